@@ -1,207 +1,771 @@
 /// \file
 /// \brief Definitions for board configuration functions
 #include "BoardConfig.h"
+#include "BacklogStore.h"
+#include "ConfigCache.h"
+#include "ConsoleLog.h"
 #include "debugging.h"
 #include <cctype>
+#include <cmath>
+#include <utility>
 
+// ============================================================================
+SampleFilter parseFilter(const char *Text) {
+    // skip the spaces after the comma
+    while (isspace(*Text))
+        ++Text;
+
+    if (strncmp(Text, "median", 6) == 0)
+        return FilterMedian;
+    if (strncmp(Text, "min", 3) == 0)
+        return FilterMin;
+    if (strncmp(Text, "max", 3) == 0)
+        return FilterMax;
+    if (strncmp(Text, "rms", 3) == 0)
+        return FilterRMS;
+    return FilterMean;
+}
+
+// ============================================================================
+const char *filterName(SampleFilter Filter) {
+    switch (Filter) {
+    case FilterMedian:
+        return "median";
+    case FilterMin:
+        return "min";
+    case FilterMax:
+        return "max";
+    case FilterRMS:
+        return "rms";
+    default:
+        return "mean";
+    }
+}
+
+// ============================================================================
+bool addPowerPorts(BoardSpecs &Specs, PowerInfo Power) {
+    // both ports have to be real ports that have already been configured
+    int NumPorts = Specs.Ports.size();
+    if (Power.CurrentPort < 0 || Power.CurrentPort >= NumPorts ||
+        Power.VoltagePort < 0 || Power.VoltagePort >= NumPorts ||
+        Specs.Ports[Power.CurrentPort].Power != PowerNone ||
+        Specs.Ports[Power.VoltagePort].Power != PowerNone) {
+        return false;
+    }
+
+    Power.FirstPort = Specs.Ports.size();
+
+    const char *Suffixes[POWERQUANTITIES] = {" Irms", " Vrms", " P", " S",
+                                             " PF"};
+    const char *Descriptions[POWERQUANTITIES] = {
+        "RMS current", "RMS voltage", "Real power", "Apparent power",
+        "Power factor"};
+
+    for (int i = 0; i < POWERQUANTITIES; ++i) {
+        PortInfo tmp;
+        tmp.Name = Power.Name + Suffixes[i];
+        tmp.Description = Descriptions[i];
+        tmp.Power = (PowerQuantity)(PowerIRMS + i);
+        tmp.PowerID = Specs.Powers.size();
+        tmp.SensorID = -1;
+
+        // these are computed, so there is nothing to scale or range check
+        tmp.Multiplier = 1.0f;
+        tmp.RangeFloor = -HUGE_VALF;
+        tmp.RangeCeiling = HUGE_VALF;
+
+        Specs.Ports.push_back(tmp);
+    }
+
+    Specs.Powers.push_back(Power);
+    return true;
+}
+
+// ============================================================================
 void printSpecs(BoardSpecs &Specs) {
-    printf("\r\nPossible Sensor Info: \r\n");
-    for (auto Sensor : Specs.Sensors){
-        printf("Type = %s, Unit = %s, Multiplier = %f, RangeFloor = %f, RangeCeiling = %f\r\n", Sensor.Type.c_str(), Sensor.Unit.c_str(), Sensor.Multiplier, Sensor.RangeFloor, Sensor.RangeCeiling);
+    LOGINFO("\r\nPossible Sensor Info: \r\n");
+    for (auto Sensor : Specs.Sensors) {
+        LOGINFO("Type = %s, Unit = %s, Multiplier = %f, RangeFloor = %f, "
+                "RangeCeiling = %f\r\n",
+                Sensor.Type.c_str(), Sensor.Unit.c_str(), Sensor.Multiplier,
+                Sensor.RangeFloor, Sensor.RangeCeiling);
+        LOGINFO("    Samples = %d, Filter = %s, Deadband = %f, MaxSilence = "
+                "%d\r\n",
+                Sensor.Samples, filterName(Sensor.Filter), Sensor.Deadband,
+                Sensor.MaxSilence);
     }
-    printf("\r\nBoard information\r\n");
-    printf("Network SSID = %s \r\n", Specs.NetworkSSID.c_str());
+    LOGINFO("\r\nBoard information\r\n");
+    LOGINFO("Network SSID = %s \r\n", Specs.NetworkSSID.c_str());
+
+    LOGINFO("Network Password = %s\t", Specs.NetworkPassword.c_str());
+    LOGINFO("Board name = %s\r\n", Specs.DatabaseTableName.c_str());
+
+    LOGINFO("Remote IP = %s\t", Specs.RemoteIP.c_str());
+    LOGINFO("Remote Get Request directory = %s\r\n", Specs.RemoteDir.c_str());
+
+    LOGINFO("remote http port = %d\t", Specs.RemotePort);
+
+    LOGINFO("Remote Hostname = %s\r\n", Specs.HostName.c_str());
+
+    LOGINFO("Upload encoding = %s\r\n",
+            Specs.Encoding == EncodeCBOR ? "cbor" : "get");
 
-    printf("Network Password = %s\t", Specs.NetworkPassword.c_str());
-    printf("Board name = %s\r\n",
-           Specs.DatabaseTableName.c_str());
+    LOGINFO("Backup batch size = %d bytes\t", Specs.BatchBytes);
+    LOGINFO("Keep connection open = %s\t", Specs.KeepAlive ? "yes" : "no");
+    LOGINFO("Backup requests in flight = %d\r\n", Specs.UploadLinks);
 
+    LOGINFO("Log flush every %d readings or %d seconds\r\n",
+            Specs.LogFlushRecords, Specs.LogFlushSeconds);
 
-    printf("Remote IP = %s\t", Specs.RemoteIP.c_str());
-    printf("Remote Get Request directory = %s\r\n",
+    LOGINFO("Config version = %lu\r\n", (unsigned long)Specs.ConfigVersion);
 
-           Specs.RemoteDir.c_str());
+    LOGINFO("ESP8266 UART = %u baud\t", (unsigned)Specs.UARTBaud);
+    LOGINFO("Flow control = %s\r\n", Specs.FlowControl ? "rts/cts" : "none");
 
-    printf("remote http port = %d\t", Specs.RemotePort);
+    for (auto Power : Specs.Powers) {
+        LOGINFO("Power %s: current port = %d, voltage port = %d, %d cycles at "
+                "%f Hz\r\n",
+                Power.Name.c_str(), Power.CurrentPort, Power.VoltagePort,
+                Power.Cycles, Power.Frequency);
+    }
+}
+/// Puts the name of the cache of the config file FileName in Out, which
+/// holds Size characters
+static void configCacheName(char *Out, size_t Size, const char *FileName) {
+    snprintf(Out, Size, "%s.cache", FileName);
+}
 
-    printf("Remote Hostname = %s\r\n", Specs.HostName.c_str());
+/// Puts the name that a new config file is written under in Out, which holds
+/// Size characters. It is renamed to FileName once it is all there.
+static void newConfigName(char *Out, size_t Size, const char *FileName) {
+    snprintf(Out, Size, "%s.new", FileName);
 }
+
 // ============================================================================
 BoardSpecs readSDCard(const char *FileName) {
 
     // try to open sd card
-    printf("\r\nReading from SD card...\r\n\n\n");
+    LOGINFO("\r\nReading from SD card...\r\n\n\n");
     FILE *fp = fopen(FileName, "rb");
 
+    // the board may have reset while a new config took the old one's place
+    if (fp == NULL) {
+        char NewName[80];
+        newConfigName(NewName, sizeof(NewName), FileName);
+        if (rename(NewName, FileName) == 0) {
+            LOGWARN("Using the new config in %s\r\n", NewName);
+            fp = fopen(FileName, "rb");
+        }
+    }
+
     BoardSpecs Output;
 
     if (fp != NULL) {
 
         // get file size for buffer
         fseek(fp, 0, SEEK_END);
-        size_t FileSize = ftell(fp);
-        char *Buffer = new char[FileSize + 1];
-
-        // reset file pointer and  read file
+        long FileSize = ftell(fp);
         rewind(fp);
-        fread(Buffer, sizeof(char), FileSize, fp);
-        // set \0 for Cstring compatability
-        Buffer[FileSize] = '\0';
 
-        delete[] Buffer; // clean up
+        if (FileSize < 0) {
+            LOGERROR("\nReading Failed!\r\n");
+            fclose(fp);
+            return Output;
+        }
 
-        // read config from SD card
-        rewind(fp);
-        Output = readConfigText(fp);
-        printf("\r\n %d Ports were configured\r\n", Output.Ports.size());
+        // read the whole file at once, the config is parsed in this buffer
+        char *Buffer = new char[FileSize + 1];
+        size_t Size = fread(Buffer, sizeof(char), FileSize, fp);
         fclose(fp);
 
+        // the text is only parsed if it changed since the cache was made
+        char CacheName[80];
+        configCacheName(CacheName, sizeof(CacheName), FileName);
+        uint32_t TextCRC = backlogCRC(Buffer, Size);
+
+        if (loadConfigCache(CacheName, Size, TextCRC, Output)) {
+            LOGINFO("Read the config from %s\r\n", CacheName);
+
+            // the parts of requests that only change with the config
+            encodeRequestParts(Output);
+            printSpecs(Output);
+        } else {
+            Output = readConfigText(Buffer, Size);
+            saveConfigCache(CacheName, Size, TextCRC, Output);
+        }
+        delete[] Buffer; // clean up
+        LOGINFO("\r\n %d Ports were configured\r\n", (int)Output.Ports.size());
+
     } else {
-        printf("\nReading Failed!\r\n");
+        LOGERROR("\nReading Failed!\r\n");
     }
 
     return Output;
 }
 
+/// One line of the config text. Its fields are cut out of it in place, like
+/// strtok() does, so nothing is copied until it goes into the BoardSpecs.
+struct ConfigLine {
+    int Number;  ///< line number, from 1
+    char *Start; ///< first character of the line
+    char *End;   ///< the '\0' at the end of the line
+    char *Next;  ///< where the next field starts, NULL after the last one
+};
+
+/// A Port line, which is added once every Sensor line has been read
+struct PortLine {
+    const char *Name;       ///< points into the config text
+    const char *SensorText; ///< the sensor ID as written, NULL if the line
+                            ///< was bad
+    long SensorID;
+    int Number; ///< line number
+    int Column; ///< column of the sensor ID
+};
+
+/// A Power line, which is added once every Port line has been read. Its ports
+/// are numbered by the order of the Port lines.
+struct PowerLine {
+    PowerInfo Power;
+    int Number; ///< line number
+};
+
+/// The lines that refer to lines that can come after them
+struct ConfigRefs {
+    vector<PortLine> Ports;
+    vector<PowerLine> Powers;
+};
+
+/// Says what is wrong with the config text at At, which is in Line
+static void configError(const ConfigLine &Line, const char *At,
+                        const char *Problem, const char *What) {
+    LOGWARN("Config line %d, column %d: %s %s\r\n", Line.Number,
+            (int)(At - Line.Start) + 1, Problem, What);
+}
 
-// ============================================================================
-BoardSpecs readConfigText(FILE *fp) {
-    BoardSpecs Specs;
-    Specs.Ports.reserve(10);   // reserve space for ports
-    Specs.Sensors.reserve(10); // and sensor types
+/// \returns Text without the spaces around it, which are cut off in place
+static char *trimField(char *Text) {
+    while (isspace((unsigned char)*Text))
+        ++Text;
 
-    int prtCnt = 0; // # of ports
+    char *End = Text + strlen(Text);
+    while (End > Text && isspace((unsigned char)End[-1]))
+        --End;
+    *End = '\0';
+    return Text;
+}
 
-    // temporary buffer
-    char Buffer[BUFFLEN];
+/// Cuts the next comma separated field out of Line. Last takes the rest of
+/// the line, commas and all.
+/// \returns the field without the spaces around it, or NULL if the line has
+/// no more
+static char *nextField(ConfigLine &Line, bool Last = false) {
+    char *Field = Line.Next;
+    if (Field == NULL)
+        return NULL;
+
+    char *Comma = Last ? NULL : strchr(Field, ',');
+    if (Comma != NULL) {
+        *Comma = '\0';
+        Line.Next = Comma + 1;
+    } else {
+        Line.Next = NULL;
+    }
+    return trimField(Field);
+}
 
-    // read through and get sensor ids before getting the port information
-    while (fgets(Buffer, BUFFLEN, fp) != NULL) {
+/// \returns true if Field was written, and isn't empty
+static bool given(const char *Field) { return Field != NULL && *Field != '\0'; }
 
-        // if the line has 'Sensor' in it, then get the sensor info from it
-        if (strstr(Buffer, "Sensor") && Buffer[0] == 'S') {
-            SensorInfo tmp;
+/// Copies Field into Value.
+/// \returns false, and says so, if it isn't there
+static bool readText(const ConfigLine &Line, const char *Field,
+                     const char *What, string &Value) {
+    if (!given(Field)) {
+        configError(Line, Field != NULL ? Field : Line.End, "missing", What);
+        return false;
+    }
+    Value = Field;
+    return true;
+}
 
-            // get the id number
-            strtok(Buffer, ":"); // get past the :
+/// Reads Field as a whole number into Value. Value is left alone if Field
+/// isn't there, which is only a mistake if it is Needed.
+/// \returns false, and says so, if it is a mistake
+static bool readInt(const ConfigLine &Line, const char *Field,
+                    const char *What, bool Needed, long &Value) {
+    if (!given(Field)) {
+        if (Needed)
+            configError(Line, Field != NULL ? Field : Line.End, "missing",
+                        What);
+        return !Needed;
+    }
 
-            const char token[] = ","; // token to split values
+    char *End;
+    long Number = strtol(Field, &End, 10);
+    if (*End != '\0') {
+        configError(Line, Field, "not a whole number:", What);
+        return false;
+    }
+    Value = Number;
+    return true;
+}
 
-            char *value = strtok(NULL, token);
-            tmp.Type = value;
+/// readInt() for numbers with a fraction
+static bool readFloat(const ConfigLine &Line, const char *Field,
+                      const char *What, bool Needed, float &Value) {
+    if (!given(Field)) {
+        if (Needed)
+            configError(Line, Field != NULL ? Field : Line.End, "missing",
+                        What);
+        return !Needed;
+    }
 
-            // get the unit of the sensor
-            value = strtok(NULL, token);
-            tmp.Unit = value;
+    char *End;
+    float Number = strtof(Field, &End);
+    if (*End != '\0') {
+        configError(Line, Field, "not a number:", What);
+        return false;
+    }
+    Value = Number;
+    return true;
+}
 
-            // get unit multiplier
-            value = strtok(NULL, token);
-            tmp.Multiplier = atof(value);
+/// BoardInfo:SSID,password,board name
+static void readBoardLine(BoardSpecs &Specs, ConfigLine &Line) {
+    char *SSID = nextField(Line);
+    char *Password = nextField(Line);
 
-            // get range start
-            value = strtok(NULL, token);
-            tmp.RangeFloor = atof(value);
+    // the board's name is the rest of the line
+    char *Name = nextField(Line, true);
 
-            // get range end till end of line
-            value = strtok(NULL, "\n");
-            tmp.RangeCeiling = atof(value);
+    readText(Line, SSID, "the WiFi SSID", Specs.NetworkSSID);
 
-            Specs.Sensors.push_back(tmp); // store those values
-            printf("Sensor type: %s, Unit: %s, range start: %f, range-end: %f\r\n", tmp.Type.c_str(),
-                   tmp.Unit.c_str(), tmp.RangeFloor, tmp.RangeCeiling);
-        }
+    // an open network has no password
+    if (Password != NULL)
+        Specs.NetworkPassword = Password;
+
+    readText(Line, Name, "the board's name", Specs.DatabaseTableName);
+}
+
+/// ConnInfo:IP address,port,hostname,directory,encoding
+static void readConnLine(BoardSpecs &Specs, ConfigLine &Line) {
+    char *IP = nextField(Line);
+    char *Port = nextField(Line);
+    char *Host = nextField(Line);
+    char *Dir = nextField(Line);
+    char *Encoding = nextField(Line);
+
+    readText(Line, IP, "the server's IP address", Specs.RemoteIP);
+
+    long Number = 0;
+    if (readInt(Line, Port, "the server's port", true, Number)) {
+        if (Number > 0 && Number <= UINT16_MAX)
+            Specs.RemotePort = Number;
+        else
+            configError(Line, Port, "out of range:", "the server's port");
     }
 
-    rewind(fp); // get ready to read again.
+    readText(Line, Host, "the hostname", Specs.HostName);
+    readText(Line, Dir, "the directory", Specs.RemoteDir);
 
-    while (fgets(Buffer, BUFFLEN, fp) != NULL) {
+    // the encoding is optional
+    Specs.Encoding =
+        Encoding != NULL && strstr(Encoding, "cbor") ? EncodeCBOR : EncodeGet;
+}
 
-        const char *s = ":";
+/// Upload:batch size,connection,links
+static void readUploadLine(BoardSpecs &Specs, ConfigLine &Line) {
+    char *Batch = nextField(Line);
+    char *Connection = nextField(Line);
+    char *Links = nextField(Line);
 
-        // save the remote connection info
-        if (Buffer[0] == 'C' && strstr(Buffer, "ConnInfo")) {
+    long Number = 0;
+    if (readInt(Line, Batch, "the batch size", false, Number) && Number >= 0)
+        Specs.BatchBytes = Number;
 
-            // we don't need the first token
-            char *tmp = strtok(Buffer, s);
+    // keep the connection open if keepalive is the next value
+    Specs.KeepAlive = Connection != NULL && strstr(Connection, "keepalive");
 
-            Specs.RemoteIP = strtok(NULL, ",");
+    // and how many requests can wait for responses at once
+    Number = 0;
+    if (readInt(Line, Links, "the number of links", false, Number) &&
+        Number > 0)
+        Specs.UploadLinks = Number;
+}
 
-            // make sure there is a digit to convert, and set an error value
-            tmp = strtok(NULL, ",");
-            if (isdigit(tmp[0])) {
-                Specs.RemotePort = atoi(tmp);
-            } else {
-                Specs.RemotePort = 0;
-            }
+/// UART:baud rate,flow control
+static void readUARTLine(BoardSpecs &Specs, ConfigLine &Line) {
+    char *Baud = nextField(Line);
+    char *Flow = nextField(Line);
 
-            Specs.HostName = strtok(NULL, ",");
+    long Number = 0;
+    if (readInt(Line, Baud, "the baud rate", true, Number) && Number > ESPBAUD)
+        Specs.UARTBaud = Number;
 
-            Specs.RemoteDir = strtok(NULL, "\n");
-        }
+    // RTS/CTS flow control if rtscts is the next value
+    Specs.FlowControl = Flow != NULL && strstr(Flow, "rtscts");
+}
+
+/// Logging:readings,seconds
+static void readLoggingLine(BoardSpecs &Specs, ConfigLine &Line) {
+    char *Records = nextField(Line);
+    char *Seconds = nextField(Line);
+
+    long Number = 0;
+    if (readInt(Line, Records, "the number of readings", false, Number) &&
+        Number > 0)
+        Specs.LogFlushRecords = Number;
+
+    Number = 0;
+    if (readInt(Line, Seconds, "the number of seconds", false, Number) &&
+        Number >= 0)
+        Specs.LogFlushSeconds = Number;
+}
+
+/// Version:number
+static void readVersionLine(BoardSpecs &Specs, ConfigLine &Line) {
+    char *Version = nextField(Line);
+
+    long Number = 0;
+    if (readInt(Line, Version, "the config version", true, Number) &&
+        Number >= 0)
+        Specs.ConfigVersion = Number;
+}
+
+/// Sensor:type,unit,multiplier,range start,range end,samples,filter,deadband,
+/// max silence
+static void readSensorLine(BoardSpecs &Specs, ConfigLine &Line) {
+    SensorInfo Sensor;
+    Sensor.ID = Specs.Sensors.size();
+
+    char *Type = nextField(Line);
+    char *Unit = nextField(Line);
+    char *Multiplier = nextField(Line);
+    char *Floor = nextField(Line);
+    char *Ceiling = nextField(Line);
+    char *Samples = nextField(Line);
+    char *Filter = nextField(Line);
+    char *Deadband = nextField(Line);
+    char *MaxSilence = nextField(Line);
+
+    // the optional values are only used if they are more than 0
+    long Burst = 0;
+    long Silence = 0;
+    float Band = 0.0f;
+
+    bool Good =
+        readText(Line, Type, "the sensor type", Sensor.Type) &&
+        readText(Line, Unit, "the unit", Sensor.Unit) &&
+        readFloat(Line, Multiplier, "the multiplier", true,
+                  Sensor.Multiplier) &&
+        readFloat(Line, Floor, "the start of the range", true,
+                  Sensor.RangeFloor) &&
+        readFloat(Line, Ceiling, "the end of the range", false,
+                  Sensor.RangeCeiling) &&
+        readInt(Line, Samples, "the number of samples", false, Burst) &&
+        readFloat(Line, Deadband, "the deadband", false, Band) &&
+        readInt(Line, MaxSilence, "the max silence", false, Silence);
+
+    // a bad line still takes up its sensor ID, so the sensors after it keep
+    // theirs. Its ports are skipped, like the ports of a multiplier of 0.
+    if (!Good) {
+        Sensor.Multiplier = 0.0f;
+    }
+
+    if (Burst > 0) {
+        Sensor.Samples = Burst > SAMPLEMAXBURST ? SAMPLEMAXBURST : Burst;
+    }
+    if (given(Filter)) {
+        Sensor.Filter = parseFilter(Filter);
+    }
+    if (Band > 0.0f) {
+        Sensor.Deadband = Band;
+    }
+    if (Silence > 0) {
+        Sensor.MaxSilence = Silence > UINT16_MAX ? UINT16_MAX : Silence;
+    }
+
+    Specs.Sensors.push_back(Sensor);
+}
+
+/// Port:name,sensor ID
+static void readPortLine(ConfigRefs &Refs, ConfigLine &Line) {
+    PortLine Port;
+    Port.Number = Line.Number;
+
+    char *Name = nextField(Line);
+    char *Sensor = nextField(Line);
+    Port.Name = Name != NULL ? Name : "";
+    Port.Column = (int)((Sensor != NULL ? Sensor : Line.End) - Line.Start) + 1;
+
+    // a bad line still takes up its number, which Power lines refer to
+    Port.SensorText = NULL;
+    if (!given(Name)) {
+        configError(Line, Name != NULL ? Name : Line.End, "missing",
+                    "the port's name");
+    } else if (readInt(Line, Sensor, "the sensor ID", true, Port.SensorID)) {
+        Port.SensorText = Sensor;
+    }
+
+    Refs.Ports.push_back(Port);
+}
+
+/// Power:name,current port,voltage port,cycles,frequency
+static void readPowerLine(ConfigRefs &Refs, ConfigLine &Line) {
+    PowerLine Power;
+    Power.Number = Line.Number;
+
+    char *Name = nextField(Line);
+    char *Current = nextField(Line);
+    char *Voltage = nextField(Line);
+    char *Cycles = nextField(Line);
+    char *Frequency = nextField(Line);
+
+    long CurrentPort = -1;
+    long VoltagePort = -1;
+    long Count = 0;
+    float Hertz = 0.0f;
+
+    if (!readText(Line, Name, "the power's name", Power.Power.Name) ||
+        !readInt(Line, Current, "the current port", true, CurrentPort) ||
+        !readInt(Line, Voltage, "the voltage port", true, VoltagePort) ||
+        !readInt(Line, Cycles, "the number of cycles", false, Count) ||
+        !readFloat(Line, Frequency, "the frequency", false, Hertz)) {
+        return;
+    }
+
+    Power.Power.CurrentPort = CurrentPort;
+    Power.Power.VoltagePort = VoltagePort;
+
+    // the number of cycles and the frequency are optional
+    if (Count > 0) {
+        Power.Power.Cycles = Count > POWERMAXCYCLES ? POWERMAXCYCLES : Count;
+    }
+    if (Hertz > 0.0f) {
+        Power.Power.Frequency = Hertz;
+    }
+
+    Refs.Powers.push_back(Power);
+}
+
+/// Reads one line of the config text into Specs, or Refs for the lines that
+/// refer to other lines
+static void readConfigLine(BoardSpecs &Specs, ConfigRefs &Refs,
+                           ConfigLine &Line) {
+    // comments, and lines that are turned off with a *, start with something
+    // other than a letter
+    if (!isalpha((unsigned char)Line.Start[0]))
+        return;
+
+    char *Colon = strchr(Line.Start, ':');
+    if (Colon == NULL) {
+        configError(Line, Line.End, "missing", "the : after the setting");
+        return;
+    }
+    *Colon = '\0';
+    Line.Next = Colon + 1;
+
+    const char *Key = trimField(Line.Start);
+    if (strncmp(Key, "Board", 5) == 0) {
+        readBoardLine(Specs, Line);
+    } else if (strncmp(Key, "Conn", 4) == 0) {
+        readConnLine(Specs, Line);
+    } else if (strncmp(Key, "Upload", 6) == 0) {
+        readUploadLine(Specs, Line);
+    } else if (strncmp(Key, "UART", 4) == 0) {
+        readUARTLine(Specs, Line);
+    } else if (strncmp(Key, "Logging", 7) == 0) {
+        readLoggingLine(Specs, Line);
+    } else if (strncmp(Key, "Version", 7) == 0) {
+        readVersionLine(Specs, Line);
+    } else if (strncmp(Key, "Sensor", 6) == 0) {
+        readSensorLine(Specs, Line);
+    } else if (strncmp(Key, "Power", 5) == 0) {
+        readPowerLine(Refs, Line);
+    } else if (strncmp(Key, "Port", 4) == 0) {
+        readPortLine(Refs, Line);
+    } else {
+        configError(Line, Line.Start, "unknown setting", Key);
+    }
+}
 
-        // checks the character at the beginning of each line
-        if (Buffer[0] == 'B' && strstr(Buffer, "Board")) {
+/// Adds the ports of the Port lines to Specs, now that every sensor is known
+/// \returns the index in Specs.Ports of each Port line's port, -1 for the
+/// ones that were skipped
+static vector<int> addPorts(BoardSpecs &Specs, const vector<PortLine> &Lines) {
+    vector<int> Index(Lines.size(), -1);
 
-            // get past the :
-            strtok(Buffer, s);
+    for (size_t i = 0; i < Lines.size(); ++i) {
+        const PortLine &Line = Lines[i];
+
+        // the line already said what was wrong with it
+        if (Line.SensorText == NULL) {
+            continue;
+        }
+
+        if (Line.SensorID < 0 || Line.SensorID >= (long)Specs.Sensors.size()) {
+            // skip this sensor, sensor id is bad
+            LOGWARN("Config line %d, column %d: Port %s has an out of bounds "
+                    "Sensor ID= %s, skipping\r\n",
+                    Line.Number, Line.Column, Line.Name, Line.SensorText);
+            continue;
+        }
 
-            // get WIFI SSID and assign it
-            Specs.NetworkSSID = strtok(NULL, ",");
+        const SensorInfo &Sensor = Specs.Sensors[Line.SensorID];
+        if (Sensor.Multiplier == 0.0f) {
+            LOGINFO("Port %s has a multiplier of 0, skipping\r\n", Line.Name);
+            continue;
+        }
 
-            // get WIFI Password and assign it
-            Specs.NetworkPassword = strtok(NULL, ",");
+        PortInfo tmp;
+        tmp.Name = Line.Name;
+        tmp.SensorID = Line.SensorID;
+        tmp.Multiplier = Sensor.Multiplier;
 
-            // getting and assigning Database tablename
-            Specs.DatabaseTableName = strtok(NULL, "\n"); 
-        } else if (Buffer[0] == 'P' && strstr(Buffer, "Port")) { // if a port description is detected
+        tmp.Description = Sensor.Type;
+        tmp.Description.append(" in ");
+        tmp.Description.append(Sensor.Unit);
 
-            // hold a Port entry
-            // then assign them to the vector in Specs
-            PortInfo tmp;
+        tmp.RangeCeiling = Sensor.RangeCeiling;
+        tmp.RangeFloor = Sensor.RangeFloor;
 
-            ++prtCnt;
-            // skip the : 
-            strtok(Buffer, ":"); 
-            
-            // grab the port name 
-            tmp.Name = strtok(NULL, ",");
+        tmp.Samples = Sensor.Samples;
+        tmp.Filter = Sensor.Filter;
 
-            tmp.SensorID = atoi(strtok(NULL, "\n"));
+        tmp.Deadband = Sensor.Deadband;
+        tmp.MaxSilence = Sensor.MaxSilence;
 
-            if (tmp.SensorID < Specs.Sensors.size() && tmp.SensorID >= 0){
+        LOGDEBUG("Port Info: name= %s id=  %d Multiplier= %0.2f "
+                 "description=%s\r\n",
+                 tmp.Name.c_str(), tmp.SensorID, tmp.Multiplier,
+                 tmp.Description.c_str());
 
-            // get port multiplier
-                tmp.Multiplier = Specs.Sensors[ tmp.SensorID].Multiplier;
+        Index[i] = Specs.Ports.size();
+        Specs.Ports.push_back(tmp);
+    }
 
-                // get sensorname
-                tmp.Description = Specs.Sensors[ tmp.SensorID].Type;
-                tmp.Description.append(" in ");
-                tmp.Description.append(Specs.Sensors[ tmp.SensorID].Unit);
+    return Index;
+}
 
-                tmp.RangeCeiling = Specs.Sensors[tmp.SensorID].RangeCeiling;
-                tmp.RangeFloor= Specs.Sensors[tmp.SensorID].RangeFloor;
+// ============================================================================
+BoardSpecs readConfigText(char *Text, size_t Size) {
+    BoardSpecs Specs;
+    ConfigRefs Refs;
 
-            printf("Port Info: name= %s id=  %d Multiplier= %0.2f description=%s\r\n", tmp.Name.c_str(),
+    char *End = Text + Size;
+    *End = '\0';
 
-                   tmp.SensorID, tmp.Multiplier, tmp.Description.c_str());
+    // one pass over the text, a line at a time
+    ConfigLine Line;
+    Line.Number = 0;
+    for (char *Start = Text; Start < End; Start = Line.End + 1) {
+        char *Break = (char *)memchr(Start, '\n', End - Start);
 
-                if (tmp.Multiplier != 0.0f){
-                    Specs.Ports.push_back(tmp);
-                }
-                else {
+        Line.Number += 1;
+        Line.Start = Start;
+        Line.End = Break != NULL ? Break : End;
+        Line.Next = NULL;
+        *Line.End = '\0';
 
-                    printf ("Port %s has a multiplier of 0, skipping\r\n", tmp.Name.c_str());
-                }
-            }
-            else {
-                // skip this sensor, sensor id is bad
-                printf("Port %s has an out of bounds Sensor ID= %d, skipping\r\n", tmp.Name.c_str(), tmp.SensorID);
-            }
-            
+        readConfigLine(Specs, Refs, Line);
+    }
 
+    // ports refer to sensors, and power pairs to ports, so they are added
+    // once every line has been read
+    Specs.Ports.reserve(Refs.Ports.size() +
+                        POWERQUANTITIES * Refs.Powers.size());
+    vector<int> PortIndex = addPorts(Specs, Refs.Ports);
+
+    for (auto &Line : Refs.Powers) {
+        PowerInfo Power = Line.Power;
+        int Lines = PortIndex.size();
+        Power.CurrentPort = Power.CurrentPort >= 0 && Power.CurrentPort < Lines
+                                ? PortIndex[Power.CurrentPort]
+                                : -1;
+        Power.VoltagePort = Power.VoltagePort >= 0 && Power.VoltagePort < Lines
+                                ? PortIndex[Power.VoltagePort]
+                                : -1;
+
+        if (!addPowerPorts(Specs, Power)) {
+            LOGWARN("Config line %d: Power %s has an out of bounds port, "
+                    "skipping\r\n",
+                    Line.Number, Power.Name.c_str());
         }
     }
+
+    // the parts of requests that only change with the config
+    encodeRequestParts(Specs);
+
     printSpecs(Specs);
     return Specs;
 }
 
+// ============================================================================
+bool configUsable(const BoardSpecs &Specs) {
+    const char *Missing = NULL;
+    if (Specs.DatabaseTableName.empty())
+        Missing = "board name";
+    else if (Specs.RemoteIP.empty())
+        Missing = "remote IP address";
+    else if (Specs.RemotePort == 0)
+        Missing = "remote port";
+    else if (Specs.HostName.empty())
+        Missing = "remote hostname";
+    else if (Specs.RemoteDir.empty())
+        Missing = "remote directory";
+    else if (Specs.Ports.empty())
+        Missing = "port";
+
+    if (Missing != NULL) {
+        LOGERROR("The config has no %s\r\n", Missing);
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+bool installConfigText(const char *FileName, char *Text, size_t Size,
+                       uint32_t Version, BoardSpecs &Specs) {
+    uint32_t TextCRC = backlogCRC(Text, Size);
+
+    // the text is written out first, since parsing it changes it
+    char NewName[80];
+    newConfigName(NewName, sizeof(NewName), FileName);
+    FILE *fp = fopen(NewName, "wb");
+    bool Written = fp != NULL && fwrite(Text, 1, Size, fp) == Size;
+    if (fp != NULL && fclose(fp) != 0)
+        Written = false;
+    if (!Written) {
+        LOGERROR("Failed to write the new config to %s\r\n", NewName);
+        remove(NewName);
+        return false;
+    }
+
+    BoardSpecs New = readConfigText(Text, Size);
+    if (!configUsable(New)) {
+        remove(NewName);
+        return false;
+    }
+
+    // the version the server asked for is the one the board has now
+    if (New.ConfigVersion != Version) {
+        LOGWARN("Config %lu has Version:%lu in it\r\n", (unsigned long)Version,
+                (unsigned long)New.ConfigVersion);
+        New.ConfigVersion = Version;
+    }
+
+    // the board starts with the new config from now on. readSDCard() looks
+    // for the new name if the board resets in between.
+    remove(FileName);
+    if (rename(NewName, FileName) != 0) {
+        LOGERROR("Failed to replace %s with %s\r\n", FileName, NewName);
+        return false;
+    }
+
+    char CacheName[80];
+    configCacheName(CacheName, sizeof(CacheName), FileName);
+    saveConfigCache(CacheName, Size, TextCRC, New);
+
+    Specs = move(New);
+    return true;
+}
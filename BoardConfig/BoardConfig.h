@@ -18,23 +18,58 @@ using namespace std;
 /// Arbitrary length for char buffers
 #define BUFFLEN 1024
 
+/// \returns the filter named at the start of Text (mean, median, min, max or
+/// rms). Anything else is FilterMean.
+SampleFilter parseFilter(const char *Text);
+
+/// \returns the name of Filter, as it is written in the config file
+const char *filterName(SampleFilter Filter);
+
+/// Adds Power and its POWERQUANTITIES ports to Specs. Its CurrentPort and
+/// VoltagePort are indexes in Specs.Ports.
+/// \returns false if either port isn't in Specs, or is computed itself
+bool addPowerPorts(BoardSpecs &Specs, PowerInfo Power);
+
 /// Prints out most of the values of the member variables in Specs
 /// This excludes the port configuration values.
 void printSpecs(BoardSpecs &Specs);
 
 /// Tries to open the specified file to read and return the configuration.
+/// FileName.cache holds the configuration that was read last time, and is
+/// used instead of parsing the file again as long as the file is the same.
+/// \sa ConfigCache.h
 /// \returns The board's configuration
 /// \sa BoardSpecs
 BoardSpecs readSDCard(const char *FileName);
 
-/// Reads the fp and derives the board configuration from that file.
-/// This function gets the Board's ID, network SSID, network password, and
-/// database table name from the file pointer. In addition to that, it reads the
-/// number of ports and their type. All of that data is returned in a struct.
-/// \param fp The file pointer to read
+/// Derives the board configuration from the text of a config file, in one
+/// pass. It gets the Board's ID, network SSID, network password, and database
+/// table name, the sensor types and the ports, and the rest of the settings.
+/// The lines can come in any order: the Port lines are matched to the Sensor
+/// lines, and the Power lines to the Port lines, after the pass. A mistake in
+/// a line is logged with its line and column, and the value, or the line, is
+/// skipped.
+/// \param Text The config file's text. It is changed, the fields are cut out
+/// of it in place, and it has to have room for a '\0' after its Size bytes.
+/// \param Size The length of Text
 /// \returns The board's configuration
 /// \sa BoardSpecs
-BoardSpecs readConfigText(FILE *fp);
+BoardSpecs readConfigText(char *Text, size_t Size);
+
+/// \returns true if Specs has everything that the board needs to send data:
+/// the board's name, the server's address, and at least one port. Logs what
+/// is missing if it doesn't.
+bool configUsable(const BoardSpecs &Specs);
 
+/// Parses the config text in Text like readConfigText(), and if the config
+/// is usable, puts it in Specs and makes it the config file FileName, cache
+/// and all, so the board starts with it next time. The config is given
+/// Version even if its Version line says something else, and the cache keeps
+/// that, so the board doesn't fetch it again after a reset. Text is changed,
+/// and has to have room for a '\0' after its Size bytes.
+/// \returns false if the config isn't usable or couldn't be saved. Specs is
+/// left alone then.
+bool installConfigText(const char *FileName, char *Text, size_t Size,
+                       uint32_t Version, BoardSpecs &Specs);
 
 #endif // BOARDCONFIG
@@ -0,0 +1,275 @@
+/// \file
+/// \brief Implementation of the config cache
+#include "ConfigCache.h"
+#include "BacklogStore.h"
+#include "ConsoleLog.h"
+#include "debugging.h"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/// Adds the bytes of Value to Data
+template <typename T> static void putValue(vector<char> &Data, T Value) {
+    const char *Bytes = (const char *)&Value;
+    Data.insert(Data.end(), Bytes, Bytes + sizeof(Value));
+}
+
+/// Adds the length of Text and then its characters to Data
+static void putString(vector<char> &Data, const string &Text) {
+    putValue<uint32_t>(Data, Text.size());
+    Data.insert(Data.end(), Text.begin(), Text.end());
+}
+
+/// Reads the values that putValue() and putString() added, in order
+struct CacheReader {
+    const char *At;  ///< the next byte to read
+    const char *End; ///< the end of the data
+    bool Good;       ///< false once a read went past End
+};
+
+/// \returns the next value in Reader, or T() if there isn't one
+template <typename T> static T getValue(CacheReader &Reader) {
+    T Value = T();
+    if ((size_t)(Reader.End - Reader.At) < sizeof(Value)) {
+        Reader.Good = false;
+        return Value;
+    }
+    memcpy(&Value, Reader.At, sizeof(Value));
+    Reader.At += sizeof(Value);
+    return Value;
+}
+
+/// \returns the next string in Reader, or "" if there isn't one
+static string getString(CacheReader &Reader) {
+    uint32_t Length = getValue<uint32_t>(Reader);
+    if ((size_t)(Reader.End - Reader.At) < Length) {
+        Reader.Good = false;
+        return "";
+    }
+    string Text(Reader.At, Length);
+    Reader.At += Length;
+    return Text;
+}
+
+/// \returns the next count of things in Reader, 0 if it can't be right
+static uint32_t getCount(CacheReader &Reader) {
+    // every thing takes at least one byte, so this keeps a bad count from
+    // reserving memory
+    uint32_t Count = getValue<uint32_t>(Reader);
+    if (Count > (size_t)(Reader.End - Reader.At)) {
+        Reader.Good = false;
+        return 0;
+    }
+    return Count;
+}
+
+/// Adds what the config file set in Specs to Data. getSpecs() has to read it
+/// back in the same order.
+static void putSpecs(vector<char> &Data, const BoardSpecs &Specs) {
+    putString(Data, Specs.ID);
+    putString(Data, Specs.NetworkSSID);
+    putString(Data, Specs.NetworkPassword);
+    putString(Data, Specs.DatabaseTableName);
+    putString(Data, Specs.RemoteIP);
+    putString(Data, Specs.RemoteDir);
+    putString(Data, Specs.HostName);
+    putValue<uint16_t>(Data, Specs.RemotePort);
+    putValue<uint8_t>(Data, Specs.Encoding);
+    putValue<uint16_t>(Data, Specs.BatchBytes);
+    putValue<uint8_t>(Data, Specs.KeepAlive);
+    putValue<uint8_t>(Data, Specs.UploadLinks);
+    putValue<uint16_t>(Data, Specs.LogFlushRecords);
+    putValue<uint16_t>(Data, Specs.LogFlushSeconds);
+    putValue<uint32_t>(Data, Specs.UARTBaud);
+    putValue<uint8_t>(Data, Specs.FlowControl);
+    putValue<uint32_t>(Data, Specs.ConfigVersion);
+
+    putValue<uint32_t>(Data, Specs.Sensors.size());
+    for (auto &Sensor : Specs.Sensors) {
+        putValue<int32_t>(Data, Sensor.ID);
+        putString(Data, Sensor.Type);
+        putString(Data, Sensor.Unit);
+        putValue<float>(Data, Sensor.Multiplier);
+        putValue<float>(Data, Sensor.RangeFloor);
+        putValue<float>(Data, Sensor.RangeCeiling);
+        putValue<uint16_t>(Data, Sensor.Samples);
+        putValue<uint8_t>(Data, Sensor.Filter);
+        putValue<float>(Data, Sensor.Deadband);
+        putValue<uint16_t>(Data, Sensor.MaxSilence);
+    }
+
+    putValue<uint32_t>(Data, Specs.Ports.size());
+    for (auto &Port : Specs.Ports) {
+        putString(Data, Port.Name);
+        putString(Data, Port.Description);
+        putValue<float>(Data, Port.Multiplier);
+        putValue<int32_t>(Data, Port.SensorID);
+        putValue<float>(Data, Port.RangeFloor);
+        putValue<float>(Data, Port.RangeCeiling);
+        putValue<uint16_t>(Data, Port.Samples);
+        putValue<uint8_t>(Data, Port.Filter);
+        putValue<uint8_t>(Data, Port.Power);
+        putValue<int32_t>(Data, Port.PowerID);
+        putValue<float>(Data, Port.Deadband);
+        putValue<uint16_t>(Data, Port.MaxSilence);
+    }
+
+    putValue<uint32_t>(Data, Specs.Powers.size());
+    for (auto &Power : Specs.Powers) {
+        putString(Data, Power.Name);
+        putValue<int32_t>(Data, Power.CurrentPort);
+        putValue<int32_t>(Data, Power.VoltagePort);
+        putValue<uint16_t>(Data, Power.Cycles);
+        putValue<float>(Data, Power.Frequency);
+        putValue<uint32_t>(Data, Power.FirstPort);
+    }
+}
+
+/// Reads what putSpecs() wrote into Specs
+static void getSpecs(CacheReader &Reader, BoardSpecs &Specs) {
+    Specs.ID = getString(Reader);
+    Specs.NetworkSSID = getString(Reader);
+    Specs.NetworkPassword = getString(Reader);
+    Specs.DatabaseTableName = getString(Reader);
+    Specs.RemoteIP = getString(Reader);
+    Specs.RemoteDir = getString(Reader);
+    Specs.HostName = getString(Reader);
+    Specs.RemotePort = getValue<uint16_t>(Reader);
+    Specs.Encoding = (UploadEncoding)getValue<uint8_t>(Reader);
+    Specs.BatchBytes = getValue<uint16_t>(Reader);
+    Specs.KeepAlive = getValue<uint8_t>(Reader);
+    Specs.UploadLinks = getValue<uint8_t>(Reader);
+    Specs.LogFlushRecords = getValue<uint16_t>(Reader);
+    Specs.LogFlushSeconds = getValue<uint16_t>(Reader);
+    Specs.UARTBaud = getValue<uint32_t>(Reader);
+    Specs.FlowControl = getValue<uint8_t>(Reader);
+    Specs.ConfigVersion = getValue<uint32_t>(Reader);
+
+    Specs.Sensors.resize(getCount(Reader));
+    for (auto &Sensor : Specs.Sensors) {
+        Sensor.ID = getValue<int32_t>(Reader);
+        Sensor.Type = getString(Reader);
+        Sensor.Unit = getString(Reader);
+        Sensor.Multiplier = getValue<float>(Reader);
+        Sensor.RangeFloor = getValue<float>(Reader);
+        Sensor.RangeCeiling = getValue<float>(Reader);
+        Sensor.Samples = getValue<uint16_t>(Reader);
+        Sensor.Filter = (SampleFilter)getValue<uint8_t>(Reader);
+        Sensor.Deadband = getValue<float>(Reader);
+        Sensor.MaxSilence = getValue<uint16_t>(Reader);
+    }
+
+    Specs.Ports.resize(getCount(Reader));
+    for (auto &Port : Specs.Ports) {
+        Port.Name = getString(Reader);
+        Port.Description = getString(Reader);
+        Port.Multiplier = getValue<float>(Reader);
+        Port.SensorID = getValue<int32_t>(Reader);
+        Port.RangeFloor = getValue<float>(Reader);
+        Port.RangeCeiling = getValue<float>(Reader);
+        Port.Samples = getValue<uint16_t>(Reader);
+        Port.Filter = (SampleFilter)getValue<uint8_t>(Reader);
+        Port.Power = (PowerQuantity)getValue<uint8_t>(Reader);
+        Port.PowerID = getValue<int32_t>(Reader);
+        Port.Deadband = getValue<float>(Reader);
+        Port.MaxSilence = getValue<uint16_t>(Reader);
+    }
+
+    Specs.Powers.resize(getCount(Reader));
+    for (auto &Power : Specs.Powers) {
+        Power.Name = getString(Reader);
+        Power.CurrentPort = getValue<int32_t>(Reader);
+        Power.VoltagePort = getValue<int32_t>(Reader);
+        Power.Cycles = getValue<uint16_t>(Reader);
+        Power.Frequency = getValue<float>(Reader);
+        Power.FirstPort = getValue<uint32_t>(Reader);
+    }
+}
+
+/// \returns the CRC of every field of Header except the CRC itself
+static uint32_t headerCRC(const ConfigCacheHeader &Header) {
+    return backlogCRC(&Header, offsetof(ConfigCacheHeader, CRC));
+}
+
+// ============================================================================
+bool loadConfigCache(const char *FileName, uint32_t SourceSize,
+                     uint32_t SourceCRC, BoardSpecs &Specs) {
+    FILE *File = fopen(FileName, "rb");
+    if (File == NULL) {
+        return false;
+    }
+
+    ConfigCacheHeader Header;
+    bool Good = fread(&Header, sizeof(Header), 1, File) == 1 &&
+                Header.CRC == headerCRC(Header) &&
+                Header.Magic == CONFIGCACHEMAGIC &&
+                Header.Version == CONFIGCACHEVERSION &&
+                Header.SourceSize == SourceSize &&
+                Header.SourceCRC == SourceCRC;
+
+    vector<char> Data;
+    if (Good) {
+        Data.resize(Header.Size);
+        Good = fread(Data.data(), 1, Data.size(), File) == Data.size() &&
+               backlogCRC(Data.data(), Data.size()) == Header.DataCRC;
+    }
+    fclose(File);
+
+    if (!Good) {
+        LOGINFO("%s is out of date\r\n", FileName);
+        return false;
+    }
+
+    BoardSpecs Cached;
+    CacheReader Reader = {Data.data(), Data.data() + Data.size(), true};
+    getSpecs(Reader, Cached);
+    if (!Reader.Good || Reader.At != Reader.End) {
+        LOGWARN("%s doesn't match its header\r\n", FileName);
+        return false;
+    }
+
+    Specs = move(Cached);
+    return true;
+}
+
+// ============================================================================
+bool saveConfigCache(const char *FileName, uint32_t SourceSize,
+                     uint32_t SourceCRC, const BoardSpecs &Specs) {
+    vector<char> Data;
+    putSpecs(Data, Specs);
+
+    ConfigCacheHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.Magic = CONFIGCACHEMAGIC;
+    Header.Version = CONFIGCACHEVERSION;
+    Header.SourceSize = SourceSize;
+    Header.SourceCRC = SourceCRC;
+    Header.Size = Data.size();
+    Header.DataCRC = backlogCRC(Data.data(), Data.size());
+    Header.CRC = headerCRC(Header);
+
+    char NewName[80];
+    snprintf(NewName, sizeof(NewName), "%s.new", FileName);
+
+    FILE *File = fopen(NewName, "wb");
+    if (File == NULL) {
+        LOGWARN("Failed to open %s for the config cache\r\n", NewName);
+        return false;
+    }
+
+    bool Good = fwrite(&Header, sizeof(Header), 1, File) == 1 &&
+                fwrite(Data.data(), 1, Data.size(), File) == Data.size();
+    Good = fclose(File) == 0 && Good;
+
+    // the old cache is already out of date, so it can go first
+    remove(FileName);
+    if (!Good || rename(NewName, FileName) != 0) {
+        LOGWARN("Failed to write the config cache %s\r\n", FileName);
+        remove(NewName);
+        return false;
+    }
+    return true;
+}
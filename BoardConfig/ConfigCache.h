@@ -0,0 +1,55 @@
+#ifndef CONFIGCACHE_H
+#define CONFIGCACHE_H
+/// \file
+/// \brief Binary copy of the parsed config, so the board doesn't parse the
+/// config text again every time it resets.
+///
+/// The cache file holds a ConfigCacheHeader followed by the settings, sensors,
+/// ports and power pairs of a BoardSpecs. The header has the size and the
+/// CRC32 of the config text that it was made from. The text still has to be
+/// read to check them, since the SD card's files don't keep a time that can be
+/// trusted, but it isn't parsed unless it changed.
+///
+/// Only what the config file sets is cached. The parts of requests are built
+/// again by encodeRequestParts() after loading.
+
+#include "Structs.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/// Identifies a config cache file ("IACC")
+#define CONFIGCACHEMAGIC (0x43434149UL)
+
+/// Bumped whenever the layout of the file changes, or readConfigText() reads
+/// the same text differently, so old caches are parsed again
+#define CONFIGCACHEVERSION (2)
+
+/// Header at the start of the cache file
+struct ConfigCacheHeader {
+    uint32_t Magic;      ///< Always CONFIGCACHEMAGIC
+    uint16_t Version;    ///< Always CONFIGCACHEVERSION
+    uint16_t Reserved;   ///< 0
+    uint32_t SourceSize; ///< bytes in the config text
+    uint32_t SourceCRC;  ///< CRC32 of the config text
+    uint32_t Size;       ///< bytes of settings after the header
+    uint32_t DataCRC;    ///< CRC32 of the bytes after the header
+    uint32_t CRC;        ///< CRC32 of every field above
+};
+
+/// Reads the config in FileName into Specs, if it was made from config text
+/// with SourceSize bytes and a CRC32 of SourceCRC.
+/// \returns false if the file isn't there, is damaged or is out of date.
+/// Specs is left alone then.
+bool loadConfigCache(const char *FileName, uint32_t SourceSize,
+                     uint32_t SourceCRC, BoardSpecs &Specs);
+
+/// Writes the config in Specs to FileName, made from config text with
+/// SourceSize bytes and a CRC32 of SourceCRC. The file is written under
+/// another name first, so a reset while it is written leaves no cache rather
+/// than half of one.
+/// \returns true if it was written
+bool saveConfigCache(const char *FileName, uint32_t SourceSize,
+                     uint32_t SourceCRC, const BoardSpecs &Specs);
+
+#endif // CONFIGCACHE_H
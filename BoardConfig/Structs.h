@@ -4,10 +4,45 @@
 ///  \brief Has the structs that store the board's information.
 
 #include "mbed.h"
+#include <ctime>
 #include <string>
 #include <vector>
 using namespace std;
 
+/// Baud rate that the ESP8266's UART starts at
+#define ESPBAUD (115200)
+
+/// Most ADC readings that can be taken for one port reading
+#define SAMPLEMAXBURST (256)
+
+/// How a burst of ADC readings is turned into one port reading
+enum SampleFilter {
+    FilterMean,   ///< average of the burst
+    FilterMedian, ///< middle reading of the burst, ignores spikes
+    FilterMin,    ///< lowest reading of the burst
+    FilterMax,    ///< highest reading of the burst
+    FilterRMS     ///< root mean square of the burst, DC offset included.
+                  ///< The burst is far shorter than a mains cycle, so AC
+                  ///< signals need a PowerInfo pair instead.
+};
+
+/// Quantities computed from a pair of current and voltage ports. Each one is
+/// reported as its own port.
+enum PowerQuantity {
+    PowerNone,     ///< a port that is connected to a pin
+    PowerIRMS,     ///< RMS current
+    PowerVRMS,     ///< RMS voltage
+    PowerReal,     ///< real power, the mean of current times voltage
+    PowerApparent, ///< apparent power, RMS current times RMS voltage
+    PowerFactor    ///< real power divided by apparent power
+};
+
+/// Number of ports that each PowerInfo adds
+#define POWERQUANTITIES (5)
+
+/// Most mains cycles that a PowerInfo can sample
+#define POWERMAXCYCLES (60)
+
 /// Houses the information for each port
 struct PortInfo {
 
@@ -17,6 +52,10 @@ struct PortInfo {
     /// The value of the port, read from a sensor.
     float Value;
 
+    /// The ADC code that Value was converted from, or -1 if Value did not come
+    /// straight from one ADC reading.
+    int32_t Raw;
+
     /// Port description
     string Description;
 
@@ -30,11 +69,50 @@ struct PortInfo {
 
     float RangeCeiling; ///< Any port reading above this is cosidered an error.
 
+    /// Number of ADC readings taken each time the port is read
+    uint16_t Samples;
+
+    /// How the readings are combined into Value
+    SampleFilter Filter;
+
+    /// What this port reports if it is computed from a pair of ports
+    PowerQuantity Power;
+
+    /// Index in BoardSpecs::Powers of the pair this port is computed from
+    int PowerID;
+
+    /// The port is only sent or logged when Value has moved more than this
+    /// since it was last reported. 0 reports every reading.
+    float Deadband;
+
+    /// Most seconds between reports, even if Value has not moved. 0 means no
+    /// limit.
+    uint16_t MaxSilence;
+
+    /// Whether Value is sent or logged this time, see reported()
+    bool Report;
+
+    /// The last Value that was reported
+    float LastValue;
+
+    /// BoardSpecs::SampleTime of the last report, 0 if there has not been one
+    time_t LastReport;
+
+    /// "&Port_ID[]=Name&Value[]=", so requests can be built without putting
+    /// the pieces together every time. Set by encodeRequestParts().
+    string ReqField;
+
+    /// \returns true if the port is active and its Value should be sent or
+    /// logged
+    bool reported() const { return Multiplier != 0.0f && Report; }
+
     /// Default Constructor.
     /// Sets all string values to "", integers to 0, and floats to 0.0
     PortInfo()
-        : Name(""), Value(0.0), Description(""), Multiplier(0.0), SensorID(0),
-           RangeFloor(0.0), RangeCeiling(0.0) {}
+        : Name(""), Value(0.0), Raw(-1), Description(""), Multiplier(0.0), SensorID(0),
+           RangeFloor(0.0), RangeCeiling(0.0), Samples(1), Filter(FilterMean),
+           Power(PowerNone), PowerID(-1), Deadband(0.0), MaxSilence(0),
+           Report(true), LastValue(0.0), LastReport(0), ReqField("") {}
 };
 
 /// Stores information regarding specific sensors
@@ -52,9 +130,46 @@ struct SensorInfo {
 
     float RangeCeiling; ///< Any port reading above this is cosidered an error.
 
+    uint16_t Samples; ///< ADC readings per port reading, 1 to SAMPLEMAXBURST
+
+    SampleFilter Filter; ///< How the ADC readings are combined
+
+    float Deadband; ///< Smallest change in a reading that is reported
+
+    uint16_t MaxSilence; ///< Most seconds between reports, 0 for no limit
+
     SensorInfo()
         : ID(0), Type("No Sensor"), Unit("No Unit"), Multiplier(0.0),
-          RangeFloor(0.0), RangeCeiling(0) {}
+          RangeFloor(0.0), RangeCeiling(0), Samples(1), Filter(FilterMean),
+          Deadband(0.0), MaxSilence(0) {}
+};
+
+/// A current port and a voltage port that are sampled together over whole
+/// mains cycles to compute power.
+struct PowerInfo {
+    string Name; ///< Start of the names of the ports that this adds
+
+    int CurrentPort; ///< Index in BoardSpecs::Ports of the current port
+
+    int VoltagePort; ///< Index in BoardSpecs::Ports of the voltage port
+
+    uint16_t Cycles; ///< Number of mains cycles to sample
+
+    float Frequency; ///< Mains frequency in Hz
+
+    /// Index in BoardSpecs::Ports of the first of the POWERQUANTITIES ports
+    /// that hold the results
+    unsigned int FirstPort;
+
+    PowerInfo()
+        : Name(""), CurrentPort(-1), VoltagePort(-1), Cycles(10),
+          Frequency(60.0f), FirstPort(0) {}
+};
+
+/// How port readings are encoded in requests to the server
+enum UploadEncoding {
+    EncodeGet, ///< a GET request with the readings in the query string
+    EncodeCBOR ///< a POST request with a CBOR body, see encodeRequestParts()
 };
 
 /// Contains board properties and the ports' data and info.
@@ -89,12 +204,63 @@ struct BoardSpecs {
     /// the http port used in the GET request
     uint16_t RemotePort;
 
+    /// How readings are encoded in requests
+    UploadEncoding Encoding;
+
+    /// Most bytes to put in one request when sending backed up data.
+    /// 0 sends one sample set per request.
+    uint16_t BatchBytes;
+
+    /// Keep the connection to the server open between requests
+    bool KeepAlive;
+
+    /// Most requests with backed up data that wait for their responses at
+    /// once, each on its own link. 1 sends them one after the other.
+    uint8_t UploadLinks;
+
+    /// Write backed up data to the SD card once this many readings are
+    /// waiting in RAM. 1 writes every sample set right away.
+    uint16_t LogFlushRecords;
+
+    /// Write backed up data to the SD card once the oldest reading has waited
+    /// in RAM this many seconds. 0 means no time limit.
+    uint16_t LogFlushSeconds;
+
+    /// Fastest baud rate to run the ESP8266's UART at. setESPBaud() sets it
+    /// to the rate that it got to.
+    uint32_t UARTBaud;
+
+    /// Use the RTS and CTS lines of the ESP8266's UART above ESPBAUD
+    bool FlowControl;
+
+    /// Version of the config, from its Version line. The server asks for a
+    /// new config by sending another one, see fetchConfigTCP().
+    uint32_t ConfigVersion;
+
+    /// When the values in Ports were read, in seconds from the board's clock
+    time_t SampleTime;
+
     /// The collection of ports and their information
     vector<PortInfo> Ports;
 
     /// Collection of possible sensor types.
     vector<SensorInfo> Sensors;
 
+    /// Port pairs that power is computed from
+    vector<PowerInfo> Powers;
+
+    /// "GET RemoteDir?Board_ID=DatabaseTableName", the start of every request.
+    /// Set by encodeRequestParts().
+    string ReqStart;
+
+    /// The end of the request line and the headers. Set by
+    /// encodeRequestParts().
+    string ReqEnd;
+
+    /// CRC32 of the port names, which identifies the port table in CBOR
+    /// requests. Set by encodeRequestParts().
+    uint32_t PortTable;
+
     /// Sets the number of ports for the board
     void setPortNum(unsigned int Num) { Ports.resize(Num); }
 
@@ -105,7 +271,11 @@ struct BoardSpecs {
     /// Sets all strings to "" and sets the initializes the vector size to 0
     BoardSpecs()
         : ID(""), NetworkSSID(""), NetworkPassword(""), DatabaseTableName(""),
-          RemoteIP(""), RemoteDir(""), RemotePort(0), Ports() {}
+          RemoteIP(""), RemoteDir(""), RemotePort(0), Encoding(EncodeGet),
+          BatchBytes(0), KeepAlive(false), UploadLinks(1), LogFlushRecords(1),
+          LogFlushSeconds(0), UARTBaud(ESPBAUD), FlowControl(false),
+          ConfigVersion(0), SampleTime(0), Ports(), ReqStart(""),
+          ReqEnd(""), PortTable(0) {}
 };
 
 #endif // STRUCTS
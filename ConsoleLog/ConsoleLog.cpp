@@ -0,0 +1,213 @@
+/// \file
+/// \brief Implementation of the console log
+#include "ConsoleLog.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+
+using namespace std;
+
+/// Set in LogFlags when there is something in the ring
+#define LOGREADY (0x01)
+
+/// How often one message has been logged lately
+struct RepeatSlot {
+    const char *Format; ///< the message, NULL if the slot is free
+    uint64_t Since;     ///< Kernel::get_ms_count() when its window started
+    uint32_t Count;     ///< times it was logged in the window
+    uint32_t LeftOut;   ///< times it was left out in the window
+};
+
+/// Messages waiting for the console. Head is where the next byte goes and
+/// Tail the next one to write; the ring is empty when they are equal, so it
+/// holds one byte less than its size.
+static char Ring[LOGBUFFERSIZE];
+static size_t Head = 0;
+static size_t Tail = 0;
+
+/// Messages that didn't fit in the ring since the last one that did
+static uint32_t Dropped = 0;
+
+static RepeatSlot Repeats[LOGREPEATSLOTS];
+
+/// Guards everything above
+static Mutex LogLock;
+
+/// Wakes up the log thread
+static EventFlags LogFlags;
+
+static Thread LogThread(osPriorityLow, LOGSTACKSIZE);
+static bool Started = false;
+
+/// Room for one message, only used with LogLock held
+static char Line[LOGLINEMAX];
+
+/// \returns the bytes that fit in the ring
+static size_t ringSpace() {
+    return (Tail + LOGBUFFERSIZE - Head - 1) % LOGBUFFERSIZE;
+}
+
+/// Adds Length bytes of Text to the ring if they fit.
+/// \returns false if they don't
+static bool ringPut(const char *Text, size_t Length) {
+    if (Length > ringSpace())
+        return false;
+
+    for (size_t i = 0; i < Length; ++i) {
+        Ring[Head] = Text[i];
+        Head = (Head + 1) % LOGBUFFERSIZE;
+    }
+    return true;
+}
+
+/// Sends the Length bytes in Line to the console: straight away before the
+/// log thread starts, and through the ring after
+static void emit(size_t Length) {
+    if (!Started) {
+        fwrite(Line, 1, Length, stdout);
+        return;
+    }
+
+    if (Dropped > 0) {
+        // say so before anything else goes out, if both fit
+        char Note[64];
+        size_t NoteLength =
+            snprintf(Note, sizeof(Note),
+                     "(%lu log messages dropped, the console is too slow)\r\n",
+                     (unsigned long)Dropped);
+        if (NoteLength + Length > ringSpace()) {
+            Dropped += 1;
+            return;
+        }
+        ringPut(Note, NoteLength);
+        Dropped = 0;
+    }
+
+    if (!ringPut(Line, Length))
+        Dropped += 1;
+}
+
+/// Says how many times the message in Slot was left out, if it was
+static void reportLeftOut(RepeatSlot &Slot) {
+    if (Slot.LeftOut > 0) {
+        size_t Length =
+            snprintf(Line, sizeof(Line),
+                     "(%lu repeats of a message were left out)\r\n",
+                     (unsigned long)Slot.LeftOut);
+        emit(min(Length, sizeof(Line) - 1));
+    }
+}
+
+/// \returns the slot that counts Format, starting a new one in the slot
+/// that has gone the longest if it has none
+static RepeatSlot &repeatSlot(const char *Format, uint64_t Now) {
+    RepeatSlot *Oldest = &Repeats[0];
+    for (int i = 0; i < LOGREPEATSLOTS; ++i) {
+        if (Repeats[i].Format == Format)
+            return Repeats[i];
+        if (Repeats[i].Format == NULL ||
+            (Oldest->Format != NULL && Repeats[i].Since < Oldest->Since))
+            Oldest = &Repeats[i];
+    }
+
+    reportLeftOut(*Oldest);
+    Oldest->Format = Format;
+    Oldest->Since = Now;
+    Oldest->Count = 0;
+    Oldest->LeftOut = 0;
+    return *Oldest;
+}
+
+/// Body of the log thread. Writes the ring to the console a piece at a time,
+/// so the ring isn't locked while the console is written.
+static void logThread() {
+    while (true) {
+        LogFlags.wait_any(LOGREADY);
+
+        while (true) {
+            char Piece[64];
+            size_t Length = 0;
+
+            LogLock.lock();
+            while (Tail != Head && Length < sizeof(Piece)) {
+                Piece[Length++] = Ring[Tail];
+                Tail = (Tail + 1) % LOGBUFFERSIZE;
+            }
+            LogLock.unlock();
+
+            if (Length == 0)
+                break;
+            fwrite(Piece, 1, Length, stdout);
+        }
+        fflush(stdout);
+    }
+}
+
+/// Formats a message into the ring. Limit leaves it out if it has been
+/// repeated too often.
+static void logArgs(bool Limit, const char *Format, va_list Args) {
+    LogLock.lock();
+
+    // setup prints everything once, only repeats after it are left out
+    bool LeaveOut = false;
+    if (Started && Limit) {
+        uint64_t Now = Kernel::get_ms_count();
+        RepeatSlot &Slot = repeatSlot(Format, Now);
+        if (Now - Slot.Since >= LOGREPEATMS) {
+            reportLeftOut(Slot);
+            Slot.Since = Now;
+            Slot.Count = 0;
+            Slot.LeftOut = 0;
+        }
+
+        LeaveOut = Slot.Count >= LOGREPEATMAX;
+        if (LeaveOut)
+            Slot.LeftOut += 1;
+        else
+            Slot.Count += 1;
+    }
+
+    if (!LeaveOut) {
+        int Length = vsnprintf(Line, sizeof(Line), Format, Args);
+
+        // a message that is cut off still ends its line
+        if (Length >= (int)sizeof(Line)) {
+            Length = sizeof(Line) - 1;
+            Line[Length - 2] = '\r';
+            Line[Length - 1] = '\n';
+        }
+        if (Length > 0)
+            emit(Length);
+    }
+
+    LogLock.unlock();
+    if (Started)
+        LogFlags.set(LOGREADY);
+}
+
+// ============================================================================
+void logMessage(const char *Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    logArgs(true, Format, Args);
+    va_end(Args);
+}
+
+// ============================================================================
+void printMessage(const char *Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    logArgs(false, Format, Args);
+    va_end(Args);
+}
+
+// ============================================================================
+void startLogThread() {
+    LogLock.lock();
+    fflush(stdout);
+    Started = true;
+    LogLock.unlock();
+
+    LogThread.start(&logThread);
+}
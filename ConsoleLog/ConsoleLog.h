@@ -0,0 +1,93 @@
+#ifndef CONSOLELOG_H
+#define CONSOLELOG_H
+/// \file
+/// \brief Leveled logging that never waits for the console.
+///
+/// The console runs at 9600 baud, so a printf() of one line holds up the
+/// thread that calls it for tens of ms. The LOG macros format the message
+/// into a ring buffer instead, and a low priority thread writes the ring to
+/// the console whenever nothing else needs the CPU. A message that doesn't
+/// fit in the ring is dropped and counted. Messages below LOGLEVEL are
+/// compiled out, arguments and all, and a message that is logged more than
+/// LOGREPEATMAX times in LOGREPEATMS ms is left out until the time is up.
+///
+/// The LOG macros can be called from any thread, but not from an interrupt.
+
+#include "mbed.h"
+
+/// Levels of the LOG macros. LOGLEVEL turns on the ones up to it.
+#define LOGLEVELERROR (1) ///< something failed, LOGERROR()
+#define LOGLEVELWARN (2)  ///< something went wrong but was handled, LOGWARN()
+#define LOGLEVELINFO (3)  ///< what the board is doing, LOGINFO()
+#define LOGLEVELDEBUG (4) ///< every reading and response, and the AT
+                          ///< commands, LOGDEBUG()
+
+/// The most detailed level that is compiled in. The build profiles set it:
+/// develop.json to LOGLEVELINFO and developmod.json to LOGLEVELDEBUG.
+#ifndef LOGLEVEL
+#define LOGLEVEL LOGLEVELWARN
+#endif
+
+/// Bytes in the ring that the console is written from
+#define LOGBUFFERSIZE (2048)
+
+/// Longest message, longer ones are cut off
+#define LOGLINEMAX (160)
+
+/// A message is logged at most LOGREPEATMAX times in LOGREPEATMS ms. The
+/// message is told apart by its format string, so the same message for
+/// every port counts together.
+#define LOGREPEATMAX (20)
+#define LOGREPEATMS (10000)
+
+/// Number of messages that the repeats are kept for at once
+#define LOGREPEATSLOTS (8)
+
+/// stack size of the thread that writes to the console, in bytes
+#define LOGSTACKSIZE (1024)
+
+#if LOGLEVEL >= LOGLEVELERROR
+#define LOGERROR(...) logMessage(__VA_ARGS__)
+#else
+#define LOGERROR(...) ((void)0)
+#endif
+
+#if LOGLEVEL >= LOGLEVELWARN
+#define LOGWARN(...) logMessage(__VA_ARGS__)
+#else
+#define LOGWARN(...) ((void)0)
+#endif
+
+#if LOGLEVEL >= LOGLEVELINFO
+#define LOGINFO(...) logMessage(__VA_ARGS__)
+#else
+#define LOGINFO(...) ((void)0)
+#endif
+
+#if LOGLEVEL >= LOGLEVELDEBUG
+#define LOGDEBUG(...) logMessage(__VA_ARGS__)
+#else
+#define LOGDEBUG(...) ((void)0)
+#endif
+
+/// What ATCmdParser::debug_on() is set to. The parser prints the AT traffic
+/// straight to the console, so it is only on in debug builds.
+#define ATDEBUG (LOGLEVEL >= LOGLEVELDEBUG)
+
+/// Logs output that was asked for, like the performance counters. It is
+/// there at every level and is never left out for repeating.
+#define LOGPRINT(...) printMessage(__VA_ARGS__)
+
+/// Formats a message, printf style, into the ring. Before startLogThread()
+/// is called the message is printed right away instead, so setup output
+/// isn't lost.
+void logMessage(const char *Format, ...) MBED_PRINTF(1, 2);
+
+/// logMessage() without the limit on repeats
+void printMessage(const char *Format, ...) MBED_PRINTF(1, 2);
+
+/// Starts the thread that writes the ring to the console. Everything logged
+/// from then on goes through the ring.
+void startLogThread();
+
+#endif // CONSOLELOG_H
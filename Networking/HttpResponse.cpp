@@ -0,0 +1,358 @@
+/// \file
+/// \brief Implementation of the HTTP response parser
+#include "HttpResponse.h"
+
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+/// A directive that the server can put in the body of a response
+struct HttpDirective {
+    const char *Name;
+
+    /// Stores the directive's Value in Result
+    void (*Read)(HttpResult &Result, const char *Value);
+};
+
+/// Reads samplerate="seconds", the board's new sampling interval
+static void readSampleRate(HttpResult &Result, const char *Value) {
+    if (isdigit((unsigned char)Value[0])) {
+        Result.SampleRate = atof(Value);
+        Result.HasRate = true;
+    }
+}
+
+/// Reads porttable="hex", the port table that the server has the names of.
+/// "unknown" comes out as 0.
+static void readPortTable(HttpResult &Result, const char *Value) {
+    Result.PortTable = strtoul(Value, NULL, 16);
+    Result.HasTable = true;
+}
+
+/// Reads configversion="number", the version of the config that the server
+/// has for the board
+static void readConfigVersion(HttpResult &Result, const char *Value) {
+    if (isdigit((unsigned char)Value[0])) {
+        Result.ConfigVersion = strtoul(Value, NULL, 10);
+        Result.HasConfig = true;
+    }
+}
+
+/// The directives that bodies are searched for. A new one only needs a line
+/// here and a field in HttpResult.
+static const HttpDirective Directives[] = {
+    {"samplerate", &readSampleRate},
+    {"porttable", &readPortTable},
+    {"configversion", &readConfigVersion},
+};
+
+/// Makes Text lower case, since header names and values are not case
+/// sensitive
+static void lowerCase(char *Text) {
+    for (; *Text; ++Text)
+        *Text = tolower((unsigned char)*Text);
+}
+
+// ============================================================================
+HttpResponse::HttpResponse() : Body(NULL), BodySize(0) { reset(); }
+
+// ============================================================================
+void HttpResponse::reset() {
+    Part = PartStatus;
+    Directive = DirectiveName;
+    memset(&Result, 0, sizeof(Result));
+    Result.ContentLength = -1;
+    Started = false;
+    clearField();
+    Field = 0;
+    LineLength = 0;
+    Left = 0;
+    BodyLength = 0;
+    BodyCut = false;
+}
+
+// ============================================================================
+void HttpResponse::keepBody(char *Buf, size_t Size) {
+    Body = Buf;
+    BodySize = Buf != NULL ? Size : 0;
+    BodyLength = 0;
+    BodyCut = false;
+}
+
+// ============================================================================
+void HttpResponse::clearField() {
+    NameLength = 0;
+    Name[0] = 0;
+    NameTooLong = false;
+    ValueLength = 0;
+    Value[0] = 0;
+}
+
+// ============================================================================
+void HttpResponse::addName(char C) {
+    if (NameLength < HTTPNAMEMAX) {
+        Name[NameLength++] = C;
+        Name[NameLength] = 0;
+    } else {
+        NameTooLong = true;
+    }
+}
+
+// ============================================================================
+void HttpResponse::addValue(char C) {
+    if (ValueLength < HTTPVALUEMAX) {
+        Value[ValueLength++] = C;
+        Value[ValueLength] = 0;
+    }
+}
+
+// ============================================================================
+void HttpResponse::feed(const char *Data, size_t Size) {
+    if (Size > 0)
+        Started = true;
+
+    for (size_t i = 0; i < Size; ++i) {
+        char C = Data[i];
+        switch (Part) {
+        case PartStatus:
+            statusByte(C);
+            break;
+
+        case PartHeaders:
+        case PartTrailers:
+            headerByte(C);
+            break;
+
+        case PartBody:
+            bodyByte(C);
+            if (Left > 0 && --Left == 0)
+                Part = PartDone;
+            break;
+
+        case PartChunkSize:
+            chunkSizeByte(C);
+            break;
+
+        case PartChunkData:
+            bodyByte(C);
+            if (--Left == 0)
+                Part = PartChunkEnd;
+            break;
+
+        case PartChunkEnd:
+            if (C == '\n') {
+                Part = PartChunkSize;
+                Field = 0;
+                LineLength = 0;
+            } else if (C != '\r') {
+                Part = PartBad;
+            }
+            break;
+
+        case PartDone:
+        case PartBad:
+            return;
+        }
+    }
+}
+
+// ============================================================================
+void HttpResponse::statusByte(char C) {
+    if (C == '\r')
+        return;
+
+    if (C == '\n') {
+        if (Field == 0 || Result.Status < 100) {
+            Part = PartBad;
+        } else {
+            Part = PartHeaders;
+            clearField();
+            Field = 0;
+            LineLength = 0;
+        }
+        return;
+    }
+
+    if (Field == 0) {
+        // HTTP/1.1
+        if (C != ' ') {
+            addName(C);
+        } else if (strncmp(Name, "HTTP/", 5) != 0) {
+            Part = PartBad;
+        } else {
+            Field = 1;
+        }
+    } else if (Field == 1) {
+        // 200
+        if (isdigit((unsigned char)C) && Result.Status < 100) {
+            Result.Status = Result.Status * 10 + (C - '0');
+        } else if (C == ' ') {
+            Field = 2;
+        } else {
+            Part = PartBad;
+        }
+    }
+    // the reason phrase doesn't matter
+}
+
+// ============================================================================
+void HttpResponse::headerByte(char C) {
+    if (C == '\r')
+        return;
+
+    if (C == '\n') {
+        if (LineLength == 0) {
+            // a blank line ends the headers, or the trailers
+            if (Part == PartHeaders)
+                headersDone();
+            else
+                Part = PartDone;
+            return;
+        }
+        if (Part == PartHeaders && Field == 1)
+            header();
+        clearField();
+        Field = 0;
+        LineLength = 0;
+        return;
+    }
+
+    ++LineLength;
+    if (Field == 0) {
+        if (C == ':')
+            Field = 1;
+        else
+            addName(C);
+    } else if (ValueLength > 0 || (C != ' ' && C != '\t')) {
+        addValue(C);
+    }
+}
+
+// ============================================================================
+void HttpResponse::header() {
+    if (NameTooLong)
+        return;
+    lowerCase(Name);
+    lowerCase(Value);
+
+    if (strcmp(Name, "content-length") == 0) {
+        Result.ContentLength = strtol(Value, NULL, 10);
+    } else if (strcmp(Name, "transfer-encoding") == 0) {
+        Result.Chunked = strstr(Value, "chunked") != NULL;
+    } else if (strcmp(Name, "connection") == 0) {
+        Result.Close = strstr(Value, "close") != NULL;
+    }
+}
+
+// ============================================================================
+void HttpResponse::headersDone() {
+    clearField();
+    Field = 0;
+    LineLength = 0;
+    Directive = DirectiveName;
+
+    if (Result.Status == 204 || Result.Status == 304) {
+        // these never have a body
+        Part = PartDone;
+    } else if (Result.Chunked) {
+        Part = PartChunkSize;
+        Left = 0;
+    } else if (Result.ContentLength >= 0) {
+        Left = Result.ContentLength;
+        Part = Left == 0 ? PartDone : PartBody;
+    } else {
+        // the body goes on until the server closes the connection
+        Left = -1;
+        Part = PartBody;
+    }
+}
+
+// ============================================================================
+void HttpResponse::chunkSizeByte(char C) {
+    if (C == '\r')
+        return;
+
+    if (C == '\n') {
+        if (LineLength == 0) {
+            Part = PartBad;
+        } else if (Left == 0) {
+            // the last chunk, only trailers are left
+            Part = PartTrailers;
+            clearField();
+            Field = 0;
+            LineLength = 0;
+        } else {
+            Part = PartChunkData;
+        }
+        return;
+    }
+
+    // the size is hex, and can have extensions after a ;
+    if (Field == 0 && isxdigit((unsigned char)C)) {
+        if (Left > LONG_MAX / 16) {
+            Part = PartBad;
+            return;
+        }
+        int Digit = isdigit((unsigned char)C)
+                        ? C - '0'
+                        : tolower((unsigned char)C) - 'a' + 10;
+        Left = Left * 16 + Digit;
+        ++LineLength;
+    } else if (LineLength > 0) {
+        Field = 1;
+    } else {
+        Part = PartBad;
+    }
+}
+
+// ============================================================================
+void HttpResponse::bodyByte(char C) {
+    if (Body != NULL) {
+        if (BodyLength < BodySize)
+            Body[BodyLength++] = C;
+        else
+            BodyCut = true;
+    }
+
+    switch (Directive) {
+    case DirectiveName:
+        if (isalnum((unsigned char)C) || C == '_') {
+            addName(C);
+        } else if (C == '=' && NameLength > 0 && !NameTooLong) {
+            Directive = DirectiveEquals;
+        } else {
+            clearField();
+        }
+        break;
+
+    case DirectiveEquals:
+        if (C == '"') {
+            Directive = DirectiveValue;
+        } else {
+            clearField();
+            Directive = DirectiveName;
+            if (isalnum((unsigned char)C) || C == '_')
+                addName(C);
+        }
+        break;
+
+    case DirectiveValue:
+        if (C == '"') {
+            for (size_t i = 0; i < sizeof(Directives) / sizeof(Directives[0]);
+                 ++i) {
+                if (strcmp(Name, Directives[i].Name) == 0)
+                    Directives[i].Read(Result, Value);
+            }
+            clearField();
+            Directive = DirectiveName;
+        } else if (C == '\n') {
+            // directives are on one line
+            clearField();
+            Directive = DirectiveName;
+        } else {
+            addValue(C);
+        }
+        break;
+    }
+}
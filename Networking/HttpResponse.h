@@ -0,0 +1,152 @@
+#ifndef HTTPRESPONSE_H
+#define HTTPRESPONSE_H
+/// \file
+/// \brief Parser for the server's HTTP responses, fed one piece at a time.
+///
+/// The ESP8266 hands over a response in +IPD pieces, in between other
+/// messages, so the parser keeps where it is between pieces and never holds
+/// more than one name and one value in memory. It reads the status line and
+/// the Content-Length, Transfer-Encoding and Connection headers, and takes
+/// directives out of the body as they go by. A directive is name="value"
+/// anywhere in the body, so the server's page can have other text around
+/// them.
+
+#include <cstddef>
+#include <cstdint>
+
+/// Longest header or directive name that is looked at. Longer ones are
+/// skipped.
+#define HTTPNAMEMAX (24)
+
+/// Longest header or directive value that is kept. Longer ones are cut off.
+#define HTTPVALUEMAX (32)
+
+/// What the server said in a response, as far as it has been read
+struct HttpResult {
+    int Status;         ///< status code, 0 until the status line is read
+    long ContentLength; ///< -1 if the response has no Content-Length
+    bool Chunked;       ///< the body has Transfer-Encoding: chunked
+    bool Close;         ///< the server closes the connection after this
+
+    bool HasRate;     ///< a samplerate directive came
+    float SampleRate; ///< samplerate="seconds"
+
+    bool HasTable;      ///< a porttable directive came
+    uint32_t PortTable; ///< porttable="hex", 0 for "unknown"
+
+    bool HasConfig;         ///< a configversion directive came
+    uint32_t ConfigVersion; ///< configversion="number", see fetchConfigTCP()
+};
+
+/// Reads one HTTP/1.x response. feed() takes the bytes in pieces of any
+/// size; result() has what they said so far.
+class HttpResponse {
+  public:
+    HttpResponse();
+
+    /// Starts over for the next response
+    void reset();
+
+    /// Parses the next Size bytes of the response. Bytes after the end of
+    /// the response are ignored.
+    void feed(const char *Data, size_t Size);
+
+    /// \returns true once the whole response has come: Content-Length bytes
+    /// of body, or the last chunk
+    bool complete() const { return Part == PartDone; }
+
+    /// \returns true if what came isn't an HTTP response
+    bool bad() const { return Part == PartBad; }
+
+    /// \returns true once any of the response has come
+    bool started() const { return Started; }
+
+    /// \returns what the response has said so far
+    const HttpResult &result() const { return Result; }
+
+    /// Copies the body into Buf as it comes, up to Size bytes, with the
+    /// chunks put back together. It stays on through reset() until
+    /// keepBody(NULL, 0).
+    void keepBody(char *Buf, size_t Size);
+
+    /// \returns the bytes of the body that were copied into the keepBody()
+    /// buffer
+    size_t bodyLength() const { return BodyLength; }
+
+    /// \returns true if the body didn't fit in the keepBody() buffer
+    bool bodyCut() const { return BodyCut; }
+
+  private:
+    /// Where the parser is in the response
+    enum ResponsePart {
+        PartStatus,    ///< the status line
+        PartHeaders,   ///< the header lines
+        PartBody,      ///< a body with a Content-Length, or none
+        PartChunkSize, ///< the size line of a chunk
+        PartChunkData, ///< the data of a chunk
+        PartChunkEnd,  ///< the line break after a chunk's data
+        PartTrailers,  ///< header lines after the last chunk
+        PartDone,      ///< the whole response has come
+        PartBad        ///< not an HTTP response
+    };
+
+    /// Where the body's directive search is
+    enum DirectivePart {
+        DirectiveName,   ///< reading what could be a name
+        DirectiveEquals, ///< after name=, the quote has to come next
+        DirectiveValue   ///< between the quotes
+    };
+
+    /// Parses one byte of the status line
+    void statusByte(char C);
+
+    /// Parses one byte of a header line, or of a trailer line
+    void headerByte(char C);
+
+    /// Uses the header in Name and Value
+    void header();
+
+    /// Picks how the body is read, at the end of the headers
+    void headersDone();
+
+    /// Parses one byte of the size line of a chunk
+    void chunkSizeByte(char C);
+
+    /// Looks for directives in one byte of the body
+    void bodyByte(char C);
+
+    /// Adds C to Name, or skips the name if it is too long
+    void addName(char C);
+
+    /// Adds C to Value, cutting the value off if it is too long
+    void addValue(char C);
+
+    /// Forgets the name and value that were being read
+    void clearField();
+
+    ResponsePart Part;
+    DirectivePart Directive;
+    HttpResult Result;
+    bool Started;
+
+    char Name[HTTPNAMEMAX + 1];
+    size_t NameLength;
+    bool NameTooLong; ///< the name didn't fit, so the field is skipped
+    char Value[HTTPVALUEMAX + 1];
+    size_t ValueLength;
+
+    /// Which part of the line is being read: in the status line 0 is the
+    /// version, 1 the code and 2 the reason. In header lines, 1 is the
+    /// value.
+    int Field;
+    size_t LineLength; ///< bytes of the line so far, without the line break
+
+    long Left; ///< body bytes still to come, -1 to the end of the connection
+
+    char *Body;        ///< where the body is copied, NULL if it isn't
+    size_t BodySize;   ///< size of Body
+    size_t BodyLength; ///< bytes copied into Body
+    bool BodyCut;      ///< the body didn't fit
+};
+
+#endif // HTTPRESPONSE_H
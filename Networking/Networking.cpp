@@ -1,6 +1,13 @@
 #include "Networking.h"
+#include "HttpResponse.h"
+#include "Profiling.h"
 
+#include "BacklogStore.h"
+#include "ConsoleLog.h"
 #include "debugging.h"
+
+#include <algorithm>
+#include <cmath>
 /// \file
 /// \brief Implementation for all network functions
 
@@ -11,6 +18,19 @@ const char *port_get_str = "&Port_ID[]=";
 
 const char *id_get_str = "Board_ID=";
 
+/// The string that preceeds the time of each sample in a batch
+const char *time_get_str = "&Time[]=";
+
+/// The string that preceeds the board's clock when a batch is sent. The
+/// server can line up the sample times with its own clock using it.
+const char *now_get_str = "&Now=";
+
+/// The string that preceeds the performance counters, see putPerfGet()
+const char *perf_get_str = "&Perf=";
+
+/// The string that asks for a config file, see fetchConfigTCP()
+const char *config_get_str = "&Config=";
+
 const char *get_req_start = "GET ";
 
 /// required for the `Host` HTTP header
@@ -18,26 +38,554 @@ const char *req_header = "Host: ";
 
 const char *get_req_end = "\r\n";
 
-const int response_size = 256;
+/// ends the request line of a keep-alive request
+const char *keep_alive_version = " HTTP/1.1\r\n";
+
+/// goes after the Host header of a keep-alive request
+const char *keep_alive_header = "\r\nConnection: keep-alive\r\n\r\n";
+
+const char *post_req_start = "POST ";
+
+/// goes after the Host header of a CBOR request, before the Connection value
+const char *cbor_header = "\r\nContent-Type: application/cbor\r\nConnection: ";
+
+const char *length_header = "\r\nContent-Length: ";
+
+/// One of the ESP8266's TCP connections to the server
+struct LinkState {
+    /// true while the link is connected to the server
+    bool Open;
+
+    /// set once the whole response to the last request on the link has
+    /// come, or something that isn't a response
+    bool Replied;
+
+    /// Kernel::get_ms_count() when the last request was sent, and when its
+    /// response started to come
+    uint64_t SentAt;
+    uint64_t RepliedAt;
+
+    /// Kernel::get_ms_count() when data last came on the link, so a long
+    /// response isn't cut off while it is still coming
+    uint64_t HeardAt;
+
+    /// reads the response as it comes
+    HttpResponse Reply;
+};
+
+/// State of the TCP connections to the server
+static struct {
+    /// the links, by link id
+    LinkState Links[MAXLINKS];
+
+    /// the link that the last AT+CIPSEND was for
+    int Sending;
+
+    /// set by the "link is not valid" handler
+    bool LinkInvalid;
+
+    /// set by the ERROR and FAIL handler
+    bool CommandFailed;
+
+    /// the parser that the handlers below belong to
+    ATCmdParser *Parser;
+
+    /// the parser's timeout for what is being waited for, see setTimeout()
+    unsigned int Timeout;
+
+    /// the port table that the server said it has, so CBOR requests can
+    /// leave out the port names
+    uint32_t KnownTable;
+
+    /// the config version that the server said it has for the board
+    uint32_t ServerConfig;
+
+    ConnectionStats Stats;
+} Connection;
+
+/// The WiFi connection, see wifiLinkUp()
+static struct {
+    WiFiState State;
+
+    /// Kernel::get_ms_count() when State was last heard about
+    uint64_t Heard;
+} WiFi;
+
+/// Sets the WiFi state to State, as of now
+static void setWiFiState(WiFiState State) {
+    WiFi.State = State;
+    WiFi.Heard = Kernel::get_ms_count();
+}
+
+/// Handles "WIFI CONNECTED" from the ESP8266
+static void onWiFiConnected() { setWiFiState(WiFiJoined); }
+
+/// Handles "WIFI GOT IP" from the ESP8266
+static void onWiFiGotIP() { setWiFiState(WiFiUp); }
+
+/// Handles "WIFI DISCONNECT" from the ESP8266. The links to the server go
+/// down with the WiFi.
+static void onWiFiDisconnect() {
+    setWiFiState(WiFiDown);
+    for (int Id = 0; Id < MAXLINKS; ++Id)
+        Connection.Links[Id].Open = false;
+}
+
+/// Handles "<Id>,CLOSED" from the ESP8266
+template <int Id> static void onLinkClosed() {
+    Connection.Links[Id].Open = false;
+}
+
+/// Handles "link is not valid" from the ESP8266. That comes back when
+/// sending on a link that was already closed. The ERROR after it stops the
+/// wait for the ">".
+static void onLinkInvalid() {
+    Connection.Links[Connection.Sending].Open = false;
+    Connection.LinkInvalid = true;
+}
+
+/// Sets the parser's timeout to Ms, and remembers it so that onData() can
+/// put it back
+static void setTimeout(ATCmdParser *_parser, unsigned int Ms) {
+    Connection.Timeout = Ms;
+    _parser->set_timeout(Ms);
+}
+
+/// Handles "+IPD,<link>,<length>:" from the ESP8266, which comes before
+/// <length> bytes that the server sent on a link. They go through the link's
+/// parser a few at a time, so responses of any length can come in on any
+/// link while the board waits for something else. A response can take
+/// several +IPDs.
+static void onData() {
+    ATCmdParser *_parser = Connection.Parser;
+    uint64_t Now = Kernel::get_ms_count();
+    int Id = -1;
+    int Length = 0;
+
+    _parser->set_timeout(RESPONSEGAP);
+    if (_parser->recv(",%d,%d:", &Id, &Length)) {
+        LinkState *Link = NULL;
+        if (Id >= 0 && Id < MAXLINKS)
+            Link = &Connection.Links[Id];
+        if (Link != NULL && !Link->Reply.started())
+            Link->RepliedAt = Now;
+        if (Link != NULL)
+            Link->HeardAt = Now;
+
+        // data on links that aren't used is skipped
+        char Buf[32];
+        while (Length > 0) {
+            int Size = min(Length, (int)sizeof(Buf));
+            if (_parser->read(Buf, Size) != Size)
+                break;
+            if (Link != NULL)
+                Link->Reply.feed(Buf, Size);
+            Length -= Size;
+        }
+
+        if (Link != NULL && (Link->Reply.complete() || Link->Reply.bad()))
+            Link->Replied = true;
+    }
+    _parser->set_timeout(Connection.Timeout);
+}
+
+/// Handles ERROR, FAIL and SEND FAIL from the ESP8266. The command that is
+/// waiting won't get its answer, so stop waiting for it.
+static void onCommandFailed() {
+    Connection.CommandFailed = true;
+    Connection.Parser->abort();
+}
+
+/// Response times of the AT commands. The first guesses are on the slow side
+/// of what an ESP8266 does, so the first few commands don't time out early.
+static CommandTiming Timings[ATCOMMANDS] = {
+    // name, floor, ceiling, mean, deviation
+    {"setup", 200, 3000, 20, 10},
+    {"join", 5000, 20000, 4000, 2000},
+    {"address", 200, 3000, 20, 10},
+    {"connect", 1000, 10000, 300, 150},
+    {"prompt", 200, 3000, 20, 10},
+    {"send ok", 500, 5000, 100, 50},
+    {"reply", 1000, 5000, 500, 250},
+};
+
+/// Adds a response time of Ms to the moving averages of Timing, with the
+/// gains that TCP uses for round trip times
+static void learnTiming(CommandTiming &Timing, float Ms) {
+    float Error = Ms - Timing.Mean;
+    Timing.Mean += Error / 8;
+    Timing.Deviation += (fabsf(Error) - Timing.Deviation) / 4;
+}
+
+// =============================================================================
+unsigned int commandTimeout(ATCommand Command) {
+    const CommandTiming &Timing = Timings[Command];
+    float Timeout = Timing.Mean + 4 * Timing.Deviation;
+    if (Timeout < Timing.Floor)
+        return Timing.Floor;
+    if (Timeout > Timing.Ceiling)
+        return Timing.Ceiling;
+    return Timeout;
+}
+
+// =============================================================================
+const CommandTiming &getCommandTiming(ATCommand Command) {
+    return Timings[Command];
+}
+
+static_assert(PerfATReply - PerfATSetup == CmdReply,
+              "the AT command counters go in the order of ATCommand");
+
+/// \returns the PerfCounter that times Command
+static PerfCounter commandCounter(ATCommand Command) {
+    return (PerfCounter)(PerfATSetup + Command);
+}
+
+/// Adds how Command went to its timing: answered after Ms, failed, or timed
+/// out after Ms
+static void recordTiming(ATCommand Command, bool Answered, bool Failed,
+                         unsigned int Ms) {
+    CommandTiming &Timing = Timings[Command];
+    if (Answered) {
+        Timing.Answers += 1;
+        int Bucket = 0;
+        while (Bucket < LATENCYBUCKETS - 1 && Ms >= (1u << Bucket))
+            ++Bucket;
+        Timing.Histogram[Bucket] += 1;
+        learnTiming(Timing, Ms);
+    } else if (Failed) {
+        Timing.Errors += 1;
+    } else {
+        // the answer takes at least this long, so the timeout grows
+        Timing.Timeouts += 1;
+        learnTiming(Timing, Ms);
+    }
+}
+
+/// Waits for Response, scanf style like ATCmdParser::recv(), as the answer to
+/// Command, for commandTimeout(Command) ms. ERROR or FAIL ends the wait
+/// early and sets Connection.CommandFailed.
+/// \returns true if Response came
+static bool expect(ATCmdParser *_parser, ATCommand Command,
+                   const char *Response, ...) {
+    unsigned int Timeout = commandTimeout(Command);
+    setTimeout(_parser, Timeout);
+    Connection.CommandFailed = false;
+
+    PerfTimer Time(commandCounter(Command));
+    Timer Clock;
+    Clock.start();
+
+    va_list Args;
+    va_start(Args, Response);
+    bool Answered = _parser->vrecv(Response, Args);
+    va_end(Args);
+
+    recordTiming(Command, Answered, Connection.CommandFailed,
+                 Answered ? Clock.read_ms() : Timeout);
+    return Answered;
+}
+
+/// Waits until the request on one of the Count links in Ids has its
+/// response, or its link closes, or commandTimeout(CmdReply) ms have gone by
+/// since it was sent, or since data last came on the link. onData() picks up
+/// the responses, in whatever order they come. A response without a
+/// Content-Length ends when its link closes.
+/// \returns the index in Ids of the link that is done waiting. See
+/// readReply() for what came.
+static int awaitReply(ATCmdParser *_parser, const int *Ids, int Count) {
+    unsigned int Timeout = commandTimeout(CmdReply);
+    while (true) {
+        uint64_t Now = Kernel::get_ms_count();
+        uint64_t Soonest = Now + Timeout;
+
+        for (int i = 0; i < Count; ++i) {
+            LinkState &Link = Connection.Links[Ids[i]];
+            uint64_t Deadline = max(Link.SentAt, Link.HeardAt) + Timeout;
+            if (Link.Replied || (!Link.Open && Link.Reply.started())) {
+                // the response can beat a SEND OK that went missing
+                uint64_t Ms = max(Link.RepliedAt, Link.SentAt) - Link.SentAt;
+                recordTiming(CmdReply, true, false, Ms);
+                recordPerf(commandCounter(CmdReply), Ms * 1000);
+                return i;
+            }
+
+            // a link that closed won't get its response
+            if (!Link.Open || Now >= Deadline) {
+                recordTiming(CmdReply, false, !Link.Open, Timeout);
+                recordPerf(commandCounter(CmdReply),
+                           (Now - Link.SentAt) * 1000);
+                return i;
+            }
+            Soonest = min(Soonest, Deadline);
+        }
+
+        // the handlers do the work, wait a little if nothing has come
+        setTimeout(_parser, Soonest - Now);
+        if (!_parser->process_oob())
+            ThisThread::sleep_for(1);
+    }
+}
+
+/// Where the pieces of a request go. A request is written by passing each
+/// piece to put() in order, so that the same code can count how long the
+/// request is, copy it into a buffer, or send part of it to the ESP8266
+/// without the whole request ever being in RAM.
+struct ReqSink {
+    char *Buf;   ///< buffer to copy the request into, or NULL
+    size_t Size; ///< size of Buf
+
+    ATCmdParser *Parser; ///< sends bytes Begin to End to this, if not NULL
+    size_t Begin;
+    size_t End;
+
+    size_t Used; ///< length of the request so far
+    bool Failed; ///< the request did not fit in Buf, or a write failed
+};
+
+/// \returns a ReqSink that only counts the length of the request
+static ReqSink countingSink() {
+    ReqSink Sink = {NULL, 0, NULL, 0, 0, 0, false};
+    return Sink;
+}
+
+/// Writes a whole request to Sink
+typedef void (*ReqWriter)(ReqSink &Sink, void *Context);
+
+/// Adds Length bytes from Text to the request in Sink
+static void put(ReqSink &Sink, const char *Text, size_t Length) {
+    size_t Start = Sink.Used;
+    Sink.Used += Length;
+
+    if (Sink.Buf != NULL) {
+        if (Sink.Used > Sink.Size)
+            Sink.Failed = true;
+        else
+            memcpy(Sink.Buf + Start, Text, Length);
+    }
+
+    // only the part of the piece that is in the window is sent
+    if (Sink.Parser != NULL && Start < Sink.End && Sink.Used > Sink.Begin) {
+        size_t From = Start < Sink.Begin ? Sink.Begin - Start : 0;
+        size_t To = Sink.Used > Sink.End ? Sink.End - Start : Length;
+        if (Sink.Parser->write(Text + From, To - From) != (int)(To - From))
+            Sink.Failed = true;
+    }
+}
+
+/// put() for C strings
+static void put(ReqSink &Sink, const char *Text) {
+    put(Sink, Text, strlen(Text));
+}
+
+/// put() for strings
+static void put(ReqSink &Sink, const string &Text) {
+    put(Sink, Text.data(), Text.size());
+}
+
+/// put() for a reading, formatted by formatFloat()
+static void putFloat(ReqSink &Sink, float Value) {
+    char Text[FLOATCHARS];
+    put(Sink, Text, formatFloat(Text, Value));
+}
+
+/// put() for a whole number, like a time or a length
+static void putNumber(ReqSink &Sink, long Number) {
+    char Text[24];
+    put(Sink, Text, snprintf(Text, sizeof(Text), "%ld", Number));
+}
+
+/// Adds a CBOR data item head: the major type, and Value in as few bytes as
+/// possible
+static void putCborHead(ReqSink &Sink, uint8_t Major, uint64_t Value) {
+    uint8_t Head[9];
+    size_t Length = 1;
+
+    if (Value < 24) {
+        Head[0] = Major << 5 | Value;
+    } else {
+        int Bytes = Value <= 0xff ? 1 : Value <= 0xffff ? 2
+                                   : Value <= 0xffffffff ? 4 : 8;
+        Head[0] = Major << 5 | (Bytes == 1 ? 24 : Bytes == 2 ? 25
+                                : Bytes == 4 ? 26 : 27);
+        // big endian
+        for (int i = Bytes; i > 0; --i) {
+            Head[i] = Value & 0xff;
+            Value >>= 8;
+        }
+        Length += Bytes;
+    }
+    put(Sink, (const char *)Head, Length);
+}
+
+/// Adds a CBOR integer
+static void putCborInt(ReqSink &Sink, int64_t Value) {
+    if (Value >= 0)
+        putCborHead(Sink, 0, Value);
+    else
+        putCborHead(Sink, 1, -1 - Value);
+}
+
+/// Adds a CBOR text string
+static void putCborText(ReqSink &Sink, const string &Text) {
+    putCborHead(Sink, 3, Text.size());
+    put(Sink, Text);
+}
+
+/// Opens link Id to the server in Specs.
+/// \returns NETWORKSUCCESS if it connected, ReqNoLink otherwise
+static int openLink(ATCmdParser *_parser, BoardSpecs &Specs, int Id) {
+    _parser->send("AT+CIPSTART=%d,\"TCP\",\"%s\",%d", Id,
+                  Specs.RemoteIP.c_str(), Specs.RemotePort);
+    if (!expect(_parser, CmdConnect, "OK")) {
+        // only this link, the others may have requests in flight
+        _parser->send("AT+CIPCLOSE=%d", Id);
+        expect(_parser, CmdSetup, "OK");
+        Connection.Links[Id].Open = false;
+
+        // "no ip" comes back if the WiFi went down without saying so
+        setWiFiState(WiFiUnknown);
+        return ReqNoLink;
+    }
+    Connection.Links[Id].Open = true;
+    return NETWORKSUCCESS;
+}
+
+/// Closes link Id
+static void closeLink(ATCmdParser *_parser, int Id) {
+    _parser->send("AT+CIPCLOSE=%d", Id);
+    expect(_parser, CmdSetup, "OK");
+    Connection.Links[Id].Open = false;
+}
 
 int startESP(ATCmdParser *_parser) {
+    // keep track of connections that the ESP8266 or the server close
+    Connection.Parser = _parser;
+    _parser->oob("0,CLOSED", &onLinkClosed<0>);
+    _parser->oob("1,CLOSED", &onLinkClosed<1>);
+    _parser->oob("2,CLOSED", &onLinkClosed<2>);
+    _parser->oob("3,CLOSED", &onLinkClosed<3>);
+    _parser->oob("link is not valid", &onLinkInvalid);
+
+    // and the server's responses, on whichever link they come
+    _parser->oob("+IPD", &onData);
+
+    // and the WiFi going up and down
+    _parser->oob("WIFI CONNECTED", &onWiFiConnected);
+    _parser->oob("WIFI GOT IP", &onWiFiGotIP);
+    _parser->oob("WIFI DISCONNECT", &onWiFiDisconnect);
+
+    // and commands that failed, instead of waiting out their timeouts
+    _parser->oob("ERROR", &onCommandFailed);
+    _parser->oob("FAIL", &onCommandFailed);
+    _parser->oob("SEND FAIL", &onCommandFailed);
+
+    for (int Id = 0; Id < MAXLINKS; ++Id)
+        Connection.Links[Id].Open = false;
+    setWiFiState(WiFiUnknown);
     _parser->send("AT+CIPCLOSE=5");
-    _parser->recv("OK");
+    expect(_parser, CmdSetup, "OK");
     _parser->send("AT+CWMODE=3");
-    _parser->recv("OK");
+    expect(_parser, CmdSetup, "OK");
     _parser->send("AT+CIPMUX=1");
-    if (_parser->recv("OK"))
+    if (expect(_parser, CmdSetup, "OK"))
         return NETWORKSUCCESS;
     else
         return -1;
 }
 
+/// Sets the board's end of the ESP8266's UART to Baud
+static void setBoardBaud(UARTSerial *Serial, int Baud, bool Flow) {
+    Serial->set_baud(Baud);
+#if DEVICE_SERIAL_FC
+    if (Flow)
+        Serial->set_flow_control(SerialBase::RTSCTS, ESPRTS, ESPCTS);
+    else
+        Serial->set_flow_control(SerialBase::Disabled);
+#endif
+}
+
+/// \returns true if the ESP8266 answers AT at the board's baud rate
+static bool espAnswers(ATCmdParser *_parser) {
+    // throw away what came in at another rate
+    _parser->flush();
+    _parser->send("AT");
+    return expect(_parser, CmdSetup, "OK");
+}
+
+/// Looks for the ESP8266 at each of the Count rates in Rates, from the
+/// slowest, which is the one it starts at, and then from the fastest.
+/// \returns the index in Rates of the rate it answered at, or -1
+static int findESPBaud(ATCmdParser *_parser, UARTSerial *Serial,
+                       const int *Rates, int Count, bool Flow) {
+    for (int i = 0; i < Count; ++i) {
+        int At = i == 0 ? Count - 1 : i - 1;
+        setBoardBaud(Serial, Rates[At], Flow && Rates[At] != ESPBAUD);
+        if (espAnswers(_parser))
+            return At;
+    }
+    return -1;
+}
+
+// =============================================================================
+int setESPBaud(ATCmdParser *_parser, UARTSerial *Serial, BoardSpecs &Specs) {
+    bool Flow = Specs.FlowControl;
+
+    // the rates to try, fastest first, ending with the one the ESP8266 starts
+    // at
+    int Rates[BAUDRATES];
+    int Count = 0;
+    for (uint32_t Baud = Specs.UARTBaud;
+         Baud > ESPBAUD && Count < BAUDRATES - 1; Baud /= 2)
+        Rates[Count++] = Baud;
+    Rates[Count++] = ESPBAUD;
+
+    int At = findESPBaud(_parser, Serial, Rates, Count, Flow);
+
+    // take the fastest rate that works
+    for (int i = 0; i < At; ++i) {
+        _parser->send("AT+UART_CUR=%d,8,1,0,%d", Rates[i], Flow ? 3 : 0);
+        if (expect(_parser, CmdSetup, "OK")) {
+            // the ESP8266 changes its rate once the OK is out
+            wait_us(BAUDSETTLE * 1000);
+            setBoardBaud(Serial, Rates[i], Flow);
+            if (espAnswers(_parser)) {
+                At = i;
+                break;
+            }
+        }
+        LOGWARN("The ESP8266 did not answer at %d baud\r\n", Rates[i]);
+
+        // ask it to go back, in case only its answers were lost, and look
+        // for it if that doesn't work either
+        bool Before = Flow && Rates[At] != ESPBAUD;
+        _parser->send("AT+UART_CUR=%d,8,1,0,%d", Rates[At], Before ? 3 : 0);
+        wait_us(BAUDSETTLE * 1000);
+        setBoardBaud(Serial, Rates[At], Before);
+        if (!espAnswers(_parser))
+            At = findESPBaud(_parser, Serial, Rates, Count, Flow);
+    }
+
+    if (At < 0) {
+        setBoardBaud(Serial, ESPBAUD, false);
+        Specs.UARTBaud = ESPBAUD;
+        Specs.FlowControl = false;
+        return -1;
+    }
+
+    Specs.UARTBaud = Rates[At];
+    Specs.FlowControl = Flow && Rates[At] != ESPBAUD;
+    LOGINFO("ESP8266 UART is at %u baud%s\r\n", (unsigned)Specs.UARTBaud,
+            Specs.FlowControl ? " with RTS/CTS" : "");
+    return NETWORKSUCCESS;
+}
+
 int connectESPWiFi(ATCmdParser *_parser, BoardSpecs &Specs) {
 
     _parser->send("AT+CWJAP=\"%s\",\"%s\"", Specs.NetworkSSID.c_str(),
                   Specs.NetworkPassword.c_str());
 
-    if (_parser->recv("OK")) {
+    if (expect(_parser, CmdJoin, "OK")) {
         if (checkESPWiFiConnection(_parser)) {
             return NETWORKSUCCESS;
         } else {
@@ -49,108 +597,461 @@ int connectESPWiFi(ATCmdParser *_parser, BoardSpecs &Specs) {
 }
 
 // =============================================================================
-string makeGetReqStr(BoardSpecs &Specs) {
-    // make the message to send
-    // get the size to allocate memory
-    size_t message_size = strlen(get_req_start) + Specs.RemoteDir.size() +
-                          Specs.DatabaseTableName.size() + 1;
-    // the 1 is for the '?'
+void encodeRequestParts(BoardSpecs &Specs) {
+    // the port table is the port names in order, each followed by a 0
+    string Names;
+    for (size_t i = 0; i < Specs.Ports.size() && i < CBORMAXPORTS; ++i) {
+        Names.append(Specs.Ports[i].Name);
+        Names.push_back(0);
+    }
+    Specs.PortTable = backlogCRC(Names.data(), Names.size());
 
-    size_t End = Specs.Ports.size();
-    size_t get_extras = strlen(port_get_str) + strlen(value_get_str);
+    if (Specs.Encoding == EncodeCBOR && Specs.Ports.size() > CBORMAXPORTS) {
+        LOGWARN("More than %d ports, sending GET requests instead of CBOR\r\n",
+                CBORMAXPORTS);
+        Specs.Encoding = EncodeGet;
+    }
+
+    if (Specs.Encoding == EncodeCBOR) {
+        // the body's length and a blank line go after this
+        Specs.ReqStart = post_req_start;
+        Specs.ReqStart.append(Specs.RemoteDir);
+        Specs.ReqStart.append(keep_alive_version);
+        Specs.ReqStart.append(req_header);
+        Specs.ReqStart.append(Specs.HostName);
+        Specs.ReqStart.append(cbor_header);
+        Specs.ReqStart.append(Specs.KeepAlive ? "keep-alive" : "close");
+        Specs.ReqStart.append(length_header);
+        Specs.ReqEnd = "\r\n\r\n";
+    } else {
+        Specs.ReqStart = get_req_start;
+        Specs.ReqStart.append(Specs.RemoteDir);
+        Specs.ReqStart.append("?");
+        Specs.ReqStart.append(id_get_str);
+        Specs.ReqStart.append(Specs.DatabaseTableName);
 
-    for (size_t i = 0; i < End; ++i) {
-        if (Specs.Ports[i].Multiplier != 0) {
-            message_size += Specs.Ports[i].Name.size() +
-                            to_string(Specs.Ports[i].Value).size() + get_extras;
+        // keep-alive requests have to be full HTTP/1.1 requests so that the
+        // server can tell where one ends and leaves the connection open
+        if (Specs.KeepAlive) {
+            Specs.ReqEnd = keep_alive_version;
+            Specs.ReqEnd.append(req_header);
+            Specs.ReqEnd.append(Specs.HostName);
+            Specs.ReqEnd.append(keep_alive_header);
+        } else {
+            Specs.ReqEnd = get_req_end;
+            Specs.ReqEnd.append(req_header);
+            Specs.ReqEnd.append(Specs.HostName);
+            Specs.ReqEnd.append(get_req_end);
         }
     }
-    // add on for the \r\n
-    message_size +=
-        strlen(id_get_str) + strlen(get_req_start) + strlen(get_req_end);
-    message_size += strlen(req_header) + Specs.HostName.size() + strlen("\r\n");
 
-    string Message = get_req_start;
+    for (size_t i = 0; i < Specs.Ports.size(); ++i) {
+        PortInfo &Port = Specs.Ports[i];
+        Port.ReqField = port_get_str;
+        Port.ReqField.append(Port.Name);
+        Port.ReqField.append(value_get_str);
+    }
+}
 
-    // reserve so that further allocations are not needed
-    Message.reserve(message_size);
+// =============================================================================
+size_t formatFloat(char *Out, float Value) {
+    double Abs = fabs(Value);
+
+    // printf handles what doesn't fit in the integer math below, along with
+    // inf and nan, which fail the comparison
+    if (!(Abs < 1e12))
+        return snprintf(Out, FLOATCHARS, "%f", Value);
+
+    size_t Length = 0;
+    if (signbit(Value))
+        Out[Length++] = '-';
 
-    Message.append(Specs.RemoteDir);
+    // the value in millionths, rounded to the 6 digits that %f prints. Like
+    // printf, ties go to the even digit.
+    double Millionths = Abs * 1000000.0;
+    uint64_t Scaled = (uint64_t)Millionths;
+    double Rest = Millionths - Scaled;
+    if (Rest > 0.5 || (Rest == 0.5 && (Scaled & 1)))
+        ++Scaled;
+    uint64_t Whole = Scaled / 1000000;
+    uint32_t Fraction = Scaled % 1000000;
 
-    Message.append("?");
+    // the whole part comes out backwards
+    char Digits[16];
+    int Count = 0;
+    do {
+        Digits[Count++] = '0' + Whole % 10;
+        Whole /= 10;
+    } while (Whole > 0);
+    while (Count > 0)
+        Out[Length++] = Digits[--Count];
+
+    Out[Length++] = '.';
+    for (int i = 5; i >= 0; --i) {
+        Out[Length + i] = '0' + Fraction % 10;
+        Fraction /= 10;
+    }
+    return Length + 6;
+}
 
-    Message.append(id_get_str);
+/// The performance counters that go with the next live upload. They are
+/// copied once, since the request is written more than once and the
+/// counters change while it is sent.
+static PerfStats PerfReport[PERFCOUNTERS];
 
-    Message.append(Specs.DatabaseTableName);
+/// \returns PerfReport filled in if the counters are due to go with a live
+/// upload, NULL if they aren't
+static const PerfStats *takePerfReport() {
+    if (!perfReportDue())
+        return NULL;
+    for (int i = 0; i < PERFCOUNTERS; ++i)
+        PerfReport[i] = getPerfStats((PerfCounter)i);
+    return PerfReport;
+}
+
+/// Adds the counters in Perf that have recorded something to a GET request,
+/// as &Perf=name:count,min,mean,max;name:... with the times in
+/// microseconds
+static void putPerfGet(ReqSink &Sink, const PerfStats *Perf) {
+    put(Sink, perf_get_str);
+    bool First = true;
+    for (int i = 0; i < PERFCOUNTERS; ++i) {
+        const PerfStats &Stats = Perf[i];
+        if (Stats.Count == 0)
+            continue;
+        if (!First)
+            put(Sink, ";");
+        First = false;
+
+        put(Sink, Stats.Name);
+        put(Sink, ":");
+        putNumber(Sink, Stats.Count);
+        put(Sink, ",");
+        putNumber(Sink, Stats.MinUs);
+        put(Sink, ",");
+        putNumber(Sink, Stats.TotalUs / Stats.Count);
+        put(Sink, ",");
+        putNumber(Sink, Stats.MaxUs);
+    }
+}
+
+/// A GET request with the reported port readings in Specs
+struct LiveReq {
+    const BoardSpecs *Specs;
+    const PerfStats *Perf; ///< counters to send along, or NULL
+};
+
+/// Writes the LiveReq that Context points to
+static void putGetReq(ReqSink &Sink, void *Context) {
+    const LiveReq &Req = *(const LiveReq *)Context;
+    const BoardSpecs &Specs = *Req.Specs;
+    put(Sink, Specs.ReqStart);
 
     // append to get request for every active port
-    for (size_t i = 0; i < End; ++i) {
-        if (Specs.Ports[i].Multiplier != 0) {
-            Message.append(port_get_str);
-            Message.append(Specs.Ports[i].Name);
-            Message.append(value_get_str);
-            Message.append(to_string(Specs.Ports[i].Value));
+    for (size_t i = 0; i < Specs.Ports.size(); ++i) {
+        const PortInfo &Port = Specs.Ports[i];
+        if (Port.reported()) {
+            put(Sink, Port.ReqField);
+            putFloat(Sink, Port.Value);
         }
     }
-    Message.append("\r\n");
-    Message.append(req_header);
-    Message.append(Specs.HostName);
-    Message.append(get_req_end);
-
-    return Message;
+    if (Req.Perf != NULL)
+        putPerfGet(Sink, Req.Perf);
+    put(Sink, Specs.ReqEnd);
 }
-// ===========================================================================
 
-string makeGetReqStr(vector<PortInfo> Ports, BoardSpecs &Specs) {
-    // make the message to send
-    // get the size to allocate memory
-    size_t message_size = strlen(get_req_start) + Specs.RemoteDir.size() +
-                          Specs.DatabaseTableName.size() + 1;
-    // the 1 is for the '?'
+/// The readings that putBackupReq() sends
+struct BackupReq {
+    const vector<PortInfo> *Ports;
+    const BoardSpecs *Specs;
+};
 
-    size_t End = Ports.size();
-    size_t get_extras = strlen(port_get_str) + strlen(value_get_str);
+/// Writes a request with the readings in the BackupReq that Context points to
+static void putBackupReq(ReqSink &Sink, void *Context) {
+    const BackupReq &Req = *(const BackupReq *)Context;
+    const vector<PortInfo> &Ports = *Req.Ports;
+    put(Sink, Req.Specs->ReqStart);
 
-    for (size_t i = 0; i < End; ++i) {
+    // ports from the backlog don't have ReqField set
+    for (size_t i = 0; i < Ports.size(); ++i) {
         if (Ports[i].Multiplier != 0.0f) {
-            message_size += Ports[i].Name.size() +
-                            to_string(Ports[i].Value).size() + get_extras;
+            put(Sink, port_get_str);
+            put(Sink, Ports[i].Name);
+            put(Sink, value_get_str);
+            putFloat(Sink, Ports[i].Value);
+        }
+    }
+    put(Sink, Req.Specs->ReqEnd);
+}
+
+/// Writes the readings of one backed up sample set, read at Time, into a batch
+static void putBatchSet(ReqSink &Sink, const vector<PortInfo> &Ports,
+                        time_t Time) {
+    for (size_t i = 0; i < Ports.size(); ++i) {
+        put(Sink, time_get_str);
+        putNumber(Sink, Time);
+        put(Sink, port_get_str);
+        put(Sink, Ports[i].Name);
+        put(Sink, value_get_str);
+        putFloat(Sink, Ports[i].Value);
+    }
+}
+
+/// The backed up sets that putBatchReq() sends
+struct BatchReq {
+    BoardSpecs *Specs;
+    const char *FileName;
+    uint32_t First;   ///< records from the start of the backlog to skip
+    uint32_t Records; ///< records after those to send
+    time_t Now;       ///< the board's clock, sent with the batch
+};
+
+/// Writes a request with the backed up sets in the BatchReq that Context
+/// points to. The sets are read from the backlog again every time.
+static void putBatchReq(ReqSink &Sink, void *Context) {
+    BatchReq &Req = *(BatchReq *)Context;
+    put(Sink, Req.Specs->ReqStart);
+    put(Sink, now_get_str);
+    putNumber(Sink, Req.Now);
+
+    static vector<PortInfo> Ports; // kept so its memory is reused
+    time_t Time;
+    uint32_t Offset = Req.First;
+    while (Offset < Req.First + Req.Records) {
+        uint32_t Length =
+            readBackupSet(*Req.Specs, Req.FileName, Offset, Ports, Time);
+        if (Length == 0) {
+            // the backlog changed since the request was measured
+            Sink.Failed = true;
+            break;
         }
+        putBatchSet(Sink, Ports, Time);
+        Offset += Length;
     }
-    // add on for the \r\n
-    message_size +=
-        strlen(id_get_str) + strlen(get_req_start) + strlen(get_req_end);
+    put(Sink, Req.Specs->ReqEnd);
+}
 
-    message_size += strlen(req_header) + Specs.HostName.size() + strlen("\r\n");
+// =============================================================================
+size_t writeGetReq(char *Buf, size_t Size, const BoardSpecs &Specs) {
+    LiveReq Req = {&Specs, NULL};
+    ReqSink Sink = {Buf, Size, NULL, 0, 0, 0, false};
+    putGetReq(Sink, &Req);
+    return Sink.Failed ? 0 : Sink.Used;
+}
 
-    string Message = get_req_start;
+// =============================================================================
+size_t writeGetReq(char *Buf, size_t Size, const vector<PortInfo> &Ports,
+                   const BoardSpecs &Specs) {
+    BackupReq Req = {&Ports, &Specs};
+    ReqSink Sink = {Buf, Size, NULL, 0, 0, 0, false};
+    putBackupReq(Sink, &Req);
+    return Sink.Failed ? 0 : Sink.Used;
+}
 
-    // reserve so that further allocations are not needed
-    Message.reserve(message_size);
+/// Keys of the map that is the body of a CBOR request
+enum CborKey {
+    CborBoard, ///< text, DatabaseTableName
+    CborTable, ///< unsigned, PortTable
+    CborNames, ///< array of the port names, only if the server needs them
+    CborNow,   ///< unsigned, the board's clock when the request was made
+    CborBase,  ///< unsigned, the time that the sets' times are relative to
+    CborSets,  ///< indefinite array of sets, see putCborSet()
+    CborPerf   ///< map of performance counter names to arrays of count,
+               ///< min, mean and max in microseconds, now and then. It comes
+               ///< before CborSets, which has to be last.
+};
 
-    Message.append(Specs.RemoteDir);
+/// What the sets that a CBOR request has so far are encoded against
+struct CborState {
+    time_t Base; ///< time of the first set
 
-    Message.append("?");
+    /// bits of the last value sent for each port, 0 before the first
+    uint32_t Last[CBORMAXPORTS];
+};
 
-    Message.append(id_get_str);
+/// A CBOR request for the readings in Specs, or for Records records of the
+/// backlog in FileName, First records after its start
+struct CborReq {
+    BoardSpecs *Specs;
+    const char *FileName; ///< NULL for the readings in Specs
+    uint32_t First;
+    uint32_t Records;
+    time_t Now;
+    bool Names;        ///< send the port names
+    size_t BodyLength; ///< for the Content-Length header
+    const PerfStats *Perf; ///< counters to send along, or NULL
+};
 
-    Message.append(Specs.DatabaseTableName);
+/// Adds the body of Req up to the start of the array of sets
+static void putCborStart(ReqSink &Sink, const CborReq &Req, time_t Base) {
+    const BoardSpecs &Specs = *Req.Specs;
 
-    // append to get request for every active port
-    for (size_t i = 0; i < End; ++i) {
-        if (Ports[i].Multiplier != 0.0f) {
-            Message.append(port_get_str);
-            Message.append(Ports[i].Name);
-            Message.append(value_get_str);
-            Message.append(to_string(Ports[i].Value));
+    int Counters = 0;
+    for (int i = 0; Req.Perf != NULL && i < PERFCOUNTERS; ++i)
+        Counters += Req.Perf[i].Count > 0;
+    putCborHead(Sink, 5, 5 + Req.Names + (Counters > 0));
+
+    putCborHead(Sink, 0, CborBoard);
+    putCborText(Sink, Specs.DatabaseTableName);
+    putCborHead(Sink, 0, CborTable);
+    putCborHead(Sink, 0, Specs.PortTable);
+
+    if (Req.Names) {
+        size_t Count = min(Specs.Ports.size(), (size_t)CBORMAXPORTS);
+        putCborHead(Sink, 0, CborNames);
+        putCborHead(Sink, 4, Count);
+        for (size_t i = 0; i < Count; ++i)
+            putCborText(Sink, Specs.Ports[i].Name);
+    }
+
+    putCborHead(Sink, 0, CborNow);
+    putCborHead(Sink, 0, Req.Now);
+    putCborHead(Sink, 0, CborBase);
+    putCborHead(Sink, 0, Base);
+
+    if (Counters > 0) {
+        putCborHead(Sink, 0, CborPerf);
+        putCborHead(Sink, 5, Counters);
+        for (int i = 0; i < PERFCOUNTERS; ++i) {
+            const PerfStats &Stats = Req.Perf[i];
+            if (Stats.Count == 0)
+                continue;
+            putCborHead(Sink, 3, strlen(Stats.Name));
+            put(Sink, Stats.Name);
+            putCborHead(Sink, 4, 4);
+            putCborHead(Sink, 0, Stats.Count);
+            putCborHead(Sink, 0, Stats.MinUs);
+            putCborHead(Sink, 0, Stats.TotalUs / Stats.Count);
+            putCborHead(Sink, 0, Stats.MaxUs);
         }
     }
-    Message.append("\r\n");
-    Message.append(req_header);
-    Message.append(Specs.HostName);
-    Message.append(get_req_end);
 
-    return Message;
+    // the sets are streamed, so the array has no length
+    putCborHead(Sink, 0, CborSets);
+    put(Sink, "\x9f", 1);
+}
+
+/// Adds a set: an array of the set's time relative to the base, a bit mask
+/// of the ports in the set (bit i is port i), and one value for each bit,
+/// lowest first. A value is the difference between the bits of the float and
+/// the bits of the port's last value, as a 32 bit signed integer, so values
+/// that change slowly only take a byte or two.
+static void putCborSet(ReqSink &Sink, CborState &State, time_t Time,
+                       uint64_t Mask, const float *Values) {
+    int Count = 0;
+    for (uint64_t Bits = Mask; Bits; Bits &= Bits - 1)
+        ++Count;
+
+    putCborHead(Sink, 4, 2 + Count);
+    putCborInt(Sink, (int64_t)Time - State.Base);
+    putCborHead(Sink, 0, Mask);
+
+    for (int i = 0; i < CBORMAXPORTS; ++i) {
+        if (!(Mask & (1ULL << i)))
+            continue;
+        uint32_t Bits;
+        memcpy(&Bits, &Values[i], sizeof(Bits));
+        putCborInt(Sink, (int32_t)(Bits - State.Last[i]));
+        State.Last[i] = Bits;
+    }
+}
+
+/// Finds the ports of a backed up set in Specs.
+/// \returns the mask of the ports that were found, with their values in Values
+static uint64_t backlogMask(const BoardSpecs &Specs,
+                            const vector<PortInfo> &Ports, float *Values) {
+    uint64_t Mask = 0;
+    size_t Count = min(Specs.Ports.size(), (size_t)CBORMAXPORTS);
+
+    for (size_t i = 0; i < Ports.size(); ++i) {
+        size_t j = 0;
+        while (j < Count && Specs.Ports[j].Name != Ports[i].Name)
+            ++j;
+
+        // the port table only has the ports from the config
+        if (j == Count) {
+            LOGWARN("Port %s is not in the port table, not sending it\r\n",
+                    Ports[i].Name.c_str());
+            continue;
+        }
+        Mask |= 1ULL << j;
+        Values[j] = Ports[i].Value;
+    }
+    return Mask;
+}
+
+/// Writes the body of the CborReq that Context points to
+static void putCborBody(ReqSink &Sink, void *Context) {
+    CborReq &Req = *(CborReq *)Context;
+    BoardSpecs &Specs = *Req.Specs;
+
+    CborState State;
+    memset(&State, 0, sizeof(State));
+    float Values[CBORMAXPORTS];
+
+    if (Req.FileName == NULL) {
+        uint64_t Mask = 0;
+        size_t Count = min(Specs.Ports.size(), (size_t)CBORMAXPORTS);
+        for (size_t i = 0; i < Count; ++i) {
+            if (Specs.Ports[i].reported()) {
+                Mask |= 1ULL << i;
+                Values[i] = Specs.Ports[i].Value;
+            }
+        }
+
+        State.Base = Specs.SampleTime;
+        putCborStart(Sink, Req, State.Base);
+        putCborSet(Sink, State, Specs.SampleTime, Mask, Values);
+
+    } else {
+        static vector<PortInfo> Ports; // kept so its memory is reused
+        time_t Time;
+        uint32_t Offset = Req.First;
+        while (Offset < Req.First + Req.Records) {
+            uint32_t Length =
+                readBackupSet(Specs, Req.FileName, Offset, Ports, Time);
+            if (Length == 0) {
+                // the backlog changed since the request was measured
+                Sink.Failed = true;
+                break;
+            }
+            if (Offset == Req.First) {
+                State.Base = Time;
+                putCborStart(Sink, Req, State.Base);
+            }
+            putCborSet(Sink, State, Time, backlogMask(Specs, Ports, Values),
+                       Values);
+            Offset += Length;
+        }
+    }
+
+    put(Sink, "\xff", 1); // end of the sets
+}
+
+/// Writes the CborReq that Context points to, with the headers
+static void putCborReq(ReqSink &Sink, void *Context) {
+    CborReq &Req = *(CborReq *)Context;
+    put(Sink, Req.Specs->ReqStart);
+    putNumber(Sink, Req.BodyLength);
+    put(Sink, Req.Specs->ReqEnd);
+    putCborBody(Sink, Context);
+}
+
+/// Measures the body of Req
+static void measureCbor(CborReq &Req) {
+    ReqSink Count = countingSink();
+    putCborBody(Count, &Req);
+    Req.BodyLength = Count.Used;
+}
+
+// =============================================================================
+size_t writeCborReq(char *Buf, size_t Size, BoardSpecs &Specs, bool Names) {
+    CborReq Req = {&Specs, NULL, 0, 0, time(NULL), Names, 0};
+    measureCbor(Req);
+
+    ReqSink Sink = {Buf, Size, NULL, 0, 0, 0, false};
+    putCborReq(Sink, &Req);
+    return Sink.Failed ? 0 : Sink.Used;
 }
 //==============================================================================
 
@@ -161,81 +1062,658 @@ bool checkESPWiFiConnection(ATCmdParser *_parser) {
     char ip_addr[16];
     _parser->send("AT+CIFSR");
 
-    _parser->recv("+CIFSR:STAIP,\"%15[^\"]\"", ip_addr);
+    // there is no address to read if the ESP8266 answered with an error
+    bool Answered = expect(_parser, CmdAddress, "+CIFSR:STAIP,\"%15[^\"]\"",
+                           ip_addr) &&
+                    expect(_parser, CmdAddress, "OK");
+    _parser->debug_on(ATDEBUG);
+    if (!Answered) {
+        setWiFiState(WiFiUnknown);
+        return false;
+    }
 
     ip_addr[15] = 0;
 
-    if (!_parser->recv("OK"))
-        return false;
-
     // if that expression is true, then 0.0.0.0 is not in the ip address, and we
     // ar connected
+    bool Connected = strstr(ip_addr, "0.0.0.0") == NULL;
+    setWiFiState(Connected ? WiFiUp : WiFiDown);
+    return Connected;
+}
 
-    _parser->debug_on(1);
-    return strstr(ip_addr, "0.0.0.0") == NULL;
+// =============================================================================
+bool wifiLinkUp(ATCmdParser *_parser) {
+    // take in the WIFI messages that came since the last command
+    while (_parser->process_oob()) {
+    }
+
+    if (WiFi.State == WiFiUnknown ||
+        Kernel::get_ms_count() - WiFi.Heard >= WIFISTALE)
+        return checkESPWiFiConnection(_parser);
+    return WiFi.State == WiFiUp;
 }
-// ============================================================================
-int sendMessageTCP(ATCmdParser *_parser, BoardSpecs &Specs, string &message,
-                   float &response) {
 
-    _parser->send("AT+CIPSTART=0,\"TCP\",\"%s\",%d", Specs.RemoteIP.c_str(),
-                  Specs.RemotePort);
-    if (!_parser->recv("OK")) {
-        _parser->send("AT+CIPCLOSE=5");
-        return -1;
+// =============================================================================
+WiFiState getWiFiState() { return WiFi.State; }
+/// Sends the Length byte request that Write writes on link Id, to the
+/// destination specified in Specs. Requests longer than CIPSENDMAX go out with
+/// one AT+CIPSEND per CIPSENDMAX bytes, and Write is called once for each of
+/// them, so it has to write the same request every time.
+/// If Specs.KeepAlive is set and the link is open, the request goes over it,
+/// otherwise the link is opened first. The response is left for
+/// awaitReply().
+/// \returns NETWORKSUCCESS once the ESP8266 has sent the request, or the
+/// RequestError that says why it didn't
+static int sendOnLink(ATCmdParser *_parser, BoardSpecs &Specs, int Id,
+                      size_t Length, ReqWriter Write, void *Context) {
+    LinkState &Link = Connection.Links[Id];
+    bool Reused = Specs.KeepAlive && Link.Open;
+    if (!Reused && openLink(_parser, Specs, Id) != NETWORKSUCCESS)
+        return ReqNoLink;
+
+    Link.Replied = false;
+    Link.Reply.reset();
+    Connection.Sending = Id;
+
+    for (size_t Begin = 0; Begin < Length; Begin += CIPSENDMAX) {
+        size_t Chunk = min(Length - Begin, (size_t)CIPSENDMAX);
+
+        Connection.LinkInvalid = false;
+        _parser->send("AT+CIPSEND=%d,%d", Id, (int)Chunk);
+
+        if (!expect(_parser, CmdPrompt, ">")) {
+            // the server has part of the request if this isn't the first
+            // piece, so it can't be sent again on a new connection
+            if (!Connection.LinkInvalid || Begin > 0) {
+                closeLink(_parser, Id);
+                return ReqNoPrompt;
+            }
+
+            // the connection was closed under us, open it again and retry once
+            Reused = false;
+            Connection.Stats.Reconnects += 1;
+            if (openLink(_parser, Specs, Id) != NETWORKSUCCESS)
+                return ReqNoLink;
+
+            _parser->send("AT+CIPSEND=%d,%d", Id, (int)Chunk);
+            if (!expect(_parser, CmdPrompt, ">")) {
+                closeLink(_parser, Id);
+                return ReqNoPrompt;
+            }
+        }
+
+        // write this piece of the request straight to the UART
+        ReqSink Sink = {NULL, 0, _parser, Begin, Begin + Chunk, 0, false};
+        Write(Sink, Context);
+        if (Sink.Failed || Sink.Used != Length) {
+            closeLink(_parser, Id);
+            return ReqWriteFailed;
+        }
+
+        // the response comes after the last piece
+        if (Begin + Chunk < Length && !expect(_parser, CmdSent, "SEND OK")) {
+            closeLink(_parser, Id);
+            return ReqNoResponse;
+        }
     }
 
-    _parser->send("AT+CIPSEND=0,%d", message.size());
+    // SEND FAIL means the server never got the request. If SEND OK just
+    // didn't come, the response still might.
+    if (!expect(_parser, CmdSent, "SEND OK") && Connection.CommandFailed) {
+        closeLink(_parser, Id);
+        return ReqNoResponse;
+    }
+    Link.SentAt = Kernel::get_ms_count();
 
-    if (!_parser->recv(">"))
-        return -3;
+    // only count the requests that the ESP8266 sent
+    Connection.Stats.Requests += 1;
+    if (Reused)
+        Connection.Stats.Reused += 1;
+    return NETWORKSUCCESS;
+}
 
-    if (!_parser->send("%s", message.c_str()))
-        return -4;
+/// Reads the response that came on link Id: the port table that the server
+/// knows, and the new sampling interval, which goes in response.
+/// \returns NETWORKSUCCESS if the server took the request, or the
+/// RequestError that says why it didn't
+static int readReply(BoardSpecs &Specs, int Id, float &response) {
+    const HttpResponse &Reply = Connection.Links[Id].Reply;
+    const HttpResult &Result = Reply.result();
 
-    if (!_parser->recv("SEND OK")){
-        if (!_parser->recv("+IPD"))
-            return -5;
+    // the data has not made it unless the server responded
+    if (!Reply.started())
+        return ReqNoResponse;
+    if (Reply.bad() || Result.Status == 0) {
+        LOGWARN("Response on link %d is not HTTP\r\n", Id);
+        return ReqBadResponse;
     }
-    else {
-        if (_parser->recv("+IPD")){
+    LOGDEBUG("Response: %d\r\n", Result.Status);
 
-            char Buf[response_size + 1];
-            _parser->read(Buf, response_size);
-            Buf[response_size] = 0;
-            printf("Response: %s\r\n", Buf);
-            if (strstr(Buf, "404"))
-                return -6;
+    // the server answered, so the WiFi is up
+    setWiFiState(WiFiUp);
 
-            // get polling rate
-            const char *tok = "samplerate=\"";
-            char *ratestart = strstr(Buf, tok);
-            // go right up to the float value
-            ratestart += strlen(tok);
+    if (Result.HasTable)
+        Connection.KnownTable = Result.PortTable;
+    if (Result.HasConfig)
+        Connection.ServerConfig = Result.ConfigVersion;
 
-            if (isdigit(ratestart[0])) {
-                response = atof(ratestart);
-            }
-        }    
+    if (Result.Status == 404)
+        return ReqNotFound;
+
+    // the server has forgotten the port table, send the names next time
+    if (Result.Status == 409) {
+        Connection.KnownTable = 0;
+        return ReqConflict;
     }
-    
-    _parser->send("AT+CIPCLOSE=5");
-    _parser->recv("OK");
+    if (Result.Status >= 500)
+        return ReqServerError;
+    if (Result.Status >= 400)
+        return ReqRejected;
+    if (Result.Status < 200 || Result.Status >= 300)
+        return ReqBadResponse;
+
+    if (Result.HasRate)
+        response = Result.SampleRate;
+    return NETWORKSUCCESS;
+}
+
+/// \returns true if link Id can take another request: it is open, and its
+/// last response ended where the server said it would
+static bool linkReusable(int Id) {
+    const LinkState &Link = Connection.Links[Id];
+    return Link.Open && Link.Reply.complete() && !Link.Reply.result().Close;
+}
+
+/// Sends the Length byte request that Write writes over TCP on link 0 to the
+/// destination specified in Specs, like sendMessageTCP(), and waits for the
+/// response. See sendOnLink().
+static int sendRequestTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                          size_t Length, ReqWriter Write, void *Context,
+                          float &response) {
+    // pick up any close notices that came in since the last request
+    if (Specs.KeepAlive) {
+        while (_parser->process_oob()) {
+        }
+    }
+
+    int err = sendOnLink(_parser, Specs, 0, Length, Write, Context);
+    if (err != NETWORKSUCCESS)
+        return err;
+
+    const int Id = 0;
+    awaitReply(_parser, &Id, 1);
+    err = readReply(Specs, Id, response);
+
+    if (!Specs.KeepAlive || !linkReusable(Id)) {
+        closeLink(_parser, Id);
+    } else if (err == NETWORKSUCCESS) {
+        LOGDEBUG("Reused the connection for %u of %u requests\r\n",
+                 Connection.Stats.Reused, Connection.Stats.Requests);
+    }
+    return err;
+}
+
+/// The message that putMessage() sends
+struct MessageReq {
+    const char *Message;
+    size_t Length;
+};
+
+/// Writes the message in the MessageReq that Context points to
+static void putMessage(ReqSink &Sink, void *Context) {
+    const MessageReq &Req = *(const MessageReq *)Context;
+    put(Sink, Req.Message, Req.Length);
+}
+
+// ============================================================================
+int sendMessageTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                   const char *Message, size_t Length, float &response) {
+    MessageReq Req = {Message, Length};
+    return sendRequestTCP(_parser, Specs, Length, &putMessage, &Req, response);
+}
+
+/// The config file that putConfigReq() asks for
+struct ConfigReq {
+    const BoardSpecs *Specs;
+    uint32_t Version;
+};
+
+/// Writes a GET request for the config in the ConfigReq that Context points
+/// to. It is a keep-alive HTTP/1.1 request whatever the config says, so that
+/// the server has to say where the response ends, and a file that was cut off
+/// can be told apart. sendRequestTCP() still closes the link after it if
+/// Specs.KeepAlive isn't set.
+static void putConfigReq(ReqSink &Sink, void *Context) {
+    const ConfigReq &Req = *(const ConfigReq *)Context;
+    const BoardSpecs &Specs = *Req.Specs;
+
+    put(Sink, get_req_start);
+    put(Sink, Specs.RemoteDir);
+    put(Sink, "?");
+    put(Sink, id_get_str);
+    put(Sink, Specs.DatabaseTableName);
+    put(Sink, config_get_str);
+
+    char Version[12];
+    put(Sink, Version,
+        snprintf(Version, sizeof(Version), "%lu", (unsigned long)Req.Version));
+
+    put(Sink, keep_alive_version);
+    put(Sink, req_header);
+    put(Sink, Specs.HostName);
+    put(Sink, keep_alive_header);
+}
+
+// ============================================================================
+int fetchConfigTCP(ATCmdParser *_parser, BoardSpecs &Specs, uint32_t Version,
+                   char *Buf, size_t Size, size_t &Length) {
+    ConfigReq Req = {&Specs, Version};
+    ReqSink Count = countingSink();
+    putConfigReq(Count, &Req);
+
+    // the body goes straight from the +IPDs into Buf
+    HttpResponse &Reply = Connection.Links[0].Reply;
+    Reply.keepBody(Buf, Size);
+
+    float Ignored = -1.0f;
+    int err = sendRequestTCP(_parser, Specs, Count.Used, &putConfigReq, &Req,
+                             Ignored);
+    Length = Reply.bodyLength();
+    bool Cut = Reply.bodyCut();
+    bool Whole = Reply.complete();
+    Reply.keepBody(NULL, 0);
+
+    if (err != NETWORKSUCCESS)
+        return err;
+    if (Cut)
+        return ReqTooLong;
+    if (!Whole)
+        return ReqNoResponse;
     return NETWORKSUCCESS;
 }
 
+// ============================================================================
+uint32_t getServerConfigVersion() { return Connection.ServerConfig; }
+
+// ============================================================================
+void closeLinks(ATCmdParser *_parser) {
+    for (int Id = 0; Id < MAXLINKS; ++Id) {
+        if (Connection.Links[Id].Open)
+            closeLink(_parser, Id);
+    }
+}
+
+// =============================================================================
+bool requestRefused(int Error) {
+    return Error == ReqNotFound || Error == ReqRejected;
+}
+
+// =============================================================================
+const ConnectionStats &getConnectionStats() { return Connection.Stats; }
+
+/// Adds sets from the backlog in Req.FileName to Req, from Req.First on,
+/// while the request fits in Budget bytes, and at least one. Req.Records is
+/// set to the records that they take up, and Length to the length of the
+/// request.
+/// \returns the number of sets, 0 if the backlog has none to send
+static int planCbor(CborReq &Req, size_t Budget, size_t &Length) {
+    PerfTimer Build(PerfRequestBuild);
+    BoardSpecs &Specs = *Req.Specs;
+    Req.Records = 0;
+
+    // the headers, with room for a 5 digit Content-Length
+    size_t Head = Specs.ReqStart.size() + 5 + Specs.ReqEnd.size();
+
+    CborState State;
+    memset(&State, 0, sizeof(State));
+    float Values[CBORMAXPORTS];
+    static vector<PortInfo> Ports; // kept so its memory is reused
+    time_t Time;
+    ReqSink Count = countingSink();
+    int Sets = 0;
+
+    // add sets while they fit, the same way putCborBody() will
+    while (true) {
+        uint32_t Records = readBackupSet(Specs, Req.FileName,
+                                         Req.First + Req.Records, Ports, Time);
+        if (Records == 0)
+            break;
+
+        if (Sets == 0) {
+            State.Base = Time;
+            putCborStart(Count, Req, Time);
+        }
+        putCborSet(Count, State, Time, backlogMask(Specs, Ports, Values),
+                   Values);
+
+        // the 1 is for the end of the sets
+        if (Sets > 0 && Head + Count.Used + 1 > Budget)
+            break;
+        Req.Records += Records;
+        ++Sets;
+
+        if (Budget == 0)
+            break;
+    }
+
+    if (Sets == 0)
+        return 0;
+
+    measureCbor(Req);
+    Count = countingSink();
+    putCborReq(Count, &Req);
+    Length = Count.Used;
+    return Sets;
+}
+
+/// Adds sets from the backlog in Req.FileName to the GET batch Req, from
+/// Req.First on, while the request fits in Budget bytes, and at least one.
+/// Req.Records is set to the records that they take up, and Length to the
+/// length of the request.
+/// \returns the number of sets, 0 if the backlog has none to send
+static int planBatch(BatchReq &Req, size_t Budget, size_t &Length) {
+    PerfTimer Build(PerfRequestBuild);
+    Req.Records = 0;
+
+    // measure the request without the sets, then add sets while they fit
+    ReqSink Count = countingSink();
+    putBatchReq(Count, &Req);
+    Length = Count.Used;
+
+    static vector<PortInfo> Ports; // kept so its memory is reused
+    time_t Time;
+    int Sets = 0;
+
+    while (true) {
+        uint32_t Records = readBackupSet(*Req.Specs, Req.FileName,
+                                         Req.First + Req.Records, Ports, Time);
+        if (Records == 0)
+            break;
+
+        Count = countingSink();
+        putBatchSet(Count, Ports, Time);
+
+        // always send at least one set, even if it is too big on its own
+        if (Sets > 0 && Length + Count.Used > Budget)
+            break;
+        Length += Count.Used;
+        Req.Records += Records;
+        ++Sets;
+    }
+    return Sets;
+}
+
+/// A request for backed up sets, in whichever form Specs asks for. Context
+/// points to the member that Write writes.
+struct BacklogReq {
+    CborReq Cbor;           ///< CBOR requests
+    BatchReq Batch;         ///< GET batches
+    BackupReq Backup;       ///< GET requests with one set
+    vector<PortInfo> Ports; ///< the set that Backup sends
+    ReqWriter Write;
+    void *Context;
+    size_t Length;
+    uint32_t Records; ///< records that the request sends
+};
+
+/// Sets Req up to send the sets of the backlog in FileName that come First
+/// records after its start: as many as fit in Specs.BatchBytes, or one if
+/// it is 0.
+/// \returns the number of sets in the request, 0 if there are none to send
+static int planBacklogReq(BacklogReq &Req, BoardSpecs &Specs,
+                          const char *FileName, uint32_t First) {
+    int Sets;
+    if (Specs.Encoding == EncodeCBOR) {
+        CborReq Cbor = {&Specs, FileName, First, 0, time(NULL),
+                        Connection.KnownTable != Specs.PortTable, 0};
+        Req.Cbor = Cbor;
+        Sets = planCbor(Req.Cbor, Specs.BatchBytes, Req.Length);
+        Req.Records = Req.Cbor.Records;
+        Req.Write = &putCborReq;
+        Req.Context = &Req.Cbor;
+
+    } else if (Specs.BatchBytes > 0) {
+        BatchReq Batch = {&Specs, FileName, First, 0, time(NULL)};
+        Req.Batch = Batch;
+        Sets = planBatch(Req.Batch, min((size_t)Specs.BatchBytes,
+                                        (size_t)BATCHMAX),
+                         Req.Length);
+        Req.Records = Req.Batch.Records;
+        Req.Write = &putBatchReq;
+        Req.Context = &Req.Batch;
+
+    } else {
+        PerfTimer Build(PerfRequestBuild);
+        time_t Time;
+        Req.Records = readBackupSet(Specs, FileName, First, Req.Ports, Time);
+        Sets = Req.Records > 0 ? 1 : 0;
+
+        BackupReq Backup = {&Req.Ports, &Specs};
+        Req.Backup = Backup;
+        ReqSink Count = countingSink();
+        putBackupReq(Count, &Req.Backup);
+        Req.Length = Count.Used;
+        Req.Write = &putBackupReq;
+        Req.Context = &Req.Backup;
+    }
+    return Sets;
+}
+
+/// Sends backed up sets from the start of the backlog in FileName in one CBOR
+/// request: as many as fit in Budget bytes, and at least one. Records is set
+/// to the number of records that were sent; they are not deleted.
+static int sendCborBacklogTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                              const char *FileName, size_t Budget,
+                              uint32_t &Records, float &response) {
+    CborReq Req = {&Specs, FileName, 0, 0, time(NULL),
+                   Connection.KnownTable != Specs.PortTable, 0};
+    Records = 0;
+
+    size_t Length;
+    int Sets = planCbor(Req, Budget, Length);
+    if (Sets == 0)
+        return NETWORKSUCCESS; // nothing to send
+
+    LOGDEBUG("Sending %d backed up sample sets (%u bytes) in one CBOR "
+             "request\r\n",
+             Sets, (unsigned)Length);
+    int err = sendRequestTCP(_parser, Specs, Length, &putCborReq, &Req,
+                             response);
+    if (err == NETWORKSUCCESS)
+        Records = Req.Records;
+    return err;
+}
+
+// =============================================================================
 int sendBackupDataTCP(ATCmdParser *_parser, BoardSpecs &Specs,
                       const char *FileName, float &response) {
-    printf("Sending backup data over the network \r\n");
+    LOGDEBUG("Sending backup data over the network \r\n");
+    if (Specs.Encoding == EncodeCBOR) {
+        uint32_t Records;
+        return sendCborBacklogTCP(_parser, Specs, FileName, 0, Records,
+                                  response);
+    }
+
     vector<PortInfo> Ports = getSensorDataFromFile(Specs, FileName);
-    string Message = makeGetReqStr(Ports, Specs);
-    return sendMessageTCP(_parser, Specs, Message, response);
+
+    BackupReq Req = {&Ports, &Specs};
+    ReqSink Count = countingSink();
+    {
+        PerfTimer Time(PerfRequestBuild);
+        putBackupReq(Count, &Req);
+    }
+    return sendRequestTCP(_parser, Specs, Count.Used, &putBackupReq, &Req,
+                          response);
+}
+
+// =============================================================================
+int sendBackupBatchTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                       const char *FileName, float &response) {
+    if (Specs.Encoding == EncodeCBOR) {
+        // POST bodies don't have the request line's length limit
+        uint32_t Records;
+        int err = sendCborBacklogTCP(_parser, Specs, FileName,
+                                     Specs.BatchBytes, Records, response);
+        if (err == NETWORKSUCCESS && !deleteDataEntries(FileName, Records))
+            return ReqNotDeleted;
+        return err;
+    }
+
+    size_t Budget = Specs.BatchBytes;
+    if (Budget > BATCHMAX)
+        Budget = BATCHMAX;
+
+    BatchReq Req = {&Specs, FileName, 0, 0, time(NULL)};
+    size_t Length;
+    int Sets = planBatch(Req, Budget, Length);
+    if (Sets == 0)
+        return NETWORKSUCCESS; // nothing to send
+
+    LOGDEBUG("Sending %d backed up sample sets (%u bytes) in one request\r\n",
+             Sets, (unsigned)Length);
+    int err = sendRequestTCP(_parser, Specs, Length, &putBatchReq, &Req,
+                             response);
+
+    // only drop the data once the server has it
+    if (err == NETWORKSUCCESS && !deleteDataEntries(FileName, Req.Records))
+        return ReqNotDeleted;
+
+    return err;
+}
+
+/// Where a request that sendBacklogPipelinedTCP() sent is at
+enum FlightState {
+    FlightWaiting, ///< no response yet
+    FlightAcked,   ///< the server has the sets
+    FlightFailed   ///< the sets have to be sent again
+};
+
+// =============================================================================
+int sendBacklogPipelinedTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                            const char *FileName, float &response) {
+    int Links = Specs.UploadLinks;
+    if (Links < 1)
+        Links = 1;
+    if (Links > MAXLINKS)
+        Links = MAXLINKS;
+
+    static BacklogReq Reqs[MAXLINKS]; // by link id, kept so memory is reused
+    FlightState State[MAXLINKS];      // by link id
+    int Flight[MAXLINKS]; // links with requests in flight, oldest sets first
+    int Count = 0;
+
+    uint32_t Next = 0; // records from the start of the backlog already sent
+    int Sent = 0;
+    bool More = true;
+    bool Broken = false; // a request failed, so later sets can't be deleted
+    int err = NETWORKSUCCESS;
+
+    // pick up any close notices that came in since the last request
+    while (_parser->process_oob()) {
+    }
+
+    while (true) {
+        // give every free link the next sets of the backlog
+        while (err == NETWORKSUCCESS && More && Count < Links &&
+               Sent < PIPELINEREQS) {
+            int Id = 0;
+            while (find(Flight, Flight + Count, Id) != Flight + Count)
+                ++Id;
+
+            BacklogReq &Req = Reqs[Id];
+            int Sets = planBacklogReq(Req, Specs, FileName, Next);
+            if (Sets == 0) {
+                More = false;
+                break;
+            }
+
+            LOGDEBUG("Sending %d backed up sample sets (%u bytes) on link "
+                     "%d\r\n",
+                     Sets, (unsigned)Req.Length, Id);
+            err = sendOnLink(_parser, Specs, Id, Req.Length, Req.Write,
+                             Req.Context);
+            if (err != NETWORKSUCCESS)
+                break;
+
+            State[Id] = FlightWaiting;
+            Flight[Count++] = Id;
+            ++Sent;
+            Next += Req.Records;
+            Connection.Stats.MostInFlight =
+                max(Connection.Stats.MostInFlight, (unsigned int)Count);
+        }
+
+        if (Count == 0)
+            break;
+
+        // wait for whichever response comes first
+        int Waiting[MAXLINKS];
+        int Left = 0;
+        for (int i = 0; i < Count; ++i) {
+            if (State[Flight[i]] == FlightWaiting)
+                Waiting[Left++] = Flight[i];
+        }
+        int Id = Waiting[awaitReply(_parser, Waiting, Left)];
+
+        int Result = readReply(Specs, Id, response);
+        if (!Specs.KeepAlive || !linkReusable(Id))
+            closeLink(_parser, Id);
+
+        if (Result == NETWORKSUCCESS) {
+            State[Id] = FlightAcked;
+        } else {
+            // stop sending, the sets after these would be out of order
+            State[Id] = FlightFailed;
+            if (err == NETWORKSUCCESS)
+                err = Result;
+        }
+
+        // drop acknowledged sets from the front of the backlog, in order
+        while (Count > 0 && State[Flight[0]] != FlightWaiting) {
+            int Done = Flight[0];
+            if (State[Done] == FlightFailed) {
+                Broken = true;
+            } else if (!Broken) {
+                if (deleteDataEntries(FileName, Reqs[Done].Records)) {
+                    Next -= Reqs[Done].Records;
+                } else {
+                    // the sets are still at the front, stop sending after them
+                    Broken = true;
+                    if (err == NETWORKSUCCESS)
+                        err = ReqNotDeleted;
+                }
+            }
+            --Count;
+            for (int i = 0; i < Count; ++i)
+                Flight[i] = Flight[i + 1];
+        }
+    }
+    return err;
 }
 
 // =============================================================================
 int sendBulkDataTCP(ATCmdParser *_parser, BoardSpecs &Specs, float &response) {
+    const PerfStats *Perf = takePerfReport();
 
-    string message = makeGetReqStr(Specs);
+    if (Specs.Encoding == EncodeCBOR) {
+        CborReq Req = {&Specs, NULL, 0, 0, time(NULL),
+                       Connection.KnownTable != Specs.PortTable, 0, Perf};
+        ReqSink Count = countingSink();
+        {
+            PerfTimer Time(PerfRequestBuild);
+            measureCbor(Req);
+            putCborReq(Count, &Req);
+        }
+        return sendRequestTCP(_parser, Specs, Count.Used, &putCborReq, &Req,
+                              response);
+    }
 
-    return sendMessageTCP(_parser, Specs, message, response);
+    LiveReq Req = {&Specs, Perf};
+    ReqSink Count = countingSink();
+    {
+        PerfTimer Time(PerfRequestBuild);
+        putGetReq(Count, &Req);
+    }
+    return sendRequestTCP(_parser, Specs, Count.Used, &putGetReq, &Req,
+                          response);
 }
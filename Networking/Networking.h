@@ -26,13 +26,145 @@
 // network operations
 #define NETWORKSUCCESS (0)
 
+/// The most bytes that the ESP8266 can send with one AT+CIPSEND
+#define CIPSENDMAX (2048)
+
+/// The most bytes that a batch of backed up data can have. Web servers commonly
+/// refuse request lines over 8 KB.
+#define BATCHMAX (8000)
+
+/// Most characters that formatFloat() writes
+#define FLOATCHARS (48)
+
+/// Most links that requests go out on at once, see sendBacklogPipelinedTCP().
+/// They are link ids 0 to MAXLINKS - 1; the ESP8266 has 5.
+#define MAXLINKS (4)
+
+/// Most requests that one sendBacklogPipelinedTCP() sends, so that the
+/// network thread gets back to new readings and the watchdog in between
+#define PIPELINEREQS (16)
+
+/// Most ports that CBOR requests can send. Boards with more send GET
+/// requests.
+#define CBORMAXPORTS (64)
+
+/// Pins of the RTS and CTS lines of the ESP8266's UART
+#define ESPRTS (PTC18)
+#define ESPCTS (PTC19)
+
+/// ms that the ESP8266 takes to change its baud rate after it answers
+/// AT+UART_CUR
+#define BAUDSETTLE (20)
+
+/// Most baud rates that setESPBaud() tries
+#define BAUDRATES (8)
+
+/// The WiFi state from the ESP8266's messages is checked with AT+CIFSR if
+/// nothing has confirmed it for this many ms
+#define WIFISTALE (60000)
+
+/// Number of buckets in CommandTiming::Histogram
+#define LATENCYBUCKETS (16)
+
+/// Longest gap in ms between the bytes of the server's response. The ESP8266
+/// sends the +IPD data in one burst, so the end of a short response doesn't
+/// need a long wait.
+#define RESPONSEGAP (100)
+
 using namespace std;
 
+/// What the board knows about its WiFi connection
+enum WiFiState {
+    WiFiUnknown, ///< nothing has said yet
+    WiFiDown,    ///< not connected to the access point
+    WiFiJoined,  ///< connected to the access point, but has no address yet
+    WiFiUp       ///< connected, with an address
+};
+
+/// Why a request to the server didn't go through. The functions that send
+/// requests return one of these, or NETWORKSUCCESS. The ones that come from
+/// the response keep its status class: a server that had trouble (5xx) may
+/// take the same request later, but one that refused it (4xx) won't.
+enum RequestError {
+    ReqNoLink = -1,       ///< the link to the server could not be opened
+    ReqNoPrompt = -3,     ///< the ESP8266 didn't take the request
+    ReqWriteFailed = -4,  ///< the request could not be written
+    ReqNoResponse = -5,   ///< the request went out, but no response came
+    ReqNotFound = -6,     ///< 404, the path in the config is wrong
+    ReqBadResponse = -7,  ///< the response isn't HTTP, or has a status that
+                          ///< isn't an answer
+    ReqConflict = -8,     ///< 409, the server doesn't know the port table
+    ReqRejected = -9,     ///< any other 4xx, the server refuses the request
+    ReqServerError = -10, ///< 5xx, the server couldn't handle it right now
+    ReqTooLong = -11,     ///< the response didn't fit where it was to go
+    ReqNotDeleted = -12   ///< the server has the data, but it couldn't be
+                          ///< deleted from the backlog
+};
+
+/// \returns true if Error came from the server refusing the request, so
+/// sending the same request again won't help
+bool requestRefused(int Error);
+
+/// The AT commands that each get their own timeout
+enum ATCommand {
+    CmdSetup,   ///< AT+CIPCLOSE, AT+CWMODE and AT+CIPMUX
+    CmdJoin,    ///< AT+CWJAP
+    CmdAddress, ///< AT+CIFSR
+    CmdConnect, ///< AT+CIPSTART
+    CmdPrompt,  ///< the ">" after AT+CIPSEND
+    CmdSent,    ///< the SEND OK after the data of an AT+CIPSEND
+    CmdReply,   ///< the +IPD that the server's response comes in
+    ATCOMMANDS  ///< number of commands
+};
+
+/// How long the ESP8266 takes to answer one kind of AT command. The timeout
+/// for the command follows the answers, see commandTimeout().
+struct CommandTiming {
+    const char *Name; ///< name for printing
+
+    unsigned int Floor;   ///< shortest timeout in ms
+    unsigned int Ceiling; ///< longest timeout in ms
+
+    float Mean;      ///< moving average of the response time in ms
+    float Deviation; ///< moving average of how far answers are from Mean
+
+    unsigned int Answers;  ///< times the expected answer came
+    unsigned int Timeouts; ///< times nothing came before the timeout
+    unsigned int Errors;   ///< times ERROR or FAIL came instead
+
+    /// Histogram[i] counts answers that took less than 2^i ms, and more than
+    /// the bucket before. The last bucket counts the rest.
+    unsigned int Histogram[LATENCYBUCKETS];
+};
+
+/// Counts how the TCP connection to the server has been used
+struct ConnectionStats {
+    unsigned int Requests;   ///< Requests that were sent
+    unsigned int Reused;     ///< Requests sent over an already open connection
+    unsigned int Reconnects; ///< Times an open connection had to be reopened
+    unsigned int MostInFlight; ///< Most requests that waited for their
+                               ///< responses at once
+};
+
 /// starts the ESP8266 with the correct settings:
 /// CIPMUX=1 and CWMODE=3
+/// It also sets up the handlers that notice when links get closed, and that
+/// pick up the server's responses.
 /// returns NETWORKSUCCESS if successful, -1 otherwise.
 int startESP(ATCmdParser *_parser);
 
+/// Raises the baud rate of the ESP8266's UART, and of Serial, to
+/// Specs.UARTBaud with AT+UART_CUR, with RTS/CTS flow control if
+/// Specs.FlowControl is set. Each rate is checked with AT. If that gets no
+/// answer, half the rate is tried, down to ESPBAUD.
+/// The ESP8266 keeps the rate until it resets, so it is looked for at every
+/// rate that could have been picked before it is raised.
+/// Specs.UARTBaud and Specs.FlowControl are set to what the UART ended up
+/// at.
+/// \returns NETWORKSUCCESS if the ESP8266 answers, -1 if it could not be found
+/// at any rate
+int setESPBaud(ATCmdParser *_parser, UARTSerial *Serial, BoardSpecs &Specs);
+
 /// Uses the SSID and Password stored in Specs to connect to that network
 /// returns NETWORKSUCCESS if successful, and a negative integer otherwise
 int connectESPWiFi(ATCmdParser *_parser, BoardSpecs &Specs);
@@ -40,19 +172,82 @@ int connectESPWiFi(ATCmdParser *_parser, BoardSpecs &Specs);
 /// return true if you are connected to a wifi network, and false if you are not
 bool checkESPWiFiConnection(ATCmdParser *_parser);
 
-/// makes a get request string to send the port readings from Ports to the
-/// remote database in Specs
-string makeGetReqStr(vector<PortInfo> Ports, BoardSpecs &Specs);
+/// \returns true if the board is connected to the WiFi network. The state is
+/// kept from the WIFI CONNECTED, WIFI GOT IP and WIFI DISCONNECT messages that
+/// the ESP8266 sends on its own, and from requests that went through. The
+/// ESP8266 is only asked with checkESPWiFiConnection() when nothing has said
+/// for WIFISTALE ms.
+bool wifiLinkUp(ATCmdParser *_parser);
+
+/// \returns what is known about the WiFi connection, without asking the
+/// ESP8266
+WiFiState getWiFiState();
+
+/// Sets the parts of requests that only change with the config: ReqStart and
+/// ReqEnd in Specs, and ReqField in every port. Has to be called again if
+/// any of the values they are made from change.
+void encodeRequestParts(BoardSpecs &Specs);
+
+/// Writes Value to Out the way printf("%f") does, without printf for most
+/// values. Out has to hold FLOATCHARS characters; no 0 is added.
+/// \returns the number of characters written
+size_t formatFloat(char *Out, float Value);
+
+/// Writes a get request that sends the reported port readings in Specs to the
+/// remote database in Specs into Buf, without allocating any memory.
+/// \returns the length of the request, or 0 if it does not fit in Size bytes
+size_t writeGetReq(char *Buf, size_t Size, const BoardSpecs &Specs);
 
-/// makes a get request string to send the Port samples in Specs to the remote
-/// database specified in Specs
-string makeGetReqStr(BoardSpecs &Specs);
+/// Writes a get request that sends the port readings from Ports to the remote
+/// database in Specs into Buf.
+/// \returns the length of the request, or 0 if it does not fit in Size bytes
+size_t writeGetReq(char *Buf, size_t Size, const vector<PortInfo> &Ports,
+                   const BoardSpecs &Specs);
 
-/// Sends message over TCP to the destination specified in Specs
+/// Writes a CBOR POST request that sends the reported port readings in Specs
+/// into Buf. Names adds the port names, for a server that does not know
+/// Specs.PortTable yet.
+/// \returns the length of the request, or 0 if it does not fit in Size bytes
+size_t writeCborReq(char *Buf, size_t Size, BoardSpecs &Specs, bool Names);
+
+/// Sends the Length bytes in Message over TCP to the destination specified in
+/// Specs, with one AT+CIPSEND per CIPSENDMAX bytes.
 /// response is the new sampling interval that you get
 /// back from the server (if the connection is successful).
-int sendMessageTCP(ATCmdParser *_parser, BoardSpecs &Specs, string &message,
-                   float &response);
+/// If Specs.KeepAlive is set, link 0 is left open for the next message, and
+/// is reopened if the ESP8266 or the server closed it in the meantime.
+/// \returns NETWORKSUCCESS if the server took the message, or a RequestError
+int sendMessageTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                   const char *Message, size_t Length, float &response);
+
+/// Asks the server for version Version of the board's config file with
+/// GET RemoteDir?Board_ID=name&Config=Version, and puts the body of the
+/// response in Buf, which holds Size bytes. Length is set to the bytes that
+/// came. The request goes on link 0 like sendMessageTCP().
+/// \returns NETWORKSUCCESS if the whole file came, ReqTooLong if it didn't
+/// fit in Buf, or another RequestError
+int fetchConfigTCP(ATCmdParser *_parser, BoardSpecs &Specs, uint32_t Version,
+                   char *Buf, size_t Size, size_t &Length);
+
+/// \returns the config version that the server last put in a configversion
+/// directive, 0 if it hasn't sent one
+uint32_t getServerConfigVersion();
+
+/// Closes every open link, so the next requests open new connections to the
+/// server in the config
+void closeLinks(ATCmdParser *_parser);
+
+/// \returns how many requests have been sent and how many of them reused an
+/// open connection
+const ConnectionStats &getConnectionStats();
+
+/// \returns the timeout in ms that the next Command gets: the mean response
+/// time plus 4 times the mean deviation, kept between the command's floor and
+/// ceiling
+unsigned int commandTimeout(ATCommand Command);
+
+/// \returns the response times of Command so far
+const CommandTiming &getCommandTiming(ATCommand Command);
 
 /// sends a GET request with the most recent port readings to the remote
 /// location specified in Specs. response is the new sampling interval for the
@@ -65,4 +260,31 @@ int sendBulkDataTCP(ATCmdParser *_parser, BoardSpecs &Specs, float &response);
 /// from the server.
 int sendBackupDataTCP(ATCmdParser *_parser, BoardSpecs &Specs,
                       const char *FileName, float &response);
+
+/// Packs as many sample sets from the backlog in FileName as fit in
+/// Specs.BatchBytes (and BATCHMAX) into one GET request, with the time each
+/// set was read, and sends it to the remote location specified in Specs.
+/// The request is streamed from the backlog to the ESP8266, so it never has
+/// to fit in RAM.
+/// The sets are only deleted from the backlog once the server has responded.
+/// response is the new sampling interval for the board that you get back from
+/// the server.
+int sendBackupBatchTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                       const char *FileName, float &response);
+
+/// Sends up to PIPELINEREQS requests with data from the backlog in FileName,
+/// with up to Specs.UploadLinks of them in flight at once, each on its own
+/// link, so that the server's round trip for one request overlaps with
+/// sending the next ones. Each request has the sets that sendBackupBatchTCP()
+/// or sendBackupDataTCP() would send.
+/// Responses are matched to requests by link id. The sets of a request are
+/// deleted once the server has responded to it and to every request with
+/// older sets. After a request fails, no more are sent, and the sets of it
+/// and of the requests after it stay in the backlog.
+/// response is the new sampling interval for the board that you get back from
+/// the server.
+/// \returns NETWORKSUCCESS if every request went through, or the error of the
+/// first one that didn't
+int sendBacklogPipelinedTCP(ATCmdParser *_parser, BoardSpecs &Specs,
+                            const char *FileName, float &response);
 #endif
@@ -0,0 +1,491 @@
+/// \file
+/// \brief Implementation of the backlog ring buffer
+#include "BacklogStore.h"
+#include "BlockDevice.h"
+#include "MbedCRC.h"
+#include "ConsoleLog.h"
+#include "debugging.h"
+#include "mbed.h"
+
+#include <cstddef>
+#include <cstring>
+
+/// byte offset of the port table in the file
+#define BACKLOGTABLESTART (2 * BACKLOGHEADERSIZE)
+
+/// byte offset of the first record slot in the file
+#define BACKLOGDATASTART                                                       \
+    (BACKLOGTABLESTART + BACKLOGMAXPORTS * sizeof(BacklogPort))
+
+uint32_t backlogCRC(const void *Data, size_t Len) {
+    MbedCRC<POLY_32BIT_ANSI, 32> Crc;
+    uint32_t Out = 0;
+    Crc.compute((void *)Data, Len, &Out);
+    return Out;
+}
+
+/// \returns the CRC of every field of Record except the CRC itself
+static uint16_t recordCRC(const BacklogRecord &Record) {
+    MbedCRC<POLY_16BIT_CCITT, 16> Crc;
+    uint32_t Out = 0;
+    Crc.compute((void *)&Record, offsetof(BacklogRecord, CRC), &Out);
+    return Out;
+}
+
+/// \returns the CRC of every field of Header except the CRC itself
+static uint32_t headerCRC(const BacklogHeader &Header) {
+    return backlogCRC(&Header, offsetof(BacklogHeader, CRC));
+}
+
+// ============================================================================
+BacklogStore::BacklogStore()
+    : File(NULL), PendingCount(0), Unsynced(0), PendingSince(0),
+      Window(BACKLOGBUFFERRECORDS), FlushRecords(1), FlushSeconds(0) {
+    memset(&Header, 0, sizeof(Header));
+    memset(Table, 0, sizeof(Table));
+    Name[0] = '\0';
+}
+
+BacklogStore::~BacklogStore() { close(); }
+
+// ============================================================================
+bool BacklogStore::open(const char *FileName) {
+    close();
+
+    // flush in windows that start and end on program size boundaries.
+    // The first slot is on a block boundary, so a window is the smallest
+    // run of records that is also a whole number of blocks
+    uint32_t Program = BlockDevice::get_default_instance()->get_program_size();
+    uint32_t A = Program, B = sizeof(BacklogRecord);
+    while (B != 0) {
+        uint32_t T = A % B;
+        A = B;
+        B = T;
+    }
+    Window = A == 0 ? 0 : Program / A;
+    if (Window == 0 || Window > BACKLOGBUFFERRECORDS ||
+        BACKLOGCAPACITY % Window != 0)
+        Window = BACKLOGBUFFERRECORDS;
+
+    strncpy(Name, FileName, sizeof(Name) - 1);
+    Name[sizeof(Name) - 1] = '\0';
+
+    File = fopen(Name, "r+b");
+    if (File != NULL && (!loadHeader() || !loadTable())) {
+        // keep whatever was there so it can be recovered by hand
+        fclose(File);
+        File = NULL;
+
+        char OldName[sizeof(Name) + 4];
+        snprintf(OldName, sizeof(OldName), "%s.old", Name);
+        LOGWARN("%s is not a backlog file, moving it to %s\r\n", Name, OldName);
+        remove(OldName);
+        rename(Name, OldName);
+    }
+
+    if (File != NULL) {
+        LOGINFO("Backlog has %lu readings\r\n", (unsigned long)Header.Count);
+        return true;
+    }
+
+    // start a new, empty backlog
+    LOGINFO("making new backlog file \r\n");
+    File = fopen(Name, "w+b");
+    if (File == NULL) {
+        LOGERROR("Failed to open %s for logging\r\n", Name);
+        return false;
+    }
+
+    memset(&Header, 0, sizeof(Header));
+    Header.Magic = BACKLOGMAGIC;
+    Header.Version = BACKLOGVERSION;
+    Header.RecordSize = sizeof(BacklogRecord);
+    Header.Capacity = BACKLOGCAPACITY;
+    Header.TableCRC = backlogCRC(Table, 0);
+
+    // write both copies so that the file is valid from the start
+    if (!commitHeader() || !commitHeader()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+void BacklogStore::close() {
+    if (File != NULL) {
+        flush();
+        fclose(File);
+        File = NULL;
+    }
+    PendingCount = 0;
+    Unsynced = 0;
+}
+
+// ============================================================================
+void BacklogStore::setFlushPolicy(uint32_t Records, uint32_t Seconds) {
+    FlushRecords = Records == 0 ? 1 : Records;
+    FlushSeconds = Seconds;
+}
+
+// ============================================================================
+bool BacklogStore::flush() {
+    if (File == NULL)
+        return false;
+    if (PendingCount == 0 && Unsynced == 0)
+        return true;
+
+    // the records have to be on the card before the header points at them
+    if (!writePending() || !sync())
+        return false;
+
+    Header.Count += Unsynced;
+    Unsynced = 0;
+    return commitHeader();
+}
+
+// ============================================================================
+void BacklogStore::poll() {
+    if (PendingCount == 0 || FlushSeconds == 0)
+        return;
+
+    if (Kernel::get_ms_count() - PendingSince >= FlushSeconds * 1000ULL)
+        flush();
+}
+
+// ============================================================================
+bool BacklogStore::pushSet(BoardSpecs &Specs) {
+    if (File == NULL)
+        return false;
+
+    uint32_t Active = 0;
+    size_t End = Specs.Ports.size();
+    for (size_t i = 0; i < End; ++i) {
+        if (Specs.Ports[i].reported())
+            ++Active;
+    }
+    if (Active == 0 || Active > Header.Capacity)
+        return false;
+
+    // make room in the buffer. Sets that are bigger than the whole buffer
+    // are written out part of the way through instead
+    if (PendingCount + Active > BACKLOGBUFFERRECORDS && !flush())
+        return false;
+
+    // nothing refers to the port table when the ring is empty, so start it
+    // over in case the configuration changed
+    if (size() == 0)
+        Header.PortCount = 0;
+
+    // make room by dropping the oldest data. That has to be committed before
+    // the slots are reused, or the old header would point at the new records
+    if (Header.Capacity - size() < Active) {
+        if (!flush())
+            return false;
+        while (Header.Capacity - Header.Count < Active) {
+            uint32_t Length = setLength(0);
+            if (Length == 0)
+                Length = Header.Count; // the ring is unreadable, start over
+            LOGWARN("Backlog is full, dropping %lu old readings\r\n",
+                    (unsigned long)Length);
+            Header.Head = (Header.Head + Length) % Header.Capacity;
+            Header.Count -= Length;
+        }
+        if (!commitHeader())
+            return false;
+    }
+
+    if (PendingCount == 0)
+        PendingSince = Kernel::get_ms_count();
+
+    BacklogRecord Record;
+    memset(&Record, 0, sizeof(Record));
+    Record.Time = Specs.SampleTime;
+    Record.Flags = BACKLOGSETSTART;
+
+    uint32_t Added = 0;
+    for (size_t i = 0; i < End; ++i) {
+        PortInfo &Port = Specs.Ports[i];
+        if (!Port.reported())
+            continue;
+
+        int Index = portIndex(Port);
+        if (Index < 0) {
+            LOGWARN("Backlog port table is full, not logging %s\r\n",
+                    Port.Name.c_str());
+            continue;
+        }
+        Record.Port = Index;
+
+        // keep the ADC code when there is one, it converts back exactly
+        if (Port.Raw >= 0) {
+            Record.Flags |= BACKLOGADC;
+            Record.Code = Port.Raw;
+        } else {
+            Record.Flags &= ~BACKLOGADC;
+            Record.Value = Port.Value;
+        }
+        Record.CRC = recordCRC(Record);
+
+        if (PendingCount == BACKLOGBUFFERRECORDS && !writePending())
+            return false;
+        Pending[PendingCount++] = Record;
+        Record.Flags &= ~BACKLOGSETSTART;
+        ++Added;
+    }
+
+    if (Added == 0)
+        return false;
+
+    // write out once the policy says so, or once the buffer reaches the end
+    // of a window so that the write covers whole blocks
+    uint32_t Last = (Header.Head + size() - 1) % Header.Capacity;
+    uint32_t First = (Last + 1 + Header.Capacity - PendingCount) %
+                     Header.Capacity;
+    bool WindowDone =
+        First / Window != Last / Window || (Last + 1) % Window == 0;
+
+    if (Unsynced > 0 || PendingCount >= FlushRecords || WindowDone)
+        return flush();
+
+    poll();
+    return true;
+}
+
+// ============================================================================
+uint32_t BacklogStore::readSet(uint32_t Offset, vector<PortInfo> &Out,
+                               time_t &Time) {
+    Out.clear();
+    Time = 0;
+
+    // buffered sets can only be read from the card
+    if (Offset + 1 > Header.Count)
+        flush();
+    uint32_t Length = setLength(Offset);
+
+    for (uint32_t i = 0; i < Length; ++i) {
+        BacklogRecord Record;
+        uint32_t Slot = (Header.Head + Offset + i) % Header.Capacity;
+
+        // skip anything that got corrupted
+        if (!readRecord(Slot, Record) || Record.CRC != recordCRC(Record) ||
+            Record.Port >= Header.PortCount) {
+            LOGWARN("Skipping bad backlog record in slot %lu\r\n",
+                    (unsigned long)Slot);
+            continue;
+        }
+
+        Time = Record.Time;
+        BacklogPort &Entry = Table[Record.Port];
+
+        PortInfo Port;
+        Port.Name = Entry.Name;
+        Port.Description = Entry.Description;
+        if (Record.Flags & BACKLOGADC) {
+            Port.Raw = Record.Code;
+            Port.Value = Record.Code / 65535.0f * Entry.Multiplier;
+        } else {
+            Port.Value = Record.Value;
+        }
+        Port.Multiplier = 1.0f;
+        Out.push_back(Port);
+    }
+    return Length;
+}
+
+// ============================================================================
+bool BacklogStore::popSet() {
+    if (Header.Count == 0)
+        flush();
+
+    if (File == NULL || Header.Count == 0)
+        return false;
+
+    uint32_t Length = setLength(0);
+    return pop(Length == 0 ? Header.Count : Length);
+}
+
+// ============================================================================
+bool BacklogStore::pop(uint32_t Records) {
+    if (Records > Header.Count)
+        flush();
+
+    if (File == NULL || Header.Count == 0)
+        return false;
+
+    if (Records > Header.Count)
+        Records = Header.Count;
+
+    uint32_t Head = Header.Head;
+    Header.Head = (Header.Head + Records) % Header.Capacity;
+    Header.Count -= Records;
+    if (!commitHeader()) {
+        // the file still has the records, so keep them here too
+        LOGERROR("Failed to delete %u records from the backlog\r\n",
+                 (unsigned)Records);
+        Header.Head = Head;
+        Header.Count += Records;
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+uint32_t BacklogStore::setLength(uint32_t Offset) {
+    if (File == NULL || Offset >= Header.Count)
+        return 0;
+
+    // a set runs until the next record that starts a set
+    BacklogRecord Record;
+    uint32_t Length = 1;
+    while (Offset + Length < Header.Count) {
+        uint32_t Slot = (Header.Head + Offset + Length) % Header.Capacity;
+        if (!readRecord(Slot, Record) || (Record.Flags & BACKLOGSETSTART))
+            break;
+        ++Length;
+    }
+    return Length;
+}
+
+// ============================================================================
+int BacklogStore::portIndex(const PortInfo &Port) {
+    // ADC codes are converted with the entry's multiplier when they are read,
+    // so a port whose multiplier changed needs an entry of its own
+    for (uint32_t i = 0; i < Header.PortCount; ++i) {
+        if (strncmp(Table[i].Name, Port.Name.c_str(),
+                    sizeof(Table[i].Name) - 1) == 0 &&
+            Table[i].Multiplier == Port.Multiplier)
+            return i;
+    }
+
+    if (Header.PortCount >= BACKLOGMAXPORTS)
+        return -1;
+
+    // add the port. The header is written after the records that use it,
+    // so the new entry is only used once it is on the card
+    BacklogPort &Entry = Table[Header.PortCount];
+    memset(&Entry, 0, sizeof(Entry));
+    strncpy(Entry.Name, Port.Name.c_str(), sizeof(Entry.Name) - 1);
+    strncpy(Entry.Description, Port.Description.c_str(),
+            sizeof(Entry.Description) - 1);
+    Entry.Multiplier = Port.Multiplier;
+
+    long Pos = BACKLOGTABLESTART + (long)Header.PortCount * sizeof(Entry);
+    if (fseek(File, Pos, SEEK_SET) != 0 ||
+        fwrite(&Entry, sizeof(Entry), 1, File) != 1) {
+        LOGERROR("Failed to write the backlog port table\r\n");
+        return -1;
+    }
+
+    Header.PortCount += 1;
+    Header.TableCRC = backlogCRC(Table, Header.PortCount * sizeof(Entry));
+    return Header.PortCount - 1;
+}
+
+// ============================================================================
+bool BacklogStore::readRecord(uint32_t Slot, BacklogRecord &Record) {
+    long Pos = BACKLOGDATASTART + (long)Slot * sizeof(BacklogRecord);
+    if (fseek(File, Pos, SEEK_SET) != 0)
+        return false;
+    return fread(&Record, sizeof(Record), 1, File) == 1;
+}
+
+// ============================================================================
+bool BacklogStore::writePending() {
+    uint32_t Done = 0;
+
+    // one write per contiguous run of slots, which is two if the ring wraps
+    while (Done < PendingCount) {
+        uint32_t Slot = (Header.Head + Header.Count + Unsynced + Done) %
+                        Header.Capacity;
+        uint32_t Run = PendingCount - Done;
+        if (Run > Header.Capacity - Slot)
+            Run = Header.Capacity - Slot;
+
+        long Pos = BACKLOGDATASTART + (long)Slot * sizeof(BacklogRecord);
+        if (fseek(File, Pos, SEEK_SET) != 0 ||
+            fwrite(&Pending[Done], sizeof(BacklogRecord), Run, File) != Run) {
+            LOGERROR("Failed to write backlog slot %lu\r\n",
+                     (unsigned long)Slot);
+            return false;
+        }
+        Done += Run;
+    }
+
+    Unsynced += PendingCount;
+    PendingCount = 0;
+    return true;
+}
+
+// ============================================================================
+bool BacklogStore::commitHeader() {
+    Header.Generation += 1;
+    Header.CRC = headerCRC(Header);
+
+    // alternate between the two copies so one is always intact
+    long Pos = (Header.Generation % 2) * BACKLOGHEADERSIZE;
+    if (fseek(File, Pos, SEEK_SET) != 0 ||
+        fwrite(&Header, sizeof(Header), 1, File) != 1) {
+        LOGERROR("Failed to write the backlog header\r\n");
+        // the next commit has to go to this copy again, not the good one
+        Header.Generation -= 1;
+        return false;
+    }
+    if (!sync()) {
+        Header.Generation -= 1;
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+bool BacklogStore::loadHeader() {
+    bool Found = false;
+
+    for (int i = 0; i < 2; ++i) {
+        BacklogHeader Copy;
+        if (fseek(File, i * BACKLOGHEADERSIZE, SEEK_SET) != 0 ||
+            fread(&Copy, sizeof(Copy), 1, File) != 1)
+            continue;
+
+        if (Copy.Magic != BACKLOGMAGIC || Copy.Version != BACKLOGVERSION ||
+            Copy.RecordSize != sizeof(BacklogRecord) || Copy.Capacity == 0 ||
+            Copy.Head >= Copy.Capacity || Copy.Count > Copy.Capacity ||
+            Copy.PortCount > BACKLOGMAXPORTS || Copy.CRC != headerCRC(Copy))
+            continue;
+
+        // keep the most recently written copy
+        if (!Found || (int32_t)(Copy.Generation - Header.Generation) > 0) {
+            Header = Copy;
+            Found = true;
+        }
+    }
+    return Found;
+}
+
+// ============================================================================
+bool BacklogStore::loadTable() {
+    memset(Table, 0, sizeof(Table));
+    size_t Size = Header.PortCount * sizeof(BacklogPort);
+
+    if (Size > 0 && (fseek(File, BACKLOGTABLESTART, SEEK_SET) != 0 ||
+                     fread(Table, Size, 1, File) != 1))
+        return false;
+
+    if (backlogCRC(Table, Size) == Header.TableCRC)
+        return true;
+
+    // an empty ring does not need its table, it was probably being rewritten
+    if (Header.Count == 0) {
+        Header.PortCount = 0;
+        return true;
+    }
+    return false;
+}
+
+// ============================================================================
+bool BacklogStore::sync() {
+    if (fflush(File) != 0)
+        return false;
+    return fsync(fileno(File)) == 0;
+}
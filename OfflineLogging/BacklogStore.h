@@ -0,0 +1,219 @@
+#ifndef BACKLOGSTORE_H
+#define BACKLOGSTORE_H
+/// \file
+/// \brief Persistent ring buffer that holds port readings that could not be
+/// sent to the database.
+///
+/// The backlog file is laid out like this:
+/// - two copies of a BacklogHeader, each in its own block
+/// - a table of BACKLOGMAXPORTS BacklogPort entries, so that port names and
+///   descriptions are stored once instead of with every reading
+/// - BACKLOGCAPACITY fixed-size BacklogRecord slots
+///
+/// Records are written and synced before the header that makes them visible,
+/// and the two header copies are written alternately. If the power goes out in
+/// the middle of a write, the newest header copy with a valid CRC still
+/// describes a consistent ring, so at most the sample set that was being
+/// written is lost.
+///
+/// tools/decode_backlog.py reads this format on a PC.
+
+#include "Structs.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+
+/// Identifies a backlog file ("IACB")
+#define BACKLOGMAGIC (0x42434149UL)
+
+/// Bumped whenever the layout of the file changes
+#define BACKLOGVERSION (3)
+
+/// Number of record slots in the ring. One record holds one port reading,
+/// so 2^18 slots is a bit over 6 days of 5 second samples from 10 ports.
+#define BACKLOGCAPACITY (1UL << 18)
+
+/// Space reserved for each header copy. A whole block, so that writing one
+/// copy cannot tear the other.
+#define BACKLOGHEADERSIZE (512)
+
+/// Number of entries in the port table
+#define BACKLOGMAXPORTS (64)
+
+/// Most records that are held in RAM before they are written to the card.
+/// 1536 bytes, which is a whole number of both records and 512 byte blocks.
+#define BACKLOGBUFFERRECORDS (128)
+
+/// Set in BacklogRecord::Flags on the first record of each sample set
+#define BACKLOGSETSTART (0x01)
+
+/// Set in BacklogRecord::Flags when the record holds an ADC code instead of
+/// a value
+#define BACKLOGADC (0x02)
+
+/// Header that describes where the data in the ring is.
+struct BacklogHeader {
+    uint32_t Magic;      ///< Always BACKLOGMAGIC
+    uint16_t Version;    ///< Always BACKLOGVERSION
+    uint16_t RecordSize; ///< sizeof(BacklogRecord)
+    uint32_t Capacity;   ///< Number of record slots in the file
+    uint32_t Head;       ///< Slot index of the oldest record
+    uint32_t Count;      ///< Number of committed records after Head
+    uint32_t PortCount;  ///< Number of entries in use in the port table
+    uint32_t TableCRC;   ///< CRC32 of the entries in use in the port table
+    uint32_t Generation; ///< Incremented on every header write
+    uint32_t CRC;        ///< CRC32 of every field above
+};
+
+/// A port that has readings in the backlog
+struct BacklogPort {
+    char Name[24];        ///< PortInfo::Name, cut off to fit
+    char Description[36]; ///< PortInfo::Description, cut off to fit
+    float Multiplier;     ///< Converts ADC codes to a value
+};
+
+/// One port reading stored in the backlog.
+struct BacklogRecord {
+    uint32_t Time; ///< When the set was read, from BoardSpecs::SampleTime
+    union {
+        float Value;   ///< The port reading
+        uint32_t Code; ///< ADC code from 0 to 65535 if BACKLOGADC is set
+    };
+    uint8_t Port;  ///< Index of the port in the port table
+    uint8_t Flags; ///< BACKLOGSETSTART and BACKLOGADC
+    uint16_t CRC;  ///< CRC16 of every field above
+};
+
+/// Fixed-size, power-loss safe FIFO of port readings on the SD card.
+/// Appending and dequeueing a sample set only touches the records involved
+/// and one header block, no matter how large the backlog is.
+///
+/// New sample sets are collected in a RAM buffer and written out together
+/// according to the flush policy (see setFlushPolicy()), when the buffer
+/// reaches the end of a program-size aligned window, or when flush() is
+/// called. Buffered sets are lost if the board resets before they are
+/// flushed.
+class BacklogStore {
+  public:
+    BacklogStore();
+    ~BacklogStore();
+
+    /// Opens FileName, or creates it if it does not exist.
+    /// A file that is not a valid backlog (e.g. a text log from an older
+    /// firmware) is renamed to FileName.old and a new backlog is started.
+    /// \returns true if the backlog is ready to use
+    bool open(const char *FileName);
+
+    /// Closes the backlog file. Everything committed stays on the card.
+    void close();
+
+    /// \returns true if a backlog file is open
+    bool isOpen() const { return File != NULL; }
+
+    /// \returns the name of the open backlog file
+    const char *fileName() const { return Name; }
+
+    /// \returns true if there are no readings in the backlog
+    bool empty() const { return size() == 0; }
+
+    /// \returns the number of readings in the backlog, buffered ones included
+    uint32_t size() const { return Header.Count + Unsynced + PendingCount; }
+
+    /// Sets when buffered sets are written to the card: once at least Records
+    /// readings are buffered, or once the oldest buffered set is Seconds old.
+    /// Records = 1 writes every set right away. Seconds = 0 turns off the
+    /// time limit.
+    void setFlushPolicy(uint32_t Records, uint32_t Seconds);
+
+    /// Writes the buffered sets to the card and commits them.
+    /// \returns true if nothing is left in RAM
+    bool flush();
+
+    /// Flushes if the oldest buffered set has been in RAM for longer than the
+    /// flush policy allows.
+    void poll();
+
+    /// Appends the values of all of the ports in Specs that are reported (see
+    /// PortInfo::reported()) as one sample set. If the ring is full, the
+    /// oldest sample sets are dropped.
+    /// \returns true if the set was buffered or committed
+    bool pushSet(BoardSpecs &Specs);
+
+    /// Reads the sample set that starts Offset records after the head.
+    /// Each reading is put in Out with the name and description of its port,
+    /// and the time the set was read is put in Time.
+    /// \returns the number of records that the set takes up, 0 if there is
+    /// no set at Offset
+    uint32_t readSet(uint32_t Offset, vector<PortInfo> &Out, time_t &Time);
+
+    /// Removes the sample set at the head of the ring.
+    /// \returns true if the records are gone from the file, false if the
+    /// backlog was empty or the header couldn't be written
+    bool popSet();
+
+    /// Removes Records records from the head of the ring with one header
+    /// write. Records should be a sum of lengths returned by readSet().
+    /// \returns true if the records are gone from the file, false if the
+    /// backlog was empty or the header couldn't be written
+    bool pop(uint32_t Records);
+
+  private:
+    /// Reads the record in Slot into Record
+    bool readRecord(uint32_t Slot, BacklogRecord &Record);
+
+    /// Writes the buffered records to the file without committing them
+    bool writePending();
+
+    /// \returns the number of records in the set at Offset records after the
+    /// head
+    uint32_t setLength(uint32_t Offset);
+
+    /// \returns the index of the entry with Port's name and multiplier in the
+    /// port table, adding it if it is not there yet, or -1 if the table is
+    /// full
+    int portIndex(const PortInfo &Port);
+
+    /// Makes the current header durable
+    bool commitHeader();
+
+    /// Reads both header copies and keeps the newest valid one
+    bool loadHeader();
+
+    /// Reads the port table that the header describes
+    bool loadTable();
+
+    /// Flushes stdio and FAT buffers out to the card
+    bool sync();
+
+    FILE *File;
+    BacklogHeader Header;
+    BacklogPort Table[BACKLOGMAXPORTS];
+    char Name[64];
+
+    /// Records that have not been written to the card yet. They go in the
+    /// slots right after the committed ones.
+    BacklogRecord Pending[BACKLOGBUFFERRECORDS];
+    uint32_t PendingCount;
+
+    /// Records after the committed ones that are in the file but are not in
+    /// the header yet. Only sets bigger than the buffer leave any behind
+    /// between calls.
+    uint32_t Unsynced;
+
+    /// Kernel::get_ms_count() when the oldest buffered set was added
+    uint64_t PendingSince;
+
+    /// Records per program-size aligned window of the file
+    uint32_t Window;
+
+    uint32_t FlushRecords;
+    uint32_t FlushSeconds;
+};
+
+/// \returns the CRC32 of Len bytes at Data
+uint32_t backlogCRC(const void *Data, size_t Len);
+
+#endif // BACKLOGSTORE
@@ -1,184 +1,143 @@
 /** @file
  \brief    Implementations for Data logging functions
 
+ All of these functions are wrappers around one BacklogStore that is opened
+ the first time any of them is called with a file name. They lock it, so they
+ can be called from the watchdog warning event as well as from main().
 */
 #include "OfflineLogging.h"
+#include "Profiling.h"
+#include "ConsoleLog.h"
 #include "debugging.h"
-// ============================================================================
-void dumpSensorDataToFile(BoardSpecs &Specs, const char *FileName) {
-    FILE *File = fopen(FileName, "r");
 
-    // if the file is not there, open in write, not append mode
-    if (File == NULL) {
-        printf("making new data file \r\n");
-        File = fopen(FileName, "wb");
+/// The backlog that every logging function works on
+static BacklogStore Backlog;
 
-        if (File == NULL) {
-            printf("Failed to open %s for logging. Skipping data logging\r\n",
-                   FileName);
-            return;
-        }
+/// Keeps more than one thread from using Backlog at the same time
+static Mutex BacklogLock;
 
-    } else {
-        printf("Appending data to data file \r\n");
-        fclose(File);
-        File = fopen(FileName, "ab");
-    }
+/// Makes sure that the backlog in FileName is the one that is open.
+/// \returns false if it could not be opened
+static bool openBacklog(const char *FileName) {
+    if (Backlog.isOpen() && strcmp(Backlog.fileName(), FileName) == 0)
+        return true;
 
-    // dump the data from all the sensors
-    int End = Specs.Ports.size();
-    for (int i = 0; i < End; ++i) {
+    return Backlog.open(FileName);
+}
 
-        // only dump the data if the port multipler != 0
-        if (Specs.Ports[i].Multiplier != 0.0f) {
+// ============================================================================
+void dumpSensorDataToFile(BoardSpecs &Specs, const char *FileName) {
+    BacklogLock.lock();
 
-            fprintf(File, "%s,%f,%s", Specs.Ports[i].Name.c_str(),
-                    Specs.Ports[i].Value, Specs.Ports[i].Description.c_str());
-            // I moved adding the \n down here because fprintf may have been
-            // botching it I am not sure though act as you feel is best
-            fputc('\n', File);
+    if (!openBacklog(FileName)) {
+        LOGERROR("Failed to open %s for logging. Skipping data logging\r\n",
+                 FileName);
+    } else {
+        LOGDEBUG("Appending data to data file \r\n");
+        Backlog.setFlushPolicy(Specs.LogFlushRecords, Specs.LogFlushSeconds);
+        PerfTimer Time(PerfBackupAppend);
+        if (!Backlog.pushSet(Specs)) {
+            LOGERROR("Failed to log data to %s\r\n", FileName);
         }
     }
 
-    fclose(File);
+    BacklogLock.unlock();
 }
 //=============================================================================
-// 1. get the number of ports the board has (n ports)
-// 2. go down n ports
-// 3. transfer the rest of the file to another file (the first n entries were
-// read earlier);
-// 4. delete the original file
 bool deleteDataEntry(BoardSpecs &Specs, const char *FileName) {
-    printf("Deleting data entry!\r\n");
-    // get the data for the ports
-    // only get the data for ports where the multiplier != 0
-    int Size = 0;
-    int End = Specs.Ports.size();
-    for (int i = 0; i < End; ++i) {
-        if (Specs.Ports[i].Multiplier != 0.0f) {
-            ++Size;
-        }
-    }
-
-    FILE *DataFile = fopen(FileName, "rb");
+    LOGDEBUG("Deleting data entry!\r\n");
+    BacklogLock.lock();
 
-    // if the file is not there, just return false (entry was not deleted)
-    if (DataFile == NULL) {
-        printf("Data file not found!\n");
-        return false;
-    }
-
-    // go down N port readings in the file
-    char *fgetstatus;
-    char Line[LINESIZE + 1];
-    while (Size > 0) {
-        fgetstatus = fgets(Line, LINESIZE, DataFile);
-        // in this case, you have already sent all the data entries and the
-        // backup file should be deleted
-        if (fgetstatus == NULL) {
-            fclose(DataFile);
-            remove(FileName);
-            return false;
-        }
-        --Size;
-    }
-    int flocation = ftell(DataFile);
-    if (fgets(Line, LINESIZE, DataFile) == NULL) {
-        fclose(DataFile);
-        remove(FileName);
-        printf("Removed DataFile\r\n");
-        return false;
+    bool More = false;
+    if (!openBacklog(FileName)) {
+        LOGWARN("Data file not found!\n");
+    } else {
+        PerfTimer Time(PerfBacklogPop);
+        Backlog.popSet();
+        More = !Backlog.empty();
     }
 
-    memset(Line, 0, LINESIZE + 1);
-
-    // reset file position
-    fseek(DataFile, flocation, SEEK_SET);
-
-    // at this point, you need get the remaining data into a different file
-    // We do not need to eat up all the memory, so we will do it in steps
-
-    // use constant backup filename
-    const char TempFileName[] = {"/sd/#~TemporaryFile.dat~#"};
+    BacklogLock.unlock();
+    return More;
+}
 
-    // open the file with that temp name
-    FILE *TempFile = fopen(TempFileName, "wb");
+// ============================================================================
+vector<PortInfo> getSensorDataFromFile(BoardSpecs &Specs,
+                                       const char *FileName) {
+    vector<PortInfo> output;
+    time_t Time;
+    BacklogLock.lock();
 
-    // stop if the file was not able to be opened
-    if (TempFile == NULL) {
-        printf("Failed to open temporary file!\n");
-        return true; // data still needs to be transmitted
+    // if the file is not there, just return an empty vector
+    if (!openBacklog(FileName)) {
+        LOGWARN("Data file not found!\n");
+    } else {
+        Backlog.readSet(0, output, Time);
     }
 
-    // transfer file contents
+    BacklogLock.unlock();
+    return output;
+}
 
-    while (fgets(Line, LINESIZE, DataFile) != NULL) {
-        fputs(Line, TempFile);
-        memset(Line, 0, LINESIZE + 1);
+// ============================================================================
+uint32_t readBackupSet(BoardSpecs &Specs, const char *FileName,
+                       uint32_t Offset, vector<PortInfo> &Ports,
+                       time_t &Time) {
+    uint32_t Length = 0;
+    Ports.clear();
+    BacklogLock.lock();
+
+    if (openBacklog(FileName)) {
+        PerfTimer Read(PerfBacklogRead);
+        Length = Backlog.readSet(Offset, Ports, Time);
     }
 
-    // close the data file
-    fclose(DataFile);
-    fclose(TempFile);
-
-    remove(FileName); // rename the DataFile
-    rename(TempFileName, FileName);
-    return true; // still data to read (probably)
+    BacklogLock.unlock();
+    return Length;
 }
 
 // ============================================================================
-vector<PortInfo> getSensorDataFromFile(BoardSpecs &Specs,
-                                       const char *FileName) {
-    FILE *DataFile = fopen(FileName, "rb");
-
-    // if the file is not there, just return an empty vector
-    if (DataFile == NULL) {
-        printf("Data file not found!\n");
-        return std::vector<PortInfo>(0);
-    }
-
-    // get the data for the ports
-    // only get the data for ports where the multiplier != 0
-    int Size = 0;
-    int End = Specs.Ports.size();
-    for (int i = 0; i < End; ++i) {
+bool deleteDataEntries(const char *FileName, uint32_t Records) {
+    bool Deleted = false;
+    BacklogLock.lock();
 
-        if (Specs.Ports[i].Multiplier != 0.0f) {
-            ++Size;
-        }
+    if (openBacklog(FileName)) {
+        PerfTimer Time(PerfBacklogPop);
+        Deleted = Backlog.pop(Records);
     }
-    // init vector to read data into
-    vector<PortInfo> output(Size);
-    char Line[LINESIZE + 1];
-    Line[LINESIZE] = 0;
 
-    for (int i = 0; i < Size; ++i) {
+    BacklogLock.unlock();
+    return Deleted;
+}
 
-        // grab all the data
-        fgets(Line, LINESIZE, DataFile);
+// ============================================================================
+bool checkForBackupFile(const char *FileName) {
+    bool Found = false;
+    BacklogLock.lock();
 
-        output[i].Name = strtok(Line, ",");
+    if (openBacklog(FileName))
+        Found = !Backlog.empty();
 
-        char *number = strtok(NULL, ",");
+    BacklogLock.unlock();
+    return Found;
+}
 
-        output[i].Value = atof(number);
+// ============================================================================
+void flushBackupFile(const char *FileName) {
+    BacklogLock.lock();
 
-        output[i].Description = strtok(NULL, "\n");
+    if (Backlog.isOpen() && strcmp(Backlog.fileName(), FileName) == 0)
+        Backlog.flush();
 
-        output[i].Multiplier = 1.0f;
-    }
-    fclose(DataFile);
-    return output;
+    BacklogLock.unlock();
 }
 
 // ============================================================================
-bool checkForBackupFile(const char *FileName) {
-    // try to open the file to see if it is there.
-    FILE *BackupFile = fopen(FileName, "rb");
+void pollBackupFile(const char *FileName) {
+    BacklogLock.lock();
 
-    if (BackupFile == NULL)
-        return false;
+    if (Backlog.isOpen() && strcmp(Backlog.fileName(), FileName) == 0)
+        Backlog.poll();
 
-    fclose(BackupFile);
-    return true;
+    BacklogLock.unlock();
 }
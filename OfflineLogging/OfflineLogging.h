@@ -4,6 +4,7 @@
 /// \brief Has prototypes for functions that log data that cannot be sent to a
 /// database
 
+#include "BacklogStore.h"
 #include "BoardConfig.h"
 
 #include <vector>
@@ -12,27 +13,49 @@
 #include <cstring>
 
 #include "Structs.h"
-/// The maximum number of characters for a line in a file when getting backup
-/// data.
-#define LINESIZE 128
 
 using namespace std;
 
-/// Deletes data entries store in FileName 
-/// It deletes N entries where N is the number of ports currently active.
-/// It also deletes the backup file when no entries are left.
+/// Deletes the oldest sample set stored in the backlog in FileName.
+/// That only moves the head of the backlog, nothing else in the file is
+/// rewritten.
+/// \returns true if there is still data left in the backlog
 bool deleteDataEntry(BoardSpecs &Specs, const char *FileName);
 
-/// Writes the sensor data in Specs to a file.
-/// It appends data if the file exists, and makes the file if it does not exist
+/// Writes the sensor data in Specs to the backlog in FileName as one sample
+/// set. The backlog is made if it does not exist.
+/// The set may be held in RAM for a while, as set by Specs.LogFlushRecords and
+/// Specs.LogFlushSeconds.
 void dumpSensorDataToFile(BoardSpecs &Specs, const char *FileName);
 
-/// Returns a single sensor reading from the file. That includes one sample from
-/// every active sensor. The size of the vector is the same size as the number
-/// of active ports in Specs
+/// Writes any sample sets that are held in RAM to the backlog in FileName.
+void flushBackupFile(const char *FileName);
+
+/// Writes the sample sets that are held in RAM to the backlog in FileName if
+/// the oldest one has been there longer than Specs.LogFlushSeconds.
+/// Should be called every polling cycle.
+void pollBackupFile(const char *FileName);
+
+/// Returns the oldest sample set from the backlog. That includes one sample
+/// from every port that was active when the set was logged.
 vector<PortInfo> getSensorDataFromFile(BoardSpecs &Specs, const char *FileName);
 
-/// Returns true if FileName exists in the current filesystem.
+/// Reads the sample set that is Offset records past the oldest data in the
+/// backlog. The readings go in Ports and the time they were taken goes in
+/// Time.
+/// \returns the number of records the set takes up, or 0 if there is no set
+/// at Offset. Adding that to Offset gives the offset of the next set.
+uint32_t readBackupSet(BoardSpecs &Specs, const char *FileName,
+                       uint32_t Offset, vector<PortInfo> &Ports, time_t &Time);
+
+/// Deletes Records records from the front of the backlog in FileName, with a
+/// single update to the file. This is how several sets that were read with
+/// readBackupSet() are deleted at once.
+/// \returns false if they couldn't be deleted, they are still in the backlog
+/// then
+bool deleteDataEntries(const char *FileName, uint32_t Records);
+
+/// Returns true if the backlog in FileName has data in it.
 /// A full file path may be necessary for this function to work.
 bool checkForBackupFile(const char *FileName);
 
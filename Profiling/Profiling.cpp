@@ -0,0 +1,109 @@
+/// \file
+/// \brief Implementation of the performance counters
+#include "Profiling.h"
+#include "ConsoleLog.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+/// Every counter, in the order of PerfCounter
+static PerfStats Counters[PERFCOUNTERS] = {
+    {"sample"},    {"append"},    {"read"},      {"pop"},
+    {"build"},     {"at_setup"},  {"at_join"},   {"at_address"},
+    {"at_connect"}, {"at_prompt"}, {"at_sent"},  {"at_reply"},
+    {"cycle"},
+};
+
+/// Kernel::get_ms_count() when the counters go with an upload next
+static uint64_t NextReport = PERFREPORTMS;
+
+// ============================================================================
+void startPerfCounters() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// ============================================================================
+uint32_t perfCycles() { return DWT->CYCCNT; }
+
+// ============================================================================
+uint32_t cyclesToMicros(uint32_t Cycles) {
+    return Cycles / (SystemCoreClock / 1000000);
+}
+
+// ============================================================================
+void recordPerf(PerfCounter Counter, uint32_t Micros) {
+    PerfStats &Stats = Counters[Counter];
+    Stats.MinUs = Stats.Count == 0 ? Micros : min(Stats.MinUs, Micros);
+    Stats.MaxUs = max(Stats.MaxUs, Micros);
+    Stats.TotalUs += Micros;
+    Stats.Count += 1;
+
+    int Bucket = 0;
+    while (Bucket < PERFBUCKETS - 1 && Micros >= (1UL << Bucket))
+        ++Bucket;
+    Stats.Histogram[Bucket] += 1;
+}
+
+// ============================================================================
+const PerfStats &getPerfStats(PerfCounter Counter) {
+    return Counters[Counter];
+}
+
+// ============================================================================
+void resetPerfCounters() {
+    for (int i = 0; i < PERFCOUNTERS; ++i) {
+        const char *Name = Counters[i].Name;
+        memset(&Counters[i], 0, sizeof(Counters[i]));
+        Counters[i].Name = Name;
+    }
+}
+
+// ============================================================================
+void printPerfCounters() {
+    LOGPRINT("\r\n%-11s %8s %10s %10s %10s  histogram (bucket i is under 2^i "
+             "us)\r\n",
+             "counter", "count", "min us", "mean us", "max us");
+
+    for (int i = 0; i < PERFCOUNTERS; ++i) {
+        const PerfStats &Stats = Counters[i];
+        if (Stats.Count == 0)
+            continue;
+
+        // each row is one message, so other messages can't split it
+        char Row[LOGLINEMAX];
+        size_t Length = snprintf(
+            Row, sizeof(Row), "%-11s %8lu %10lu %10lu %10lu ", Stats.Name,
+            (unsigned long)Stats.Count, (unsigned long)Stats.MinUs,
+            (unsigned long)(Stats.TotalUs / Stats.Count),
+            (unsigned long)Stats.MaxUs);
+
+        int First = 0;
+        while (Stats.Histogram[First] == 0)
+            ++First;
+        int Last = PERFBUCKETS - 1;
+        while (Stats.Histogram[Last] == 0)
+            --Last;
+
+        Length += snprintf(Row + Length, sizeof(Row) - Length, " %d:", First);
+        for (int Bucket = First; Bucket <= Last && Length < sizeof(Row);
+             ++Bucket) {
+            Length += snprintf(Row + Length, sizeof(Row) - Length, " %lu",
+                               (unsigned long)Stats.Histogram[Bucket]);
+        }
+        LOGPRINT("%s\r\n", Row);
+    }
+}
+
+// ============================================================================
+bool perfReportDue() {
+    uint64_t Now = Kernel::get_ms_count();
+    if (Now < NextReport)
+        return false;
+
+    NextReport = Now + PERFREPORTMS;
+    return true;
+}
@@ -0,0 +1,114 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+/// \file
+/// \brief Counters that time the firmware's hot paths with the Cortex-M4's
+/// DWT cycle counter.
+///
+/// Each PerfCounter keeps how often its code ran and the shortest, mean and
+/// longest time it took, along with a histogram. A PerfTimer times the scope
+/// that it is in. Each counter is only recorded from one thread at a time, so
+/// recording takes no lock; a counter that is printed while it is being
+/// recorded can be off by that one time.
+
+#include "mbed.h"
+
+#include <algorithm>
+#include <cstdint>
+
+/// Number of buckets in PerfStats::Histogram
+#define PERFBUCKETS (24)
+
+/// The counters go along with a live upload at most this often, in ms. See
+/// perfReportDue().
+#define PERFREPORTMS (900000)
+
+/// Times that are longer than this many ms are taken from the kernel's clock
+/// instead, since the 32 bit cycle counter wraps after about 35 s at 120 MHz
+#define PERFLONGMS (30000)
+
+/// The parts of the firmware that are timed
+enum PerfCounter {
+    PerfSample,       ///< reading every port for one frame
+    PerfBackupAppend, ///< adding a set of readings to the backup file
+    PerfBacklogRead,  ///< reading a backed up set to send it
+    PerfBacklogPop,   ///< deleting sets from the backup file once sent
+    PerfRequestBuild, ///< putting a request together, timed on the pass
+                      ///< that measures it, which does all of the work but
+                      ///< the UART writes. For backed up data that
+                      ///< includes reading the sets.
+    PerfATSetup,      ///< the AT commands, in the order of ATCommand
+    PerfATJoin,
+    PerfATAddress,
+    PerfATConnect,
+    PerfATPrompt,
+    PerfATSent,
+    PerfATReply,
+    PerfCycle,   ///< the network thread handling one frame, or one round of
+                 ///< sending backed up data
+    PERFCOUNTERS ///< number of counters
+};
+
+/// How long one PerfCounter's code has taken
+struct PerfStats {
+    const char *Name; ///< short name, with no spaces so it can go in a URL
+
+    uint32_t Count;   ///< times the code ran
+    uint64_t TotalUs; ///< time that it took in all, in microseconds
+    uint32_t MinUs;   ///< shortest time, 0 if Count is 0
+    uint32_t MaxUs;   ///< longest time
+
+    /// Histogram[i] counts times under 2^i microseconds, and not under the
+    /// bucket before. The last bucket counts the rest.
+    uint32_t Histogram[PERFBUCKETS];
+};
+
+/// Starts the DWT cycle counter. The counters can't time anything before
+/// this is called.
+void startPerfCounters();
+
+/// \returns the DWT cycle counter
+uint32_t perfCycles();
+
+/// \returns the microseconds in Cycles of the core clock
+uint32_t cyclesToMicros(uint32_t Cycles);
+
+/// Adds one run of Micros microseconds to Counter
+void recordPerf(PerfCounter Counter, uint32_t Micros);
+
+/// \returns what Counter has recorded
+const PerfStats &getPerfStats(PerfCounter Counter);
+
+/// Sets every counter back to 0
+void resetPerfCounters();
+
+/// Prints every counter that has recorded something as a table, with the
+/// histogram buckets from the first one that counted something to the last
+void printPerfCounters();
+
+/// \returns true if the counters should go with the next live upload, and
+/// starts waiting PERFREPORTMS for the one after it. The counters aren't
+/// reset once they are sent, so a lost upload loses nothing.
+bool perfReportDue();
+
+/// Times the scope it is in, and adds the time to Counter when it ends
+class PerfTimer {
+  public:
+    explicit PerfTimer(PerfCounter Counter)
+        : Counter(Counter), StartCycles(perfCycles()),
+          StartMs(Kernel::get_ms_count()) {}
+
+    ~PerfTimer() {
+        uint64_t Ms = Kernel::get_ms_count() - StartMs;
+        recordPerf(Counter,
+                   Ms > PERFLONGMS
+                       ? (uint32_t)std::min<uint64_t>(Ms * 1000, UINT32_MAX)
+                       : cyclesToMicros(perfCycles() - StartCycles));
+    }
+
+  private:
+    PerfCounter Counter;
+    uint32_t StartCycles;
+    uint64_t StartMs;
+};
+
+#endif // PROFILING_H
@@ -0,0 +1,269 @@
+/// \file
+/// \brief Implementation of the port reading functions
+#include "Sampling.h"
+#include "ConsoleLog.h"
+#include "debugging.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ============================================================================
+float filterBurst(uint16_t *Codes, size_t Count, SampleFilter Filter,
+                  int32_t &Raw) {
+    Raw = -1;
+    if (Count == 0)
+        return 0.0f;
+
+    switch (Filter) {
+    case FilterMedian:
+        nth_element(Codes, Codes + Count / 2, Codes + Count);
+        Raw = Codes[Count / 2];
+        return Raw;
+
+    case FilterMin:
+        Raw = *min_element(Codes, Codes + Count);
+        return Raw;
+
+    case FilterMax:
+        Raw = *max_element(Codes, Codes + Count);
+        return Raw;
+
+    case FilterRMS: {
+        // 256 squared 16 bit codes fit in 48 bits
+        uint64_t Sum = 0;
+        for (size_t i = 0; i < Count; ++i)
+            Sum += (uint32_t)Codes[i] * Codes[i];
+        return sqrtf((float)Sum / Count);
+    }
+
+    default: {
+        uint32_t Sum = 0;
+        for (size_t i = 0; i < Count; ++i)
+            Sum += Codes[i];
+
+        // a single reading is still an exact ADC code
+        if (Count == 1)
+            Raw = Sum;
+        return (float)Sum / Count;
+    }
+    }
+}
+
+// ============================================================================
+void readPorts(AnalogIn *Pins, size_t NumPins, BoardSpecs &Specs,
+               SampleFrame &Frame) {
+    Frame.Time = time(NULL);
+    Frame.Config = Specs.ConfigVersion;
+
+    size_t End = Specs.Ports.size();
+    if (End > FRAMEPORTS)
+        End = FRAMEPORTS;
+    Frame.Count = End;
+
+    // only the sampling thread reads ports, so this can stay off its stack
+    static uint16_t Burst[SAMPLEMAXBURST];
+
+    for (size_t i = 0; i < End; ++i) {
+        PortInfo &Port = Specs.Ports[i];
+        Frame.Values[i] = 0.0f;
+        Frame.Raw[i] = -1;
+
+        // only reads the port if a port is connected. Power ports are filled
+        // in below.
+        if (Port.Multiplier == 0.0f || Port.Power != PowerNone || i >= NumPins)
+            continue;
+
+        // read the port in a burst and combine the readings, keeping the ADC
+        // code for logging if the result is one
+        size_t Count = Port.Samples;
+        if (Count < 1)
+            Count = 1;
+        if (Count > SAMPLEMAXBURST)
+            Count = SAMPLEMAXBURST;
+        for (size_t j = 0; j < Count; ++j)
+            Burst[j] = Pins[i].read_u16();
+
+        float Code = filterBurst(Burst, Count, Port.Filter, Frame.Raw[i]);
+        Frame.Values[i] = Code / 65535.0f * Port.Multiplier;
+
+        // set error indicator if the sample is out of range
+        if (Frame.Values[i] > Port.RangeCeiling) {
+            Frame.Raw[i] = -1;
+            Frame.Values[i] = HUGE_VAL;
+            LOGWARN("\r\nPort value exceeded valid sample value range, "
+                    "assigning "
+                    "error value\r\n");
+        } else if (Frame.Values[i] < Port.RangeFloor) {
+            Frame.Raw[i] = -1;
+            Frame.Values[i] = -HUGE_VAL;
+            LOGWARN("\r\nPort value is under the valid sample range, "
+                    "assigning "
+                    "error value\r\n");
+        }
+        // print data
+        LOGDEBUG("\r\n%s's value = %f\r\n", Port.Name.c_str(), Frame.Values[i]);
+    }
+
+    for (size_t p = 0; p < Specs.Powers.size(); ++p) {
+        const PowerInfo &Power = Specs.Powers[p];
+        if (Power.FirstPort + POWERQUANTITIES > End ||
+            (size_t)Power.CurrentPort >= NumPins ||
+            (size_t)Power.VoltagePort >= NumPins)
+            continue;
+
+        float Results[POWERQUANTITIES];
+        capturePower(Pins[Power.CurrentPort], Pins[Power.VoltagePort], Power,
+                     Specs.Ports[Power.CurrentPort].Multiplier,
+                     Specs.Ports[Power.VoltagePort].Multiplier, Results);
+
+        for (int q = 0; q < POWERQUANTITIES; ++q) {
+            Frame.Values[Power.FirstPort + q] = Results[q];
+            LOGDEBUG("\r\n%s's value = %f\r\n",
+                     Specs.Ports[Power.FirstPort + q].Name.c_str(), Results[q]);
+        }
+    }
+}
+
+/// Flag in PowerFlags that is set when the next power sample is due
+#define POWERTICK (1)
+
+/// Wakes capturePower() for each sample. Only the sampling thread waits on it.
+static EventFlags PowerFlags;
+
+/// Timeout handler that marks the next power sample as due
+static void powerTick() { PowerFlags.set(POWERTICK); }
+
+// ============================================================================
+void capturePower(AnalogIn &Current, AnalogIn &Voltage, const PowerInfo &Power,
+                  float CurrentMultiplier, float VoltageMultiplier,
+                  float *Results) {
+    uint32_t Count = Power.Cycles * POWERSAMPLESPERCYCLE;
+    uint32_t Period = 1000000.0f / (Power.Frequency * POWERSAMPLESPERCYCLE);
+
+    // sums of ADC codes, so the whole window is kept in exact integer math
+    uint32_t SumI = 0, SumV = 0;
+    uint64_t SumII = 0, SumVV = 0, SumIV = 0;
+
+    // only the sampling thread captures power, so one Timeout is enough
+    static Timeout Tick;
+    Timer Clock;
+    Clock.start();
+    uint32_t Next = 0;
+
+    for (uint32_t n = 0; n < Count; ++n) {
+        // sleep until the next sample time, so the window covers whole cycles
+        // and the lower priority threads can run in between
+        int32_t Left = (int32_t)(Next - (uint32_t)Clock.read_us());
+        if (Left > 0) {
+            Tick.attach_us(callback(&powerTick), Left);
+            PowerFlags.wait_any(POWERTICK);
+        }
+        Next += Period;
+
+        uint32_t I = Current.read_u16();
+        uint32_t V = Voltage.read_u16();
+
+        SumI += I;
+        SumV += V;
+        SumII += I * I;
+        SumVV += V * V;
+        SumIV += I * V;
+    }
+
+    // Count^2 times the variances and covariance, with the DC offset of the
+    // sensors taken out. These can't overflow for up to POWERMAXCYCLES cycles.
+    int64_t N = Count;
+    int64_t VarI = N * (int64_t)SumII - (int64_t)SumI * SumI;
+    int64_t VarV = N * (int64_t)SumVV - (int64_t)SumV * SumV;
+    int64_t CovIV = N * (int64_t)SumIV - (int64_t)SumI * SumV;
+
+    // convert from codes to units
+    float ScaleI = CurrentMultiplier / (65535.0f * Count);
+    float ScaleV = VoltageMultiplier / (65535.0f * Count);
+
+    float IRMS = sqrtf((float)VarI) * ScaleI;
+    float VRMS = sqrtf((float)VarV) * ScaleV;
+    float Real = (float)CovIV * ScaleI * ScaleV;
+    float Apparent = IRMS * VRMS;
+
+    Results[0] = IRMS;
+    Results[1] = VRMS;
+    Results[2] = Real;
+    Results[3] = Apparent;
+    Results[4] = Apparent > 0.0f ? Real / Apparent : 0.0f;
+}
+
+// ============================================================================
+void applyFrame(const SampleFrame &Frame, BoardSpecs &Specs) {
+    Specs.SampleTime = Frame.Time;
+
+    size_t End = Specs.Ports.size();
+    for (size_t i = 0; i < End; ++i) {
+        if (i < Frame.Count) {
+            Specs.Ports[i].Value = Frame.Values[i];
+            Specs.Ports[i].Raw = Frame.Raw[i];
+        } else {
+            // ports without a pin have nothing to report
+            Specs.Ports[i].Value = 0.0f;
+            Specs.Ports[i].Raw = -1;
+        }
+    }
+}
+
+// ============================================================================
+bool markChanges(BoardSpecs &Specs) {
+    bool Any = false;
+
+    for (size_t i = 0; i < Specs.Ports.size(); ++i) {
+        PortInfo &Port = Specs.Ports[i];
+        if (Port.Multiplier == 0.0f)
+            continue;
+
+        Port.Report = Port.Deadband <= 0.0f || Port.LastReport == 0 ||
+                      fabsf(Port.Value - Port.LastValue) > Port.Deadband ||
+                      (Port.MaxSilence > 0 &&
+                       Specs.SampleTime - Port.LastReport >= Port.MaxSilence);
+
+        if (Port.Report) {
+            Port.LastValue = Port.Value;
+            Port.LastReport = Specs.SampleTime;
+            Any = true;
+        }
+    }
+    return Any;
+}
+
+// ============================================================================
+bool SampleRing::push(const SampleFrame &Frame) {
+    uint32_t End = Tail.load(memory_order_relaxed);
+    uint32_t Used = End - Head.load(memory_order_acquire);
+    if (Used >= SAMPLERINGFRAMES)
+        return false;
+
+    Frames[End % SAMPLERINGFRAMES] = Frame;
+
+    // the frame has to be in place before the consumer can see it
+    Tail.store(End + 1, memory_order_release);
+
+    if (Used + 1 > HighWater)
+        HighWater = Used + 1;
+    return true;
+}
+
+// ============================================================================
+bool SampleRing::pop(SampleFrame &Frame) {
+    uint32_t Start = Head.load(memory_order_relaxed);
+    if (Start == Tail.load(memory_order_acquire))
+        return false;
+
+    Frame = Frames[Start % SAMPLERINGFRAMES];
+
+    // the slot can be reused once the frame has been copied out
+    Head.store(Start + 1, memory_order_release);
+    return true;
+}
+
+// ============================================================================
+uint32_t SampleRing::size() const {
+    return Tail.load(memory_order_acquire) - Head.load(memory_order_acquire);
+}
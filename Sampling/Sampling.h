@@ -0,0 +1,126 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+/// \file
+/// \brief Functions that read the analog ports
+
+#include "Structs.h"
+#include "mbed.h"
+
+#include <atomic>
+#include <ctime>
+
+using namespace std;
+
+/// The most ports that a SampleFrame holds readings for. Enough for every pin
+/// and the ports of two PowerInfo pairs.
+#define FRAMEPORTS (10 + 2 * POWERQUANTITIES)
+
+/// Number of times each mains cycle is sampled when computing power
+#define POWERSAMPLESPERCYCLE (32)
+
+/// Number of frames that SampleRing holds. Must be a power of 2.
+#define SAMPLERINGFRAMES (16)
+
+/// One reading of every port, taken at the same time.
+/// Index i holds the reading of BoardSpecs::Ports[i].
+struct SampleFrame {
+    /// When the ports were read, in seconds from the board's clock
+    time_t Time;
+
+    /// Number of ports in the frame
+    unsigned int Count;
+
+    /// BoardSpecs::ConfigVersion of the config that the ports were read
+    /// with, so the readings go with the right ports while a new config is
+    /// swapped in
+    uint32_t Config;
+
+    /// The port readings, see PortInfo::Value
+    float Values[FRAMEPORTS];
+
+    /// The ADC codes the readings came from, see PortInfo::Raw
+    int32_t Raw[FRAMEPORTS];
+
+    SampleFrame() : Time(0), Count(0), Config(0) {}
+};
+
+/// Combines Count ADC codes into one code with Filter. The codes may be
+/// reordered. Raw is set to the result if it is one of the codes, and -1 if it
+/// isn't.
+/// \returns the combined code, from 0 to 65535
+float filterBurst(uint16_t *Codes, size_t Count, SampleFilter Filter,
+                  int32_t &Raw);
+
+/// Reads every active port in Specs into Frame. Each port is read
+/// PortInfo::Samples times back to back and the readings are combined with
+/// PortInfo::Filter. Ports computed from a PowerInfo pair are filled in with
+/// capturePower(). Pins[i] is the analog input that Specs.Ports[i] is
+/// connected to, and there are NumPins of them.
+/// Readings outside of a port's range are set to +/-HUGE_VAL.
+/// Specs is only read, so this can run while another thread uses the
+/// readings in Specs.
+void readPorts(AnalogIn *Pins, size_t NumPins, BoardSpecs &Specs,
+               SampleFrame &Frame);
+
+/// Samples Current and Voltage together POWERSAMPLESPERCYCLE times per cycle
+/// for Power.Cycles mains cycles, and computes the POWERQUANTITIES results in
+/// the order of PowerQuantity, starting at PowerIRMS. The DC offset of both
+/// sensors is removed before the RMS values and the power are computed.
+/// The multipliers convert ADC readings to units, like PortInfo::Multiplier.
+/// The thread sleeps between samples, so this can only be called from the
+/// sampling thread, and not from an interrupt.
+void capturePower(AnalogIn &Current, AnalogIn &Voltage, const PowerInfo &Power,
+                  float CurrentMultiplier, float VoltageMultiplier,
+                  float *Results);
+
+/// Copies the readings and the time in Frame into Specs, so that they can be
+/// sent or logged.
+void applyFrame(const SampleFrame &Frame, BoardSpecs &Specs);
+
+/// Decides which ports in Specs are reported this time and sets
+/// PortInfo::Report on them. A port is reported if it has no deadband, if it
+/// has never been reported, if its value has moved more than its deadband
+/// since it was last reported, or if it has been quiet for its MaxSilence.
+/// \returns true if any port is reported
+bool markChanges(BoardSpecs &Specs);
+
+/// Fixed-size FIFO of frames between one thread that reads the ports and one
+/// thread that sends them. It never locks, so a thread that is blocked on the
+/// ESP8266 can't hold up the one that reads the ports.
+/// push() may only be called from one thread, and pop() from one other
+/// thread.
+class SampleRing {
+  public:
+    SampleRing() : Head(0), Tail(0), HighWater(0) {}
+
+    /// Adds a copy of Frame to the end of the ring.
+    /// \returns false if the ring is full
+    bool push(const SampleFrame &Frame);
+
+    /// Takes the oldest frame out of the ring and puts it in Frame.
+    /// \returns false if the ring is empty
+    bool pop(SampleFrame &Frame);
+
+    /// \returns the number of frames in the ring
+    uint32_t size() const;
+
+    /// \returns the most frames that have been in the ring at once
+    uint32_t highWater() const { return HighWater; }
+
+    /// \returns the number of frames the ring can hold
+    uint32_t capacity() const { return SAMPLERINGFRAMES; }
+
+  private:
+    SampleFrame Frames[SAMPLERINGFRAMES];
+
+    /// Total number of frames popped. Only written by pop().
+    atomic<uint32_t> Head;
+
+    /// Total number of frames pushed. Only written by push().
+    atomic<uint32_t> Tail;
+
+    /// Only written by push()
+    volatile uint32_t HighWater;
+};
+
+#endif // SAMPLING
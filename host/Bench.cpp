@@ -0,0 +1,390 @@
+/// \file
+/// \brief Times the offline logging and upload code on a PC and prints the
+/// results as JSON, so that runs from different firmware versions can be
+/// compared.
+///
+/// Every result has the operations per second, the bytes and 512 byte blocks
+/// written to the simulated SD card per operation, and the heap allocations
+/// (operator new calls) per operation. Run with --help for the options.
+
+#include "ATCmdParser.h"
+#include "EspSim.h"
+#include "HostFS.h"
+#include "HttpStandIn.h"
+#include "Networking.h"
+#include "OfflineLogging.h"
+#include "UARTSerial.h"
+#include "mbed.h"
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/// operator new calls since the program started
+static atomic<uint64_t> NewCalls(0);
+
+void *operator new(size_t Size) {
+    NewCalls += 1;
+    void *Block = malloc(Size ? Size : 1);
+    if (Block == NULL)
+        abort();
+    return Block;
+}
+
+void *operator new[](size_t Size) { return operator new(Size); }
+void operator delete(void *Block) noexcept { free(Block); }
+void operator delete[](void *Block) noexcept { free(Block); }
+void operator delete(void *Block, size_t) noexcept { free(Block); }
+void operator delete[](void *Block, size_t) noexcept { free(Block); }
+
+/// Counts that are taken before and after a benchmark
+struct Sample {
+    uint64_t Micros;
+    uint64_t Allocations;
+    HostFSStats Card;
+
+    static Sample now() {
+        Sample S;
+        S.Micros = hostMicros();
+        S.Allocations = NewCalls;
+        S.Card = hostFSStats();
+        return S;
+    }
+};
+
+/// Where the JSON goes, and whether a result has been written yet
+static FILE *Out;
+static bool FirstResult = true;
+
+/// Writes one result. Extra is more JSON members, starting with a comma.
+static void result(const char *Name, const string &Extra, uint64_t Ops,
+                   const Sample &Start, const Sample &End) {
+    double Seconds = (End.Micros - Start.Micros) / 1000000.0;
+    double N = Ops ? Ops : 1;
+
+    fprintf(Out,
+            "%s\n    {\"bench\": \"%s\"%s, \"ops\": %llu, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f, \"bytes_per_op\": %.1f, "
+            "\"blocks_per_op\": %.3f, \"syncs_per_op\": %.3f, "
+            "\"allocs_per_op\": %.2f}",
+            FirstResult ? "" : ",", Name, Extra.c_str(),
+            (unsigned long long)Ops, Seconds, Seconds > 0 ? Ops / Seconds : 0,
+            (End.Card.BytesWritten - Start.Card.BytesWritten) / N,
+            (End.Card.BlocksWritten - Start.Card.BlocksWritten) / N,
+            (End.Card.Syncs - Start.Card.Syncs) / N,
+            (End.Allocations - Start.Allocations) / N);
+    fflush(Out);
+    FirstResult = false;
+    fprintf(stderr, "  %s%s: %llu ops in %.3f s\n", Name, Extra.c_str(),
+            (unsigned long long)Ops, Seconds);
+}
+
+/// \returns board settings with Count active ports that have readings
+static BoardSpecs makeSpecs(int Count) {
+    BoardSpecs Specs;
+    Specs.DatabaseTableName = "Bench-Board";
+    Specs.RemoteIP = "192.168.43.220";
+    Specs.RemotePort = 80;
+    Specs.HostName = "localhost";
+    Specs.RemoteDir = "/seniorDesign/bulk_sensor_readings.php";
+    Specs.SampleTime = 1700000000;
+
+    for (int i = 0; i < Count; ++i) {
+        PortInfo Port;
+        Port.Name = "Port_" + to_string(i);
+        Port.Description = "Current in Amps";
+        Port.Multiplier = 133.33f;
+        Port.RangeCeiling = 1000.0f;
+        Port.Raw = (i * 2731) % 65536;
+        Port.Value = Port.Raw / 65535.0f * Port.Multiplier;
+        Specs.Ports.push_back(Port);
+    }
+    encodeRequestParts(Specs);
+    return Specs;
+}
+
+/// Fills a new backlog in FileName until it holds at least Records records
+static void fill(BoardSpecs &Specs, const char *FileName, uint32_t Records) {
+    uint16_t Flush = Specs.LogFlushRecords;
+    Specs.LogFlushRecords = BACKLOGBUFFERRECORDS;
+    uint32_t Sets = (Records + Specs.Ports.size() - 1) / Specs.Ports.size();
+    for (uint32_t i = 0; i < Sets; ++i) {
+        Specs.SampleTime += 5;
+        dumpSensorDataToFile(Specs, FileName);
+    }
+    flushBackupFile(FileName);
+    Specs.LogFlushRecords = Flush;
+}
+
+/// Times dumpSensorDataToFile(), getSensorDataFromFile() and
+/// deleteDataEntry() with Records records already in the backlog
+static void backlogBench(uint32_t Records, uint32_t Ops) {
+    const int Ports = 10;
+    string Name = "/sd/bench_" + to_string(Records) + ".dat";
+    const char *FileName = Name.c_str();
+
+    const char *Policies[] = {"sync", "buffered"};
+    uint16_t FlushRecords[] = {1, 50};
+
+    for (int p = 0; p < 2; ++p) {
+        BoardSpecs Specs = makeSpecs(Ports);
+        Specs.LogFlushRecords = FlushRecords[p];
+        remove(FileName);
+        fill(Specs, FileName, Records);
+
+        string Extra = ", \"records\": " + to_string(Records) +
+                       ", \"ports\": " + to_string(Ports) +
+                       ", \"policy\": \"" + Policies[p] + "\"";
+
+        Sample Start = Sample::now();
+        for (uint32_t i = 0; i < Ops; ++i) {
+            Specs.SampleTime += 5;
+            dumpSensorDataToFile(Specs, FileName);
+        }
+        flushBackupFile(FileName);
+        result("dumpSensorDataToFile", Extra, Ops, Start, Sample::now());
+
+        // reading and deleting don't depend on the flush policy
+        if (p > 0)
+            continue;
+
+        Start = Sample::now();
+        for (uint32_t i = 0; i < Ops; ++i) {
+            vector<PortInfo> Set = getSensorDataFromFile(Specs, FileName);
+        }
+        result("getSensorDataFromFile", Extra, Ops, Start, Sample::now());
+
+        Start = Sample::now();
+        uint32_t Deleted = 0;
+        while (Deleted < Ops) {
+            ++Deleted;
+            if (!deleteDataEntry(Specs, FileName))
+                break;
+        }
+        result("deleteDataEntry", Extra, Deleted, Start, Sample::now());
+    }
+    remove(FileName);
+}
+
+/// Times both writeGetReq() overloads and writeCborReq() for Ports ports
+static void requestBench(int Ports, uint32_t Ops) {
+    BoardSpecs Specs = makeSpecs(Ports);
+    string Extra = ", \"ports\": " + to_string(Ports);
+    static char Buf[8192];
+
+    size_t Bytes = 0;
+    Sample Start = Sample::now();
+    for (uint32_t i = 0; i < Ops; ++i)
+        Bytes = writeGetReq(Buf, sizeof(Buf), Specs);
+    result("writeGetReq", Extra + ", \"request_bytes\": " + to_string(Bytes),
+           Ops, Start, Sample::now());
+
+    Start = Sample::now();
+    for (uint32_t i = 0; i < Ops; ++i)
+        Bytes = writeGetReq(Buf, sizeof(Buf), Specs.Ports, Specs);
+    result("writeGetReq(vector)",
+           Extra + ", \"request_bytes\": " + to_string(Bytes), Ops, Start,
+           Sample::now());
+
+    // with the port names, and after the server has the port table
+    for (int Names = 1; Names >= 0; --Names) {
+        Start = Sample::now();
+        for (uint32_t i = 0; i < Ops; ++i)
+            Bytes = writeCborReq(Buf, sizeof(Buf), Specs, Names);
+        result("writeCborReq",
+               Extra + ", \"names\": " + (Names ? "true" : "false") +
+                   ", \"request_bytes\": " + to_string(Bytes),
+               Ops, Start, Sample::now());
+    }
+}
+
+/// Sends a backlog of Sets sample sets through the simulated ESP8266 and
+/// server, one set per request or in batches of up to Batch bytes, with up to
+/// Links requests in flight. The UART is raised to Baud with setESPBaud()
+/// first.
+static void drainBench(int Sets, UploadEncoding Encoding, uint16_t Batch,
+                       bool KeepAlive, int Baud, int ServerMs, int Links = 1) {
+    const int Ports = 10;
+    const char *FileName = "/sd/bench_drain.dat";
+
+    EspSimConfig Config;
+    Config.JoinMs = 10;
+    Config.ServerMs = ServerMs;
+
+    HttpStandIn Server(5.0f, NULL);
+    EspSim Esp(Config, Server);
+    HostUARTDevice = &Esp;
+
+    UARTSerial Serial(PTC17, PTC16, ESPBAUD);
+    ATCmdParser Parser(&Serial);
+    Parser.set_delimiter("\r\n");
+    Parser.set_timeout(3000);
+
+    BoardSpecs Specs = makeSpecs(Ports);
+    Specs.BatchBytes = Batch;
+    Specs.KeepAlive = KeepAlive;
+    Specs.UploadLinks = Links;
+    Specs.Encoding = Encoding;
+    Specs.UARTBaud = Baud;
+    Specs.FlowControl = Baud > ESPBAUD;
+    encodeRequestParts(Specs);
+    remove(FileName);
+    fill(Specs, FileName, Sets * Ports);
+
+    setESPBaud(&Parser, &Serial, Specs);
+    startESP(&Parser);
+    connectESPWiFi(&Parser, Specs);
+
+    EspSimStats Before = Esp.stats();
+    Sample Start = Sample::now();
+    int Failures = 0;
+    while (checkForBackupFile(FileName) && Failures < 10) {
+        float Rate = -1.0f;
+        int Err;
+        if (Links > 1) {
+            Err = sendBacklogPipelinedTCP(&Parser, Specs, FileName, Rate);
+        } else if (Batch) {
+            Err = sendBackupBatchTCP(&Parser, Specs, FileName, Rate);
+        } else {
+            Err = sendBackupDataTCP(&Parser, Specs, FileName, Rate);
+            if (Err == NETWORKSUCCESS)
+                deleteDataEntry(Specs, FileName);
+        }
+        if (Err != NETWORKSUCCESS)
+            ++Failures;
+    }
+    Sample End = Sample::now();
+    EspSimStats After = Esp.stats();
+
+    string Extra = ", \"sets\": " + to_string(Sets) +
+                   ", \"ports\": " + to_string(Ports) + ", \"mode\": \"" +
+                   (Batch ? "batch" : "single") + "\", \"encoding\": \"" +
+                   (Encoding == EncodeCBOR ? "cbor" : "get") +
+                   "\", \"batch_bytes\": " + to_string(Batch) +
+                   ", \"keepalive\": " +
+                   (KeepAlive ? "true" : "false") +
+                   ", \"baud\": " + to_string(Specs.UARTBaud) +
+                   ", \"server_ms\": " + to_string(ServerMs) +
+                   ", \"links\": " + to_string(Links) +
+                   ", \"most_in_flight\": " + to_string(After.MostLinks) +
+                   ", \"requests\": " + to_string(Server.stats().Requests) +
+                   ", \"cipsends\": " + to_string(After.Sends - Before.Sends) +
+                   ", \"values\": " + to_string(Server.stats().Values) +
+                   ", \"request_bytes\": " + to_string(Server.stats().Bytes) +
+                   ", \"uart_bytes\": " +
+                   to_string(After.BytesIn + After.BytesOut - Before.BytesIn -
+                             Before.BytesOut) +
+                   ", \"failures\": " + to_string(Failures) +
+                   ", \"drained\": " +
+                   (checkForBackupFile(FileName) ? "false" : "true");
+    result("drain", Extra, Sets, Start, End);
+
+    remove(FileName);
+    HostUARTDevice = NULL;
+}
+
+/// Prints the options
+static void usage(const char *Program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --out FILE   write the JSON to FILE instead of stdout\n"
+            "  --dir DIR    folder for the backlog files (bench_sd)\n"
+            "  --quick      smaller backlogs and fewer operations\n"
+            "  --only NAME  only run backlog, request or drain\n"
+            "  --verbose    show the firmware's output\n",
+            Program);
+}
+
+int main(int argc, char **argv) {
+    hostMicros(); // start the clock
+
+    const char *OutName = NULL;
+    string Dir = "bench_sd";
+    string Only;
+    bool Quick = false;
+    bool Verbose = false;
+
+    for (int i = 1; i < argc; ++i) {
+        string Arg = argv[i];
+        if (Arg == "--out" && i + 1 < argc)
+            OutName = argv[++i];
+        else if (Arg == "--dir" && i + 1 < argc)
+            Dir = argv[++i];
+        else if (Arg == "--only" && i + 1 < argc)
+            Only = argv[++i];
+        else if (Arg == "--quick")
+            Quick = true;
+        else if (Arg == "--verbose")
+            Verbose = true;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // the firmware prints a lot, keep it out of the JSON unless it is wanted
+    Out = OutName ? fopen(OutName, "w") : fdopen(dup(fileno(stdout)), "w");
+    if (Out == NULL) {
+        perror(OutName);
+        return 1;
+    }
+    if (!Verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    hostFSInit("sd", Dir.c_str());
+
+    fprintf(Out, "{\n  \"format\": 1,\n  \"quick\": %s,\n  \"results\": [",
+            Quick ? "true" : "false");
+
+    if (Only.empty() || Only == "backlog") {
+        // the ring holds BACKLOGCAPACITY records, so the largest size is a
+        // full ring, where every new set drops the oldest one
+        vector<uint32_t> Sizes = {10, 100, 1000, 10000, 100000,
+                                  BACKLOGCAPACITY};
+        if (Quick)
+            Sizes = {10, 1000, 100000};
+        fprintf(stderr, "backlog\n");
+        for (uint32_t Size : Sizes)
+            backlogBench(Size, Quick ? 200 : 2000);
+    }
+
+    if (Only.empty() || Only == "request") {
+        fprintf(stderr, "request\n");
+        for (int Ports = 1; Ports <= 64; Ports *= 2)
+            requestBench(Ports, Quick ? 2000 : 20000);
+    }
+
+    if (Only.empty() || Only == "drain") {
+        fprintf(stderr, "drain\n");
+        int Sets = Quick ? 10 : 50;
+        for (UploadEncoding Encoding : {EncodeGet, EncodeCBOR}) {
+            drainBench(Sets, Encoding, 0, false, 115200, 80);
+            drainBench(Sets, Encoding, 0, true, 115200, 80);
+            drainBench(Sets, Encoding, 2048, true, 115200, 80);
+            drainBench(Sets, Encoding, BATCHMAX, true, 115200, 80);
+
+            // a faster UART mostly helps the big requests
+            drainBench(Sets, Encoding, 0, true, 921600, 80);
+            drainBench(Sets, Encoding, 2048, true, 921600, 80);
+            drainBench(Sets, Encoding, BATCHMAX, true, 921600, 80);
+
+            // a far away server, where pipelining the requests helps most
+            for (int Links : {1, 4}) {
+                drainBench(Sets, Encoding, 0, true, 921600, 400, Links);
+                drainBench(Sets, Encoding, 2048, true, 921600, 400, Links);
+            }
+        }
+    }
+
+    fprintf(Out, "\n  ]\n}\n");
+    fclose(Out);
+
+    // the simulators' threads don't need to be waited for
+    _exit(0);
+}
@@ -0,0 +1,383 @@
+/// \file
+/// \brief Implementation of the simulated ESP8266
+#include "EspSim.h"
+
+#include <algorithm>
+
+// ============================================================================
+EspSim::EspSim(const EspSimConfig &Config, HttpStandIn &Server)
+    : Config(Config), Server(Server), Random(Config.Seed), OutEnd(0),
+      DataLeft(0), DataLink(0), Joined(false), Outage(0), Rejoin(false) {
+    ByteUs = 10 * 1000000.0 / Config.Baud; // start bit, 8 data bits, stop bit
+    BoardBaud = Config.Baud;
+    BoardFlow = false;
+    Flow = false;
+    for (int i = 0; i < ESPLINKS; ++i)
+        Links[i] = Link{false, 0, string(), 0, 0, false};
+}
+
+// ============================================================================
+void EspSim::setBaud(int Baud) {
+    lock_guard<mutex> Guard(Lock);
+    BoardBaud = Baud;
+}
+
+// ============================================================================
+void EspSim::setFlowControl(bool On) {
+    lock_guard<mutex> Guard(Lock);
+    BoardFlow = On;
+}
+
+// ============================================================================
+bool EspSim::wired() { return BoardBaud == Config.Baud && BoardFlow == Flow; }
+
+// ============================================================================
+bool EspSim::heard() { return wired() && Config.Baud <= Config.MaxBaud; }
+
+// ============================================================================
+EspSimStats EspSim::stats() {
+    lock_guard<mutex> Guard(Lock);
+    Stats.Baud = Config.Baud;
+    return Stats;
+}
+
+// ============================================================================
+uint64_t EspSim::emit(const string &Data) {
+    if (!heard()) {
+        Stats.Garbled += Data.size();
+        return OutEnd;
+    }
+
+    Chunk New;
+    New.Start = max(OutEnd, hostMicros());
+    New.Data = Data;
+    New.Sent = 0;
+    New.ByteUs = ByteUs;
+    OutEnd = New.Start + (uint64_t)(Data.size() * ByteUs);
+    Out.push_back(New);
+    return OutEnd;
+}
+
+// ============================================================================
+void EspSim::schedule(const string &Data, double DelayMs, int Link,
+                      bool Close) {
+    Event New = {hostMicros() + (uint64_t)(DelayMs * 1000), Data, Link,
+                 Link >= 0 ? Links[Link].Opened : 0, Close};
+    auto Where = upper_bound(
+        Events.begin(), Events.end(), New,
+        [](const Event &A, const Event &B) { return A.At < B.At; });
+    Events.insert(Where, New);
+}
+
+// ============================================================================
+void EspSim::release() {
+    uint64_t Now = hostMicros();
+    while (!Events.empty() && Events.front().At <= Now) {
+        Event Due = Events.front();
+        Events.erase(Events.begin());
+
+        if (Due.Link < 0) {
+            emit(Due.Data);
+            continue;
+        }
+
+        // the response is lost with its connection
+        Link &On = Links[Due.Link];
+        if (!On.Open || On.Opened != Due.Opened)
+            continue;
+
+        On.Waiting = false;
+        uint64_t Done = emit(Due.Data);
+        Stats.Latency.push_back((Done - On.SendStart) / 1000.0);
+        On.LastRequest = Done;
+        if (Due.Close)
+            close(Due.Link);
+    }
+}
+
+// ============================================================================
+void EspSim::close(int Id) {
+    if (Links[Id].Open) {
+        Links[Id].Open = false;
+        Links[Id].Waiting = false;
+        emit(to_string(Id) + ",CLOSED\r\n");
+    }
+}
+
+// ============================================================================
+void EspSim::update() {
+    updateOutage();
+    expireIdle();
+    release();
+}
+
+// ============================================================================
+void EspSim::received(const char *Bytes, size_t Size) {
+    // the board can't send faster than the wire
+    wait_us(Size * 10 * 1000000.0 / BoardBaud);
+
+    lock_guard<mutex> Guard(Lock);
+    Stats.BytesIn += Size;
+    update();
+
+    // the ESP8266 can't make sense of bytes at another rate
+    if (!wired()) {
+        Stats.Garbled += Size;
+        return;
+    }
+
+    for (size_t i = 0; i < Size; ++i) {
+        if (DataLeft > 0) {
+            Data += Bytes[i];
+            if (--DataLeft == 0)
+                payload();
+            continue;
+        }
+
+        Line += Bytes[i];
+        if (Line.size() >= 2 && Line.compare(Line.size() - 2, 2, "\r\n") == 0) {
+            Line.resize(Line.size() - 2);
+            if (!Line.empty())
+                command(Line);
+            Line.clear();
+        }
+    }
+}
+
+// ============================================================================
+void EspSim::command(const string &Cmd) {
+    Stats.Commands += 1;
+    if (Config.Echo)
+        emit(Cmd + "\r\n");
+
+    if (Cmd == "AT" || Cmd == "AT+CWMODE=3" || Cmd == "AT+CIPMUX=1") {
+        emit("\r\nOK\r\n");
+
+    } else if (Cmd == "ATE0" || Cmd == "ATE1") {
+        Config.Echo = Cmd == "ATE1";
+        emit("\r\nOK\r\n");
+
+    } else if (Cmd.compare(0, 12, "AT+CIPCLOSE=") == 0) {
+        // 5 closes them all
+        int Id = atoi(Cmd.c_str() + 12);
+        for (int i = 0; i < ESPLINKS; ++i) {
+            if (i == Id || Id == ESPLINKS)
+                close(i);
+        }
+        emit("\r\nOK\r\n");
+
+    } else if (Cmd.compare(0, 12, "AT+UART_CUR=") == 0) {
+        int Baud = 0, Bits = 0, Stop = 0, Parity = 0, Control = 0;
+        if (sscanf(Cmd.c_str() + 12, "%d,%d,%d,%d,%d", &Baud, &Bits, &Stop,
+                   &Parity, &Control) != 5 ||
+            Baud < 110 || Bits != 8 || Stop != 1 || Parity != 0) {
+            emit("\r\nERROR\r\n");
+        } else {
+            // the answer goes out at the old rate
+            emit("\r\nOK\r\n");
+            Config.Baud = Baud;
+            ByteUs = 10 * 1000000.0 / Baud;
+            Flow = Control == 3;
+        }
+
+    } else if (Cmd.compare(0, 9, "AT+CWJAP=") == 0) {
+        if (Config.WiFi && Outage != 1) {
+            Joined = true;
+            schedule("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n",
+                     Config.JoinMs);
+        } else {
+            Joined = false;
+            schedule("+CWJAP:3\r\n\r\nFAIL\r\n", Config.JoinMs);
+        }
+
+    } else if (Cmd == "AT+CIFSR") {
+        emit(string("+CIFSR:APIP,\"192.168.4.1\"\r\n"
+                    "+CIFSR:APMAC,\"1a:fe:34:00:00:01\"\r\n"
+                    "+CIFSR:STAIP,\"") +
+             (Joined ? "192.168.43.50" : "0.0.0.0") +
+             "\"\r\n+CIFSR:STAMAC,\"18:fe:34:00:00:01\"\r\n\r\nOK\r\n");
+
+    } else if (Cmd.compare(0, 12, "AT+CIPSTART=") == 0) {
+        int Id = atoi(Cmd.c_str() + 12);
+        if (Id < 0 || Id >= ESPLINKS) {
+            emit("\r\nERROR\r\n");
+        } else if (!Joined) {
+            emit("no ip\r\n\r\nERROR\r\n");
+        } else if (Links[Id].Open) {
+            emit("ALREADY CONNECTED\r\n\r\nERROR\r\n");
+        } else {
+            Link &New = Links[Id];
+            New.Open = true;
+            New.Opened += 1;
+            New.LastRequest = hostMicros();
+            New.Request.clear();
+            Stats.Connects += 1;
+            schedule(to_string(Id) + ",CONNECT\r\n\r\nOK\r\n",
+                     Config.ConnectMs);
+        }
+
+    } else if (Cmd.compare(0, 11, "AT+CIPSEND=") == 0) {
+        int Id = -1, Length = 0;
+        sscanf(Cmd.c_str() + 11, "%d,%d", &Id, &Length);
+        if (Id < 0 || Id >= ESPLINKS || Length <= 0) {
+            emit("\r\nERROR\r\n");
+        } else if (!Links[Id].Open) {
+            emit("link is not valid\r\n\r\nERROR\r\n");
+        } else {
+            if (Links[Id].Request.empty())
+                Links[Id].SendStart = hostMicros();
+            DataLink = Id;
+            DataLeft = Length;
+            Data.clear();
+            emit("\r\nOK\r\n> ");
+        }
+
+    } else {
+        emit("\r\nERROR\r\n");
+    }
+}
+
+// ============================================================================
+void EspSim::payload() {
+    Stats.Sends += 1;
+    emit("\r\nRecv " + to_string(Data.size()) + " bytes\r\n");
+
+    uniform_real_distribution<double> Chance(0.0, 1.0);
+    if (Chance(Random) < Config.Drop) {
+        Stats.Dropped += 1;
+        emit("\r\nSEND FAIL\r\n");
+        close(DataLink);
+        return;
+    }
+    emit("\r\nSEND OK\r\n");
+
+    // a request can take several AT+CIPSENDs
+    Link &On = Links[DataLink];
+    On.Request += Data;
+    if (!HttpStandIn::complete(On.Request))
+        return;
+    string Whole;
+    Whole.swap(On.Request);
+
+    if (Chance(Random) < Config.Loss) {
+        Stats.Lost += 1;
+        return;
+    }
+
+    On.Waiting = true;
+    int Waiting = 0;
+    for (int i = 0; i < ESPLINKS; ++i)
+        Waiting += Links[i].Waiting;
+    Stats.MostLinks = max(Stats.MostLinks, Waiting);
+
+    // the server works on requests on different links at the same time
+    bool KeepAlive;
+    string Response = Server.handle(Whole, KeepAlive);
+    string Packets;
+    size_t Most = Config.IpdMax > 0 ? Config.IpdMax : Response.size();
+    for (size_t At = 0; At < Response.size(); At += Most) {
+        string Piece = Response.substr(At, Most);
+        Packets += "\r\n+IPD," + to_string(DataLink) + "," +
+                   to_string(Piece.size()) + ":" + Piece;
+    }
+    schedule(Packets, Config.ServerMs, DataLink, !KeepAlive);
+}
+
+// ============================================================================
+void EspSim::expireIdle() {
+    if (Config.IdleCloseMs <= 0)
+        return;
+    for (int i = 0; i < ESPLINKS; ++i) {
+        if (Links[i].Open && !Links[i].Waiting &&
+            hostMicros() > Links[i].LastRequest + Config.IdleCloseMs * 1000ULL)
+            close(i);
+    }
+}
+
+// ============================================================================
+uint64_t EspSim::nextOutageChange() {
+    if (Config.OutageMs <= 0 || Outage == 2)
+        return UINT64_MAX;
+    return (Config.OutageAtMs + (Outage == 1 ? Config.OutageMs : 0)) * 1000ULL;
+}
+
+// ============================================================================
+void EspSim::updateOutage() {
+    while (hostMicros() >= nextOutageChange()) {
+        if (Outage == 0) {
+            // everything goes down with the access point
+            Rejoin = Joined;
+            for (int i = 0; i < ESPLINKS; ++i)
+                close(i);
+            if (Joined) {
+                Joined = false;
+                emit("WIFI DISCONNECT\r\n");
+            }
+        } else if (Rejoin) {
+            // the ESP8266 joins again on its own
+            Joined = true;
+            schedule("WIFI CONNECTED\r\nWIFI GOT IP\r\n", Config.JoinMs);
+        }
+        Outage += 1;
+    }
+}
+
+// ============================================================================
+bool EspSim::ready(uint64_t Now) {
+    if (Out.empty())
+        return false;
+    const Chunk &First = Out.front();
+    return First.Start + (uint64_t)(First.Sent * First.ByteUs) <= Now;
+}
+
+// ============================================================================
+size_t EspSim::transmit(char *Bytes, size_t Size) {
+    lock_guard<mutex> Guard(Lock);
+    update();
+
+    uint64_t Now = hostMicros();
+    size_t Copied = 0;
+    while (Copied < Size && ready(Now)) {
+        Chunk &First = Out.front();
+        Bytes[Copied++] = First.Data[First.Sent++];
+        if (First.Sent == First.Data.size())
+            Out.pop_front();
+    }
+    Stats.BytesOut += Copied;
+    return Copied;
+}
+
+// ============================================================================
+bool EspSim::waitReadable(int Timeout) {
+    uint64_t End = hostMicros() + (uint64_t)max(Timeout, 0) * 1000;
+    while (true) {
+        uint64_t Next;
+        {
+            lock_guard<mutex> Guard(Lock);
+            update();
+            uint64_t Now = hostMicros();
+            if (ready(Now))
+                return true;
+            if (Now >= End)
+                return false;
+
+            // sleep until the next byte arrives, or until the timeout
+            Next = End;
+            if (!Out.empty()) {
+                const Chunk &First = Out.front();
+                Next = min(Next, First.Start +
+                                     (uint64_t)(First.Sent * First.ByteUs));
+            }
+            for (int i = 0; i < ESPLINKS; ++i) {
+                if (Config.IdleCloseMs > 0 && Links[i].Open)
+                    Next = min<uint64_t>(Next, Links[i].LastRequest +
+                                                   Config.IdleCloseMs * 1000ULL);
+            }
+            if (!Events.empty())
+                Next = min(Next, Events.front().At);
+            Next = min(Next, nextOutageChange());
+            Next = max(Next, Now + 1) - Now;
+        }
+        wait_us(Next);
+    }
+}
@@ -0,0 +1,196 @@
+#ifndef ESPSIM_H
+#define ESPSIM_H
+/// \file
+/// \brief Simulated ESP8266 that answers the AT commands the firmware sends,
+/// with configurable delays and failures.
+
+#include "HttpStandIn.h"
+#include "UARTSerial.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// Link ids that the ESP8266 has, 0 to 4
+#define ESPLINKS (5)
+
+/// How the simulated ESP8266, WiFi network and server behave
+struct EspSimConfig {
+    int Baud;          ///< UART speed that the ESP8266 starts at, each byte
+                       ///< takes 10 bits of wire time
+    int MaxBaud;       ///< fastest rate the wiring carries to the board.
+                       ///< Above it, the ESP8266 still hears the board, but
+                       ///< the board can't hear it
+    bool Echo;         ///< echo commands back, like the ESP8266 does by default
+    bool WiFi;         ///< whether the access point is there to join
+    int JoinMs;        ///< time for AT+CWJAP to finish
+    int ConnectMs;     ///< time for AT+CIPSTART to open a connection
+    int ServerMs;      ///< time from SEND OK until the server's response
+    double Loss;       ///< chance that a request gets no response
+    double Drop;       ///< chance that the connection drops during a send
+    int IdleCloseMs;   ///< server closes kept-alive connections after this
+                       ///< long without a request, 0 never
+    int OutageAtMs;    ///< the access point goes away this long after the
+                       ///< start
+    int OutageMs;      ///< and comes back after this long, 0 for no outage
+    int IpdMax;        ///< most response bytes in one +IPD, longer responses
+                       ///< come in several like TCP segments do
+    unsigned Seed;     ///< for the random failures
+
+    EspSimConfig()
+        : Baud(115200), MaxBaud(921600), Echo(true), WiFi(true), JoinMs(2000), ConnectMs(40),
+          ServerMs(80), Loss(0.0), Drop(0.0), IdleCloseMs(0), OutageAtMs(0),
+          OutageMs(0), IpdMax(1460), Seed(1) {}
+};
+
+/// What the simulated ESP8266 has done
+struct EspSimStats {
+    uint64_t BytesIn;    ///< bytes from the board
+    uint64_t BytesOut;   ///< bytes to the board
+    uint64_t Commands;   ///< AT commands
+    uint64_t Connects;   ///< connections opened
+    uint64_t Sends;      ///< AT+CIPSEND payloads
+    uint64_t Lost;       ///< requests that got no response
+    uint64_t Dropped;    ///< connections dropped during a send
+    uint64_t Garbled;    ///< bytes lost because the two ends of the UART
+                         ///< were set up differently
+    int Baud;            ///< the ESP8266's baud rate
+    vector<double> Latency; ///< ms from AT+CIPSEND until the whole response
+                            ///< has reached the board, for every response
+    int MostLinks;       ///< most links that had a request in flight at once
+
+    EspSimStats()
+        : BytesIn(0), BytesOut(0), Commands(0), Connects(0), Sends(0),
+          Lost(0), Dropped(0), Garbled(0), Baud(0), MostLinks(0) {}
+};
+
+/// Sits on the other end of the host's UARTSerial. Everything it sends is
+/// timed by the baud rate and the delays in EspSimConfig, so the firmware
+/// sees the same waits it would on the board.
+class EspSim : public HostDevice {
+  public:
+    EspSim(const EspSimConfig &Config, HttpStandIn &Server);
+
+    void received(const char *Data, size_t Size) override;
+    size_t transmit(char *Data, size_t Size) override;
+    bool waitReadable(int Timeout) override;
+    void setBaud(int Baud) override;
+    void setFlowControl(bool On) override;
+
+    EspSimStats stats();
+
+  private:
+    /// Bytes for the board that start arriving at Start
+    struct Chunk {
+        uint64_t Start; ///< hostMicros()
+        string Data;
+        size_t Sent;    ///< bytes already read by the board
+        double ByteUs;  ///< wire time of one byte at the rate it was sent at
+    };
+
+    /// Output that waits for something that takes a while: the WiFi being
+    /// joined, a connection being opened or the server answering. It goes
+    /// out when it is due, so it doesn't hold up what is queued after it.
+    struct Event {
+        uint64_t At;        ///< hostMicros() when it is due
+        string Data;
+        int Link;           ///< link that it is a response on, or -1
+        unsigned Opened;    ///< Link::Opened when the request came
+        bool Close;         ///< the server closes Link after the response
+    };
+
+    /// One of the ESP8266's TCP connections
+    struct Link {
+        bool Open;
+        unsigned Opened;      ///< times the link was opened
+        string Request;       ///< payloads of the request that is not
+                              ///< complete yet
+        uint64_t SendStart;   ///< when the first AT+CIPSEND of the request
+                              ///< came in
+        uint64_t LastRequest; ///< hostMicros() of the last response
+        bool Waiting;         ///< the server hasn't answered its request yet
+    };
+
+    /// Queues Data to start arriving after everything already queued has
+    /// arrived. Lock has to be held.
+    /// \returns hostMicros() when the last byte of Data arrives
+    uint64_t emit(const string &Data);
+
+    /// Queues Data to be emitted DelayMs from now, as a response on Link if
+    /// it isn't -1. Lock has to be held.
+    void schedule(const string &Data, double DelayMs, int Link = -1,
+                  bool Close = false);
+
+    /// Emits the events that are due. Lock has to be held.
+    void release();
+
+    /// Closes Link, and tells the board. Lock has to be held.
+    void close(int Id);
+
+    /// \returns true if both ends of the UART have the same settings, so
+    /// that the ESP8266 can make sense of what the board sends. Lock has to
+    /// be held.
+    bool wired();
+
+    /// \returns true if the board can make sense of what the ESP8266 sends.
+    /// Lock has to be held.
+    bool heard();
+
+    /// Handles one line from the board. Lock has to be held.
+    void command(const string &Line);
+
+    /// Handles a finished AT+CIPSEND payload. Lock has to be held.
+    void payload();
+
+    /// Closes kept-alive connections that have been idle for too long. Lock
+    /// has to be held.
+    void expireIdle();
+
+    /// Starts and ends the WiFi outage when it is time to. Lock has to be
+    /// held.
+    void updateOutage();
+
+    /// \returns hostMicros() when the outage starts or ends next, or
+    /// UINT64_MAX. Lock has to be held.
+    uint64_t nextOutageChange();
+
+    /// \returns true if the first queued byte has arrived. Lock has to be
+    /// held.
+    bool ready(uint64_t Now);
+
+    /// Catches up with the time: the outage, idle connections and due events.
+    /// Lock has to be held.
+    void update();
+
+    EspSimConfig Config;
+    HttpStandIn &Server;
+    EspSimStats Stats;
+    mt19937 Random;
+
+    mutex Lock;
+    deque<Chunk> Out;
+    vector<Event> Events; ///< in the order they are due
+    uint64_t OutEnd; ///< hostMicros() when the last queued byte arrives
+    double ByteUs;   ///< wire time of one byte at the ESP8266's rate
+    int BoardBaud;   ///< the board's baud rate
+    bool BoardFlow;  ///< the board uses RTS/CTS
+    bool Flow;       ///< the ESP8266 uses RTS/CTS
+
+    string Line;       ///< command being received
+    size_t DataLeft;   ///< payload bytes still expected
+    string Data;       ///< payload being received
+    int DataLink;      ///< link that the payload is for
+
+    bool Joined;
+    Link Links[ESPLINKS];
+    int Outage;   ///< 0 before the outage, 1 during it, 2 after it
+    bool Rejoin;  ///< the ESP8266 was joined when the outage started
+};
+
+#endif // ESPSIM_H
@@ -0,0 +1,251 @@
+/// \file
+/// \brief Runs the firmware on a PC against a simulated ESP8266, web server
+/// and SD card, and reports how it did.
+///
+/// The firmware's main() is built as firmwareMain() and runs in its own
+/// thread at wall-clock speed. Run with --help for the options.
+
+#include "EspSim.h"
+#include "HostFS.h"
+#include "HttpStandIn.h"
+#include "Networking.h"
+#include "mbed.h"
+
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+
+using namespace std;
+
+/// The firmware's main()
+int firmwareMain();
+
+/// Prints the options
+static void usage(const char *Program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --sd DIR         directory that holds the SD card's files "
+            "(sd)\n"
+            "  --seconds N      how long to run the firmware for (60)\n"
+            "  --baud N         ESP8266 UART speed at the start (115200)\n"
+            "  --max-baud N     fastest UART speed the wiring carries "
+            "(921600)\n"
+            "  --server-ms N    server response time in ms (80)\n"
+            "  --connect-ms N   time to open a connection in ms (40)\n"
+            "  --join-ms N      time to join the WiFi network in ms (2000)\n"
+            "  --loss P         chance that a request gets no response (0)\n"
+            "  --drop P         chance that a connection drops during a "
+            "send (0)\n"
+            "  --idle-close N   server closes idle kept-alive connections "
+            "after N ms (0, never)\n"
+            "  --outage S,N     the access point goes away S seconds in, "
+            "for N seconds\n"
+            "  --no-wifi        the access point can't be joined\n"
+            "  --no-echo        the ESP8266 doesn't echo commands\n"
+            "  --samplerate S   sample rate the server sends back (5)\n"
+            "  --pad N          pad the server's responses to N bytes (0)\n"
+            "  --chunked        send the responses' bodies in chunks\n"
+            "  --http-errors P  chance that the server answers 503 (0)\n"
+            "  --ipd-max N      most response bytes in one +IPD (1460)\n"
+            "  --csv FILE       write every reading the server gets to FILE\n"
+            "  --config-version N,FILE\n"
+            "                   the server announces config N and serves "
+            "FILE for it\n"
+            "  --config-after K announce it after K requests (0)\n"
+            "  --seed N         seed for the random failures (1)\n"
+            "  --quiet          hide the firmware's output\n",
+            Program);
+}
+
+/// Prints what happened during the run to Report
+static void report(FILE *Report, double Seconds, EspSim &Esp,
+                   HttpStandIn &Server) {
+    EspSimStats Link = Esp.stats();
+    HttpStats Http = Server.stats();
+    HostFSStats Card = hostFSStats();
+
+    vector<double> &Latency = Link.Latency;
+    sort(Latency.begin(), Latency.end());
+    double Mean = 0;
+    for (double L : Latency)
+        Mean += L;
+    if (!Latency.empty())
+        Mean /= Latency.size();
+    double P50 = Latency.empty() ? 0 : Latency[Latency.size() / 2];
+    double P99 = Latency.empty() ? 0 : Latency[Latency.size() * 99 / 100];
+    double Max = Latency.empty() ? 0 : Latency.back();
+
+    fprintf(Report, "\n---- host run: %.1f s ----\n", Seconds);
+    fprintf(Report,
+            "requests answered   %llu (%.2f/s), %llu 503s, %llu with "
+            "counters\n",
+            (unsigned long long)Http.Requests, Http.Requests / Seconds,
+            (unsigned long long)Http.Errors,
+            (unsigned long long)Http.PerfReports);
+    fprintf(Report, "config fetches      %llu\n",
+            (unsigned long long)Http.ConfigFetches);
+    fprintf(Report, "readings stored     %llu (%.2f/s), %llu not finite\n",
+            (unsigned long long)Http.Values, Http.Values / Seconds,
+            (unsigned long long)Http.BadValues);
+    fprintf(Report, "request latency ms  mean %.1f  p50 %.1f  p99 %.1f  "
+                    "max %.1f\n",
+            Mean, P50, P99, Max);
+    fprintf(Report,
+            "esp8266             %llu commands, %llu connects, %llu sends, "
+            "%llu lost, %llu dropped\n",
+            (unsigned long long)Link.Commands,
+            (unsigned long long)Link.Connects, (unsigned long long)Link.Sends,
+            (unsigned long long)Link.Lost, (unsigned long long)Link.Dropped);
+    fprintf(Report,
+            "uart bytes          %llu to the esp, %llu from it, %llu "
+            "garbled, at %d baud\n",
+            (unsigned long long)Link.BytesIn,
+            (unsigned long long)Link.BytesOut,
+            (unsigned long long)Link.Garbled, Link.Baud);
+    fprintf(Report,
+            "sd card             %llu bytes written, %llu blocks "
+            "programmed, %llu syncs\n",
+            (unsigned long long)Card.BytesWritten,
+            (unsigned long long)Card.BlocksWritten,
+            (unsigned long long)Card.Syncs);
+
+    // how long the ESP8266 took to answer each kind of command. Bucket i of
+    // the histogram is under 2^i ms.
+    fprintf(Report, "at commands         answers timeouts errors  mean ms  "
+                    "timeout ms  histogram\n");
+    for (int c = 0; c < ATCOMMANDS; ++c) {
+        const CommandTiming &Timing = getCommandTiming((ATCommand)c);
+        fprintf(Report, "  %-17s %7u %8u %6u %8.1f %11u ", Timing.Name,
+                Timing.Answers, Timing.Timeouts, Timing.Errors, Timing.Mean,
+                commandTimeout((ATCommand)c));
+        for (int b = 0; b < LATENCYBUCKETS; ++b)
+            fprintf(Report, " %u", Timing.Histogram[b]);
+        fprintf(Report, "\n");
+    }
+    fflush(Report);
+}
+
+int main(int argc, char **argv) {
+    hostMicros(); // start the clock
+
+    EspSimConfig Config;
+    string SDDir = "sd";
+    double Seconds = 60;
+    float SampleRate = 5.0f;
+    size_t Pad = 0;
+    bool Chunked = false;
+    double HttpErrors = 0;
+    const char *CSVName = NULL;
+    unsigned long ConfigVersion = 0;
+    string ConfigName;
+    unsigned long ConfigAfter = 0;
+    bool Quiet = false;
+
+    for (int i = 1; i < argc; ++i) {
+        string Arg = argv[i];
+        bool HasValue = i + 1 < argc;
+        if (Arg == "--sd" && HasValue)
+            SDDir = argv[++i];
+        else if (Arg == "--seconds" && HasValue)
+            Seconds = atof(argv[++i]);
+        else if (Arg == "--baud" && HasValue)
+            Config.Baud = atoi(argv[++i]);
+        else if (Arg == "--max-baud" && HasValue)
+            Config.MaxBaud = atoi(argv[++i]);
+        else if (Arg == "--server-ms" && HasValue)
+            Config.ServerMs = atoi(argv[++i]);
+        else if (Arg == "--connect-ms" && HasValue)
+            Config.ConnectMs = atoi(argv[++i]);
+        else if (Arg == "--join-ms" && HasValue)
+            Config.JoinMs = atoi(argv[++i]);
+        else if (Arg == "--loss" && HasValue)
+            Config.Loss = atof(argv[++i]);
+        else if (Arg == "--drop" && HasValue)
+            Config.Drop = atof(argv[++i]);
+        else if (Arg == "--idle-close" && HasValue)
+            Config.IdleCloseMs = atoi(argv[++i]);
+        else if (Arg == "--samplerate" && HasValue)
+            SampleRate = atof(argv[++i]);
+        else if (Arg == "--pad" && HasValue)
+            Pad = atoi(argv[++i]);
+        else if (Arg == "--chunked")
+            Chunked = true;
+        else if (Arg == "--http-errors" && HasValue)
+            HttpErrors = atof(argv[++i]);
+        else if (Arg == "--ipd-max" && HasValue)
+            Config.IpdMax = atoi(argv[++i]);
+        else if (Arg == "--csv" && HasValue)
+            CSVName = argv[++i];
+        else if (Arg == "--config-version" && HasValue) {
+            char Name[256] = "";
+            sscanf(argv[++i], "%lu,%255s", &ConfigVersion, Name);
+            ConfigName = Name;
+        } else if (Arg == "--config-after" && HasValue)
+            ConfigAfter = strtoul(argv[++i], NULL, 10);
+        else if (Arg == "--seed" && HasValue)
+            Config.Seed = atoi(argv[++i]);
+        else if (Arg == "--outage" && HasValue) {
+            double At = 0, Length = 0;
+            sscanf(argv[++i], "%lf,%lf", &At, &Length);
+            Config.OutageAtMs = At * 1000;
+            Config.OutageMs = Length * 1000;
+        } else if (Arg == "--no-wifi")
+            Config.WiFi = false;
+        else if (Arg == "--no-echo")
+            Config.Echo = false;
+        else if (Arg == "--quiet")
+            Quiet = true;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // the report goes to the real stdout even if the firmware's output
+    // is hidden
+    FILE *Report = fdopen(dup(fileno(stdout)), "w");
+    if (Quiet && freopen("/dev/null", "w", stdout) == NULL) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    FILE *CSV = NULL;
+    if (CSVName != NULL && (CSV = fopen(CSVName, "w")) == NULL) {
+        perror(CSVName);
+        return 1;
+    }
+
+    string ConfigText;
+    if (ConfigVersion != 0) {
+        FILE *File = fopen(ConfigName.c_str(), "rb");
+        if (File == NULL) {
+            perror(ConfigName.c_str());
+            return 1;
+        }
+        char Buffer[4096];
+        size_t Got;
+        while ((Got = fread(Buffer, 1, sizeof(Buffer), File)) > 0)
+            ConfigText.append(Buffer, Got);
+        fclose(File);
+    }
+
+    hostFSInit("sd", SDDir.c_str());
+    HttpStandIn Server(SampleRate, CSV, Pad);
+    Server.setChunked(Chunked);
+    Server.setErrorRate(HttpErrors);
+    if (ConfigVersion != 0)
+        Server.setConfig(ConfigVersion, ConfigText, ConfigAfter);
+    EspSim Esp(Config, Server);
+    HostUARTDevice = &Esp;
+
+    thread([]() { firmwareMain(); }).detach();
+    wait_us(Seconds * 1000000);
+
+    fflush(stdout);
+    report(Report, Seconds, Esp, Server);
+    if (CSV)
+        fflush(CSV);
+
+    // the firmware never returns, so don't wait for its threads
+    _exit(0);
+}
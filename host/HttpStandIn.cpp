@@ -0,0 +1,398 @@
+/// \file
+/// \brief Implementation of the web server stand-in
+#include "HttpStandIn.h"
+
+#include "MbedCRC.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+// ============================================================================
+HttpStandIn::HttpStandIn(float SampleRate, FILE *CSV, size_t MinResponse)
+    : SampleRate(SampleRate), CSV(CSV), MinResponse(MinResponse),
+      Chunked(false), ErrorRate(0.0), ConfigVersion(0), ConfigAfter(0),
+      Random(1) {}
+
+// ============================================================================
+void HttpStandIn::setConfig(uint32_t Version, const string &Text,
+                            uint64_t After) {
+    lock_guard<mutex> Guard(Lock);
+    ConfigVersion = Version;
+    ConfigText = Text;
+    ConfigAfter = After;
+}
+
+/// \returns the value of the Name= parameter that starts at Query[At],
+/// which ends at the next & or space
+static string paramValue(const string &Query, size_t At) {
+    size_t End = Query.find_first_of("& \r\n", At);
+    return Query.substr(At, End == string::npos ? string::npos : End - At);
+}
+
+/// \returns the value of the Content-Length header in Request, or 0
+static size_t contentLength(const string &Request, size_t HeadEnd) {
+    size_t At = Request.find("Content-Length: ");
+    if (At == string::npos || At > HeadEnd)
+        return 0;
+    return strtoul(Request.c_str() + At + 16, NULL, 10);
+}
+
+/// Reads the parts of CBOR that the firmware writes
+struct CborReader {
+    const uint8_t *At;
+    const uint8_t *End;
+    bool Bad;
+
+    CborReader(const string &Data)
+        : At((const uint8_t *)Data.data()),
+          End((const uint8_t *)Data.data() + Data.size()), Bad(false) {}
+
+    /// Reads the head of a data item.
+    /// \returns false at a break (0xff), or if the data is bad
+    bool head(int &Major, uint64_t &Value) {
+        if (Bad || At >= End || *At == 0xff) {
+            if (At < End && *At == 0xff)
+                ++At;
+            else
+                Bad = true;
+            return false;
+        }
+        Major = *At >> 5;
+        int Info = *At++ & 0x1f;
+        if (Info < 24) {
+            Value = Info;
+            return true;
+        }
+        if (Info == 31) { // indefinite length
+            Value = UINT64_MAX;
+            return true;
+        }
+        int Bytes = Info == 24 ? 1 : Info == 25 ? 2 : Info == 26 ? 4 : 8;
+        if (Info > 27 || End - At < Bytes) {
+            Bad = true;
+            return false;
+        }
+        Value = 0;
+        for (int i = 0; i < Bytes; ++i)
+            Value = Value << 8 | *At++;
+        return true;
+    }
+
+    /// \returns an unsigned integer, or 0 if the next item isn't one
+    uint64_t unsignedInt() {
+        int Major;
+        uint64_t Value;
+        if (!head(Major, Value) || Major != 0)
+            Bad = true;
+        return Bad ? 0 : Value;
+    }
+
+    /// \returns an integer, or 0 if the next item isn't one
+    int64_t integer() {
+        int Major;
+        uint64_t Value;
+        if (!head(Major, Value) || Major > 1)
+            Bad = true;
+        if (Bad)
+            return 0;
+        return Major == 0 ? (int64_t)Value : -1 - (int64_t)Value;
+    }
+
+    /// \returns a text string, or "" if the next item isn't one
+    string text() {
+        int Major;
+        uint64_t Length;
+        if (!head(Major, Length) || Major != 3 || Length > (size_t)(End - At))
+            Bad = true;
+        if (Bad)
+            return "";
+        string Text((const char *)At, Length);
+        At += Length;
+        return Text;
+    }
+};
+
+// ============================================================================
+bool HttpStandIn::complete(const string &Request) {
+    size_t LineEnd = Request.find("\r\n");
+    if (LineEnd == string::npos)
+        return false;
+    if (Request.find(" HTTP/1.") > LineEnd)
+        return true;
+
+    size_t HeadEnd = Request.find("\r\n\r\n");
+    if (HeadEnd == string::npos)
+        return false;
+    return Request.size() >= HeadEnd + 4 + contentLength(Request, HeadEnd);
+}
+
+// ============================================================================
+string HttpStandIn::handle(const string &Request, bool &KeepAlive) {
+    // only the request line and the headers matter
+    size_t LineEnd = Request.find("\r\n");
+    string Line = Request.substr(0, LineEnd);
+
+    KeepAlive = Line.find(" HTTP/1.1") != string::npos &&
+                Request.find("Connection: keep-alive") != string::npos;
+
+    lock_guard<mutex> Guard(Lock);
+    Stats.Bytes += Request.size();
+
+    uniform_real_distribution<double> Chance(0.0, 1.0);
+    if (ErrorRate > 0 && Chance(Random) < ErrorRate) {
+        Stats.Errors += 1;
+        return response("503 Service Unavailable", "", KeepAlive);
+    }
+
+    if (Line.compare(0, 5, "POST ") == 0)
+        return handleCbor(Request, KeepAlive);
+
+    if (Line.compare(0, 4, "GET ") != 0) {
+        KeepAlive = false;
+        return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+    }
+
+    size_t Query = Line.find('?');
+    if (Line.find("&Config=") != string::npos) {
+        Stats.ConfigFetches += 1;
+        return response("200 OK", ConfigText, KeepAlive);
+    }
+
+    string Board;
+    size_t At = Line.find("Board_ID=");
+    if (At != string::npos)
+        Board = paramValue(Line, At + strlen("Board_ID="));
+
+    // Time[] comes before the Port_ID[]/Value[] pair that it goes with
+    string Time = to_string((long)time(NULL));
+    string Port;
+    for (At = Query; At != string::npos && At < Line.size();
+         At = Line.find('&', At + 1)) {
+        if (Line.compare(At + 1, 7, "Time[]=") == 0) {
+            Time = paramValue(Line, At + 8);
+        } else if (Line.compare(At + 1, 10, "Port_ID[]=") == 0) {
+            Port = paramValue(Line, At + 11);
+        } else if (Line.compare(At + 1, 5, "Perf=") == 0) {
+            Stats.PerfReports += 1;
+        } else if (Line.compare(At + 1, 8, "Value[]=") == 0) {
+            string Value = paramValue(Line, At + 9);
+            Stats.Values += 1;
+            if (!isfinite(atof(Value.c_str())))
+                Stats.BadValues += 1;
+            if (CSV)
+                fprintf(CSV, "%s,%s,%s,%s\n", Board.c_str(), Time.c_str(),
+                        Port.c_str(), Value.c_str());
+        }
+    }
+    Stats.Requests += 1;
+
+    char Rate[64];
+    snprintf(Rate, sizeof(Rate), "samplerate=\"%f\"\r\n", SampleRate);
+    return response("200 OK", Rate + configDirective(), KeepAlive);
+}
+
+// ============================================================================
+string HttpStandIn::handleCbor(const string &Request, bool &KeepAlive) {
+    size_t HeadEnd = Request.find("\r\n\r\n");
+    string Body = Request.substr(HeadEnd + 4, contentLength(Request, HeadEnd));
+    CborReader Reader(Body);
+
+    string Board;
+    uint64_t Table = 0;
+    vector<string> Names;
+    bool HasNames = false;
+    bool HasPerf = false;
+    uint64_t Base = 0;
+
+    /// a reading, before the port table is known
+    struct Reading {
+        int64_t Time;
+        int Port;
+        float Value;
+    };
+    vector<Reading> Readings;
+
+    int Major;
+    uint64_t Count = 0;
+    if (!Reader.head(Major, Count) || Major != 5)
+        Reader.Bad = true;
+
+    for (uint64_t k = 0; k < Count && !Reader.Bad; ++k) {
+        switch (Reader.unsignedInt()) {
+        case 0:
+            Board = Reader.text();
+            break;
+        case 1:
+            Table = Reader.unsignedInt();
+            break;
+        case 2: {
+            uint64_t Length = 0;
+            if (!Reader.head(Major, Length) || Major != 4)
+                Reader.Bad = true;
+            for (uint64_t i = 0; i < Length && !Reader.Bad; ++i)
+                Names.push_back(Reader.text());
+            HasNames = true;
+            break;
+        }
+        case 3:
+            Reader.unsignedInt(); // the board's clock
+            break;
+        case 4:
+            Base = Reader.unsignedInt();
+            break;
+        case 5: {
+            uint32_t Last[64] = {0};
+            uint64_t Length = 0;
+            if (!Reader.head(Major, Length) || Major != 4)
+                Reader.Bad = true;
+
+            // sets until the break
+            uint64_t Items;
+            while (!Reader.Bad && Reader.head(Major, Items)) {
+                if (Major != 4 || Items < 2) {
+                    Reader.Bad = true;
+                    break;
+                }
+                int64_t Time = Base + Reader.integer();
+                uint64_t Mask = Reader.unsignedInt();
+                for (int i = 0; i < 64 && !Reader.Bad; ++i) {
+                    if (!(Mask & (1ULL << i)))
+                        continue;
+                    Last[i] += (uint32_t)Reader.integer();
+                    Reading R = {Time, i, 0.0f};
+                    memcpy(&R.Value, &Last[i], sizeof(R.Value));
+                    Readings.push_back(R);
+                }
+            }
+            break;
+        }
+        case 6: {
+            // counter names, each with its count, min, mean and max
+            uint64_t Length = 0;
+            if (!Reader.head(Major, Length) || Major != 5)
+                Reader.Bad = true;
+            for (uint64_t i = 0; i < Length && !Reader.Bad; ++i) {
+                Reader.text();
+                uint64_t Items = 0;
+                if (!Reader.head(Major, Items) || Major != 4 || Items != 4)
+                    Reader.Bad = true;
+                for (uint64_t j = 0; j < Items && !Reader.Bad; ++j)
+                    Reader.unsignedInt();
+            }
+            HasPerf = true;
+            break;
+        }
+        default:
+            Reader.Bad = true;
+        }
+    }
+
+    if (Reader.Bad) {
+        KeepAlive = false;
+        return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+    }
+
+    // the port table is the names, each followed by a 0
+    if (HasNames) {
+        string Joined;
+        for (const string &Name : Names)
+            Joined += Name + '\0';
+        MbedCRC<POLY_32BIT_ANSI, 32> Crc;
+        uint32_t Check = 0;
+        Crc.compute(Joined.data(), Joined.size(), &Check);
+        if (Check != Table) {
+            KeepAlive = false;
+            return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        }
+        Tables[Table] = Names;
+    }
+
+    auto Found = Tables.find(Table);
+    if (Found == Tables.end())
+        return response("409 Conflict", "porttable=\"unknown\"\r\n", KeepAlive);
+
+    Stats.PerfReports += HasPerf;
+    for (const Reading &R : Readings) {
+        Stats.Values += 1;
+        if (!isfinite(R.Value))
+            Stats.BadValues += 1;
+        if (CSV) {
+            string Name = (size_t)R.Port < Found->second.size()
+                              ? Found->second[R.Port]
+                              : "port" + to_string(R.Port);
+            fprintf(CSV, "%s,%lld,%s,%f\n", Board.c_str(), (long long)R.Time,
+                    Name.c_str(), R.Value);
+        }
+    }
+    Stats.Requests += 1;
+
+    char Text[96];
+    snprintf(Text, sizeof(Text), "samplerate=\"%f\"\r\nporttable=\"%08x\"\r\n",
+             SampleRate, (unsigned)Table);
+    return response("200 OK", Text + configDirective(), KeepAlive);
+}
+
+// ============================================================================
+string HttpStandIn::response(const char *Status, const string &Text,
+                             bool KeepAlive) {
+    string Body = Text;
+
+    if (Chunked) {
+        // padding is only the body here, the chunk sizes aren't counted
+        if (Body.size() < MinResponse)
+            Body.append(MinResponse - Body.size(), ' ');
+        return string("HTTP/1.1 ") + Status +
+               "\r\nContent-Type: text/html\r\nTransfer-Encoding: chunked"
+               "\r\nConnection: " +
+               (KeepAlive ? "keep-alive" : "close") + "\r\n\r\n" +
+               chunks(Body);
+    }
+
+    // pad the body to the shortest length that makes the whole response
+    // long enough. The header gets longer with the Content-Length.
+    char Head[160];
+    for (size_t Length = Body.size();; ++Length) {
+        size_t HeadLength =
+            snprintf(Head, sizeof(Head),
+                     "HTTP/1.1 %s\r\nContent-Type: text/html\r\n"
+                     "Content-Length: %u\r\nConnection: %s\r\n\r\n",
+                     Status, (unsigned)Length,
+                     KeepAlive ? "keep-alive" : "close");
+        if (HeadLength + Length >= MinResponse) {
+            Body.append(Length - Body.size(), ' ');
+            break;
+        }
+    }
+    return string(Head) + Body;
+}
+
+// ============================================================================
+string HttpStandIn::chunks(const string &Body) {
+    // small chunks, so directives get split across them
+    const size_t ChunkSize = 7;
+    string Chunks;
+    char Size[16];
+    for (size_t At = 0; At < Body.size(); At += ChunkSize) {
+        string Piece = Body.substr(At, ChunkSize);
+        snprintf(Size, sizeof(Size), "%x;n=%u\r\n", (unsigned)Piece.size(),
+                 (unsigned)(At / ChunkSize));
+        Chunks += Size + Piece + "\r\n";
+    }
+    return Chunks + "0\r\nX-Chunks: done\r\n\r\n";
+}
+
+// ============================================================================
+string HttpStandIn::configDirective() {
+    if (ConfigVersion == 0 || Stats.Requests < ConfigAfter)
+        return "";
+    return "configversion=\"" + to_string(ConfigVersion) + "\"\r\n";
+}
+
+// ============================================================================
+HttpStats HttpStandIn::stats() {
+    lock_guard<mutex> Guard(Lock);
+    return Stats;
+}
@@ -0,0 +1,93 @@
+#ifndef HTTPSTANDIN_H
+#define HTTPSTANDIN_H
+/// \file
+/// \brief Stands in for the web server and bulk_sensor_readings.php, so the
+/// simulated ESP8266 has something to send requests to.
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// What the stand-in has received
+struct HttpStats {
+    uint64_t Requests;  ///< requests that were answered
+    uint64_t Values;    ///< port readings in those requests
+    uint64_t BadValues; ///< readings that the server could not store
+    uint64_t Bytes;     ///< bytes of requests
+    uint64_t Errors;    ///< requests answered with 503 on purpose
+    uint64_t PerfReports; ///< requests that had the performance counters
+    uint64_t ConfigFetches; ///< requests for the config file
+
+    HttpStats()
+        : Requests(0), Values(0), BadValues(0), Bytes(0), Errors(0),
+          PerfReports(0), ConfigFetches(0) {}
+};
+
+/// Answers the firmware's GET requests like the PHP script does: it stores
+/// every Port_ID[]/Value[] pair (with its Time[] when there is one) and
+/// answers with the sample rate. CBOR POST requests are decoded too, and the
+/// port tables they send are remembered.
+class HttpStandIn {
+  public:
+    /// SampleRate is sent back with every response, CSV (if it isn't NULL)
+    /// gets a row for every reading. Responses are padded to at least
+    /// MinResponse bytes.
+    HttpStandIn(float SampleRate, FILE *CSV, size_t MinResponse = 0);
+
+    /// Handles one request. KeepAlive is set if the connection should stay
+    /// open afterwards.
+    /// \returns the whole HTTP response
+    string handle(const string &Request, bool &KeepAlive);
+
+    /// Sends bodies with Transfer-Encoding: chunked, in small chunks
+    void setChunked(bool On) { Chunked = On; }
+
+    /// Answers this fraction of requests with 503 Service Unavailable,
+    /// without storing their readings
+    void setErrorRate(double Rate) { ErrorRate = Rate; }
+
+    /// Announces config Version in the responses once After requests have
+    /// been answered, and answers requests for it with Text
+    void setConfig(uint32_t Version, const string &Text, uint64_t After);
+
+    HttpStats stats();
+
+    /// \returns true if Request holds a whole request. Requests without an
+    /// HTTP version end with the request line.
+    static bool complete(const string &Request);
+
+  private:
+    /// Handles a CBOR POST request. Lock has to be held.
+    string handleCbor(const string &Request, bool &KeepAlive);
+
+    /// \returns a response with Status and Body, padded to MinResponse
+    string response(const char *Status, const string &Body, bool KeepAlive);
+
+    /// \returns Body as chunks, the last one empty
+    static string chunks(const string &Body);
+
+    /// \returns the configversion directive, or "" if it isn't announced
+    /// yet. Lock has to be held.
+    string configDirective();
+
+    float SampleRate;
+    FILE *CSV;
+    size_t MinResponse;
+    bool Chunked;
+    double ErrorRate;
+    uint32_t ConfigVersion; ///< 0 if no config is announced
+    string ConfigText;
+    uint64_t ConfigAfter;
+    mt19937 Random; ///< for the 503s
+    mutex Lock;
+    HttpStats Stats;
+    map<uint32_t, vector<string>> Tables; ///< port names by port table
+};
+
+#endif // HTTPSTANDIN_H
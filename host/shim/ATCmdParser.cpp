@@ -0,0 +1,238 @@
+/// \file
+/// \brief Host version of mbed's ATCmdParser, following the same matching
+/// rules.
+#include "ATCmdParser.h"
+
+#define LF (10)
+#define CR (13)
+
+// ============================================================================
+ATCmdParser::ATCmdParser(mbed::FileHandle *FH, const char *Delimiter,
+                         int BufferSize, int Timeout, bool Debug)
+    : FH(FH), BufferSize(BufferSize), Timeout(Timeout), Debug(Debug),
+      InPrev(0), Aborted(false), Oobs(NULL) {
+    Buffer = new char[BufferSize];
+    set_delimiter(Delimiter);
+}
+
+// ============================================================================
+ATCmdParser::~ATCmdParser() {
+    while (Oobs) {
+        Oob *Next = Oobs->Next;
+        delete Oobs;
+        Oobs = Next;
+    }
+    delete[] Buffer;
+}
+
+// ============================================================================
+void ATCmdParser::set_delimiter(const char *NewDelimiter) {
+    strncpy(Delimiter, NewDelimiter, sizeof(Delimiter) - 1);
+    Delimiter[sizeof(Delimiter) - 1] = 0;
+    DelimiterSize = strlen(Delimiter);
+}
+
+// ============================================================================
+int ATCmdParser::putc(char C) { return FH->write(&C, 1) == 1 ? 0 : -1; }
+
+// ============================================================================
+int ATCmdParser::getc() {
+    if (!FH->wait_readable(Timeout))
+        return -1;
+
+    unsigned char C;
+    return FH->read(&C, 1) == 1 ? C : -1;
+}
+
+// ============================================================================
+void ATCmdParser::flush() {
+    while (FH->readable()) {
+        unsigned char C;
+        FH->read(&C, 1);
+    }
+}
+
+// ============================================================================
+int ATCmdParser::write(const char *Data, int Size) {
+    return FH->write(Data, Size) == Size ? Size : -1;
+}
+
+// ============================================================================
+int ATCmdParser::read(char *Data, int Size) {
+    for (int i = 0; i < Size; ++i) {
+        int C = getc();
+        if (C < 0)
+            return -1;
+        Data[i] = C;
+    }
+    return Size;
+}
+
+// ============================================================================
+bool ATCmdParser::send(const char *Command, ...) {
+    va_list Args;
+    va_start(Args, Command);
+    bool Sent = vsend(Command, Args);
+    va_end(Args);
+    return Sent;
+}
+
+// ============================================================================
+bool ATCmdParser::vsend(const char *Command, va_list Args) {
+    int Length = vsnprintf(Buffer, BufferSize, Command, Args);
+    if (Length < 0 || Length >= BufferSize) {
+        // the board's parser can't send this either
+        if (Debug)
+            printf("AT(Error): Buffer overflow\n");
+        return false;
+    }
+
+    if (Debug)
+        printf("AT> %s\n", Buffer);
+
+    if (write(Buffer, Length) < 0 || write(Delimiter, DelimiterSize) < 0)
+        return false;
+    return true;
+}
+
+// ============================================================================
+bool ATCmdParser::recv(const char *Response, ...) {
+    va_list Args;
+    va_start(Args, Response);
+    bool Matched = vrecv(Response, Args);
+    va_end(Args);
+    return Matched;
+}
+
+// ============================================================================
+bool ATCmdParser::vrecv(const char *Response, va_list Args) {
+restart:
+    Aborted = false;
+
+    // match one line of the response at a time. No response just checks for
+    // out of band messages
+    while (!Response || Response[0]) {
+        // copy the line into the front of the buffer with every conversion
+        // replaced by one that is only checked, not stored
+        int i = 0;
+        int Offset = 0;
+        bool WholeLine = false;
+
+        while (Response && Response[i]) {
+            if (Response[i] == '%' && Response[i + 1] != '%' &&
+                Response[i + 1] != '*') {
+                Buffer[Offset++] = '%';
+                Buffer[Offset++] = '*';
+                i++;
+            } else {
+                Buffer[Offset++] = Response[i++];
+                // a newline ends the line, unless it is in a %[^\n]
+                if (Response[i - 1] == '\n' &&
+                    !(i >= 3 && Response[i - 3] == '[' &&
+                      Response[i - 2] == '^')) {
+                    WholeLine = true;
+                    break;
+                }
+            }
+        }
+
+        // %n tells whether the whole line matched
+        Buffer[Offset++] = '%';
+        Buffer[Offset++] = 'n';
+        Buffer[Offset++] = 0;
+
+        int j = 0;
+        while (true) {
+            // when only checking for out of band messages, don't wait
+            if (!Response && j == 0 && !FH->readable())
+                return false;
+
+            int C = getc();
+            if (C < 0) {
+                if (Debug)
+                    printf("AT(Timeout)\n");
+                return false;
+            }
+
+            // turn every kind of line ending into one \n
+            if ((C == CR && InPrev != LF) || (C == LF && InPrev != CR)) {
+                InPrev = C;
+                C = '\n';
+            } else if ((C == CR && InPrev == LF) ||
+                       (C == LF && InPrev == CR)) {
+                InPrev = C;
+                continue;
+            } else {
+                InPrev = C;
+            }
+
+            if (BufferSize - 1 < j + Offset) {
+                if (Debug)
+                    printf("AT(Error): Buffer overflow");
+                return false;
+            }
+            Buffer[Offset + j++] = C;
+            Buffer[Offset + j] = 0;
+
+            for (Oob *O = Oobs; O; O = O->Next) {
+                if ((unsigned)j == O->Len &&
+                    memcmp(O->Prefix, Buffer + Offset, O->Len) == 0) {
+                    if (Debug)
+                        printf("AT! %s\n", O->Prefix);
+                    O->Func();
+
+                    if (Aborted) {
+                        if (Debug)
+                            printf("AT(Aborted)\n");
+                        return false;
+                    }
+                    // the handler may have used the parser, set up again
+                    goto restart;
+                }
+            }
+
+            int Count = -1;
+            if (WholeLine && C != '\n') {
+                // wait for the end of the line if the format has one
+            } else if (Response) {
+                sscanf(Buffer + Offset, Buffer, &Count);
+            }
+
+            if (Count == j) {
+                if (Debug)
+                    printf("AT= %s\n", Buffer + Offset);
+
+                // store the values with the real format
+                memcpy(Buffer, Response, i);
+                Buffer[i] = 0;
+                vsscanf(Buffer + Offset, Buffer, Args);
+
+                Response += i;
+                break;
+            }
+
+            // start over at the end of a line, or when the buffer is full of
+            // what is probably binary data
+            if (C == '\n' || j + 1 >= BufferSize - Offset) {
+                if (Debug)
+                    printf("AT< %s", Buffer + Offset);
+                j = 0;
+            }
+        }
+    }
+
+    return true;
+}
+
+// ============================================================================
+void ATCmdParser::oob(const char *Prefix, mbed::Callback<void()> Func) {
+    Oob *O = new Oob;
+    O->Prefix = Prefix;
+    O->Len = strlen(Prefix);
+    O->Func = Func;
+    O->Next = Oobs;
+    Oobs = O;
+}
+
+// ============================================================================
+bool ATCmdParser::process_oob() { return recv(NULL); }
@@ -0,0 +1,64 @@
+#ifndef HOST_ATCMDPARSER_H
+#define HOST_ATCMDPARSER_H
+/// \file
+/// \brief Host version of mbed's ATCmdParser. It matches responses the same
+/// way, so the firmware behaves the same against the simulated ESP8266 as it
+/// does against a real one.
+
+#include "mbed.h"
+
+class ATCmdParser {
+  public:
+    ATCmdParser(mbed::FileHandle *FH, const char *Delimiter = "\r",
+                int BufferSize = 256, int Timeout = 8000, bool Debug = false);
+    ~ATCmdParser();
+
+    void set_timeout(int Timeout) { this->Timeout = Timeout; }
+    void set_delimiter(const char *Delimiter);
+    void debug_on(unsigned int On) { Debug = On != 0; }
+
+    /// Sends a formatted command followed by the delimiter
+    bool send(const char *Command, ...);
+    bool vsend(const char *Command, va_list Args);
+
+    /// Waits for lines that match Response, scanf style. Lines that don't
+    /// match are thrown away, and out of band messages are handled.
+    bool recv(const char *Response, ...);
+    bool vrecv(const char *Response, va_list Args);
+
+    int putc(char C);
+    int getc();
+    int write(const char *Data, int Size);
+    int read(char *Data, int Size);
+    void flush();
+
+    /// Calls Func whenever a line starts with Prefix
+    void oob(const char *Prefix, mbed::Callback<void()> Func);
+
+    /// Handles any out of band messages that have already arrived
+    bool process_oob();
+
+    /// Makes the recv() that is running return false
+    void abort() { Aborted = true; }
+
+  private:
+    struct Oob {
+        const char *Prefix;
+        size_t Len;
+        mbed::Callback<void()> Func;
+        Oob *Next;
+    };
+
+    mbed::FileHandle *FH;
+    char *Buffer;
+    int BufferSize;
+    int Timeout;
+    bool Debug;
+    char Delimiter[8];
+    int DelimiterSize;
+    int InPrev;
+    bool Aborted;
+    Oob *Oobs;
+};
+
+#endif // HOST_ATCMDPARSER_H
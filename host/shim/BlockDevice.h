@@ -0,0 +1,23 @@
+#ifndef HOST_BLOCKDEVICE_H
+#define HOST_BLOCKDEVICE_H
+/// \file
+/// \brief Host version of mbed's BlockDevice. Files on the "SD card" are
+/// plain files in a directory, see HostFS.h.
+
+#include "mbed.h"
+
+typedef uint64_t bd_size_t;
+
+class BlockDevice {
+  public:
+    virtual ~BlockDevice() {}
+
+    /// An SD card's block sizes
+    bd_size_t get_read_size() const { return 512; }
+    bd_size_t get_program_size() const { return 512; }
+    bd_size_t get_erase_size() const { return 512; }
+
+    static BlockDevice *get_default_instance();
+};
+
+#endif // HOST_BLOCKDEVICE_H
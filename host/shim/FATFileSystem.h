@@ -0,0 +1,20 @@
+#ifndef HOST_FATFILESYSTEM_H
+#define HOST_FATFILESYSTEM_H
+/// \file
+/// \brief Host version of mbed's FATFileSystem. Mounting it makes
+/// "/<name>/..." paths open files in the directory set with hostFSInit().
+
+#include "BlockDevice.h"
+
+class FATFileSystem {
+  public:
+    FATFileSystem(const char *Name) : Name(Name) {}
+    int mount(BlockDevice *BD);
+    int unmount() { return 0; }
+    int reformat(BlockDevice *BD);
+
+  private:
+    const char *Name;
+};
+
+#endif // HOST_FATFILESYSTEM_H
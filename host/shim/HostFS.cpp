@@ -0,0 +1,148 @@
+/// \file
+/// \brief Redirects the firmware's SD card files to a directory on the PC
+#include "HostFS.h"
+#include "BlockDevice.h"
+#include "FATFileSystem.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+
+using namespace std;
+
+extern "C" {
+FILE *__real_fopen(const char *Path, const char *Mode);
+int __real_fclose(FILE *File);
+size_t __real_fwrite(const void *Data, size_t Size, size_t Count, FILE *File);
+int __real_rename(const char *Old, const char *New);
+int __real_remove(const char *Path);
+}
+
+static mutex Lock;
+static string Prefix; ///< "/sd/"
+static string Root;   ///< directory that Prefix maps to
+static HostFSStats Stats;
+
+/// Blocks of each open SD card file that have been written since its last
+/// sync
+static map<FILE *, set<uint64_t>> Dirty;
+
+/// \returns Path in the host directory if it is on the SD card, or Path
+static string hostPath(const char *Path) {
+    if (!Prefix.empty() && strncmp(Path, Prefix.c_str(), Prefix.size()) == 0)
+        return Root + "/" + (Path + Prefix.size());
+    return Path;
+}
+
+/// Counts File's dirty blocks as written. Lock has to be held.
+static void commitBlocks(FILE *File) {
+    auto It = Dirty.find(File);
+    if (It != Dirty.end()) {
+        Stats.BlocksWritten += It->second.size();
+        It->second.clear();
+    }
+}
+
+// ============================================================================
+void hostFSInit(const char *MountName, const char *Dir) {
+    lock_guard<mutex> Guard(Lock);
+    Prefix = string("/") + MountName + "/";
+    Root = Dir;
+    mkdir(Dir, 0755);
+}
+
+// ============================================================================
+HostFSStats hostFSStats() {
+    lock_guard<mutex> Guard(Lock);
+    return Stats;
+}
+
+// ============================================================================
+void hostFSResetStats() {
+    lock_guard<mutex> Guard(Lock);
+    Stats = HostFSStats();
+}
+
+// ============================================================================
+BlockDevice *BlockDevice::get_default_instance() {
+    static BlockDevice Card;
+    return &Card;
+}
+
+// ============================================================================
+int FATFileSystem::mount(BlockDevice *BD) {
+    if (Prefix.empty())
+        hostFSInit(Name, "sd");
+    return 0;
+}
+
+// ============================================================================
+int FATFileSystem::reformat(BlockDevice *BD) { return mount(BD); }
+
+extern "C" {
+
+// ============================================================================
+FILE *__wrap_fopen(const char *Path, const char *Mode) {
+    string Real = hostPath(Path);
+    FILE *File = __real_fopen(Real.c_str(), Mode);
+
+    lock_guard<mutex> Guard(Lock);
+    if (File != NULL && Real != Path) {
+        Dirty[File].clear();
+        Stats.Opens += 1;
+    }
+    return File;
+}
+
+// ============================================================================
+int __wrap_fclose(FILE *File) {
+    {
+        lock_guard<mutex> Guard(Lock);
+        commitBlocks(File);
+        Dirty.erase(File);
+    }
+    return __real_fclose(File);
+}
+
+// ============================================================================
+size_t __wrap_fwrite(const void *Data, size_t Size, size_t Count, FILE *File) {
+    long Start = ftell(File);
+    size_t Written = __real_fwrite(Data, Size, Count, File);
+
+    lock_guard<mutex> Guard(Lock);
+    auto It = Dirty.find(File);
+    if (It != Dirty.end() && Start >= 0 && Written > 0) {
+        uint64_t Bytes = (uint64_t)Written * Size;
+        Stats.BytesWritten += Bytes;
+        for (uint64_t Block = Start / 512; Block <= (Start + Bytes - 1) / 512;
+             ++Block)
+            It->second.insert(Block);
+    }
+    return Written;
+}
+
+// ============================================================================
+int __wrap_rename(const char *Old, const char *New) {
+    return __real_rename(hostPath(Old).c_str(), hostPath(New).c_str());
+}
+
+// ============================================================================
+int __wrap_remove(const char *Path) {
+    return __real_remove(hostPath(Path).c_str());
+}
+
+// ============================================================================
+int __wrap_fsync(int FD) {
+    // the data only has to reach the PC's page cache, a real fsync would
+    // measure the PC's disk instead of the SD card
+    lock_guard<mutex> Guard(Lock);
+    Stats.Syncs += 1;
+    for (auto &Entry : Dirty) {
+        if (fileno(Entry.first) == FD)
+            commitBlocks(Entry.first);
+    }
+    return 0;
+}
+
+} // extern "C"
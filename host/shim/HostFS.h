@@ -0,0 +1,34 @@
+#ifndef HOST_HOSTFS_H
+#define HOST_HOSTFS_H
+/// \file
+/// \brief Puts the firmware's "/sd/..." files in a directory on the PC, and
+/// counts what would have been written to the SD card.
+///
+/// The firmware's calls to fopen(), fclose(), fwrite(), rename(), remove()
+/// and fsync() are redirected here with the linker's --wrap option, so the
+/// firmware code is built unchanged.
+
+#include <cstdint>
+
+/// What the firmware has done to the SD card
+struct HostFSStats {
+    uint64_t BytesWritten;  ///< bytes passed to fwrite()
+    uint64_t BlocksWritten; ///< 512 byte blocks programmed, see below
+    uint64_t Syncs;         ///< fsync() calls
+    uint64_t Opens;         ///< fopen() calls
+
+    HostFSStats() : BytesWritten(0), BlocksWritten(0), Syncs(0), Opens(0) {}
+};
+
+/// Makes files under /MountName/ live in Dir
+void hostFSInit(const char *MountName, const char *Dir);
+
+/// \returns the counts so far. BlocksWritten counts every block that was
+/// written to between two syncs (or a close) once, like the FAT driver's
+/// cache does.
+HostFSStats hostFSStats();
+
+/// Sets every count back to 0
+void hostFSResetStats();
+
+#endif // HOST_HOSTFS_H
@@ -0,0 +1,42 @@
+#ifndef HOST_MBEDCRC_H
+#define HOST_MBEDCRC_H
+/// \file
+/// \brief Host version of mbed's MbedCRC, for the two polynomials that the
+/// firmware uses, with mbed's default settings for each.
+
+#include "mbed.h"
+
+enum crc_polynomial_t { POLY_32BIT_ANSI = 0x04C11DB7, POLY_16BIT_CCITT = 0x1021 };
+
+namespace mbed {
+
+template <crc_polynomial_t Polynomial, int Width> class MbedCRC {
+  public:
+    int32_t compute(const void *Data, unsigned long Size, uint32_t *CRC) {
+        const uint8_t *Bytes = (const uint8_t *)Data;
+        if (Width == 32) {
+            // reflected, starts at and is XORed with 0xFFFFFFFF
+            uint32_t R = 0xFFFFFFFFUL;
+            while (Size--) {
+                R ^= *Bytes++;
+                for (int k = 0; k < 8; ++k)
+                    R = (R >> 1) ^ (0xEDB88320UL & (0 - (R & 1)));
+            }
+            *CRC = ~R;
+        } else {
+            // not reflected, starts at 0xFFFF
+            uint16_t R = 0xFFFF;
+            while (Size--) {
+                R ^= *Bytes++ << 8;
+                for (int k = 0; k < 8; ++k)
+                    R = (R & 0x8000) ? (R << 1) ^ Polynomial : R << 1;
+            }
+            *CRC = R;
+        }
+        return 0;
+    }
+};
+
+} // namespace mbed
+
+#endif // HOST_MBEDCRC_H
@@ -0,0 +1,6 @@
+#ifndef HOST_SOCKETADDRESS_H
+#define HOST_SOCKETADDRESS_H
+/// \file
+/// \brief Empty, the firmware includes SocketAddress.h but doesn't use it.
+
+#endif // HOST_SOCKETADDRESS_H
@@ -0,0 +1,41 @@
+/// \file
+/// \brief Host version of mbed's UARTSerial
+#include "UARTSerial.h"
+
+HostDevice *HostUARTDevice = NULL;
+
+// ============================================================================
+UARTSerial::UARTSerial(PinName Tx, PinName Rx, int Baud) {
+    if (HostUARTDevice == NULL)
+        error("No device is attached to the host serial port\n");
+    set_baud(Baud);
+}
+
+// ============================================================================
+ssize_t UARTSerial::read(void *Buffer, size_t Size) {
+    size_t Got = HostUARTDevice->transmit((char *)Buffer, Size);
+    return Got > 0 ? (ssize_t)Got : -EAGAIN;
+}
+
+// ============================================================================
+ssize_t UARTSerial::write(const void *Buffer, size_t Size) {
+    HostUARTDevice->received((const char *)Buffer, Size);
+    return Size;
+}
+
+// ============================================================================
+bool UARTSerial::readable() const { return HostUARTDevice->waitReadable(0); }
+
+// ============================================================================
+bool UARTSerial::wait_readable(int Timeout) {
+    return HostUARTDevice->waitReadable(Timeout);
+}
+
+// ============================================================================
+void UARTSerial::set_baud(int Baud) { HostUARTDevice->setBaud(Baud); }
+
+// ============================================================================
+void UARTSerial::set_flow_control(Flow Type, PinName Flow1, PinName Flow2) {
+    // only both lines together are simulated
+    HostUARTDevice->setFlowControl(Type == RTSCTS);
+}
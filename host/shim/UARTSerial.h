@@ -0,0 +1,49 @@
+#ifndef HOST_UARTSERIAL_H
+#define HOST_UARTSERIAL_H
+/// \file
+/// \brief Host version of mbed's UARTSerial. It is wired to whatever
+/// HostDevice is in HostUARTDevice instead of to pins.
+
+#include "mbed.h"
+
+/// A device on the other end of the host's serial port
+class HostDevice {
+  public:
+    virtual ~HostDevice() {}
+
+    /// Takes bytes that the board wrote
+    virtual void received(const char *Data, size_t Size) = 0;
+
+    /// Copies up to Size bytes that have arrived for the board into Data.
+    /// \returns the number of bytes copied
+    virtual size_t transmit(char *Data, size_t Size) = 0;
+
+    /// Waits up to Timeout ms for a byte to arrive for the board.
+    /// \returns true if one has
+    virtual bool waitReadable(int Timeout) = 0;
+
+    /// Changes the board's baud rate
+    virtual void setBaud(int Baud) {}
+
+    /// Turns the board's RTS/CTS flow control on or off
+    virtual void setFlowControl(bool On) {}
+};
+
+/// The device that every UARTSerial talks to. Set it before the firmware
+/// opens the port.
+extern HostDevice *HostUARTDevice;
+
+class UARTSerial : public mbed::FileHandle, public mbed::SerialBase {
+  public:
+    UARTSerial(PinName Tx, PinName Rx, int Baud = 9600);
+
+    ssize_t read(void *Buffer, size_t Size) override;
+    ssize_t write(const void *Buffer, size_t Size) override;
+    bool readable() const override;
+    bool wait_readable(int Timeout) override;
+
+    void set_baud(int Baud);
+    void set_flow_control(Flow Type, PinName Flow1 = NC, PinName Flow2 = NC);
+};
+
+#endif // HOST_UARTSERIAL_H
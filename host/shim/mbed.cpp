@@ -0,0 +1,347 @@
+/// \file
+/// \brief Implementation of the mbed OS stand-ins
+#include "mbed.h"
+
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+/// When the program started. A function so that it is set before any static
+/// object can use it.
+static chrono::steady_clock::time_point programStart() {
+    static const chrono::steady_clock::time_point Start =
+        chrono::steady_clock::now();
+    return Start;
+}
+
+// ============================================================================
+uint64_t hostMicros() {
+    return chrono::duration_cast<chrono::microseconds>(
+               chrono::steady_clock::now() - programStart())
+        .count();
+}
+
+// ============================================================================
+float AnalogIn::read() {
+    double Seconds = hostMicros() / 1000000.0;
+    double Phase = Pin * 0.6;
+    double Noise = (rand() % 1001 - 500) / 500000.0;
+    return 0.5 + 0.25 * sin(2 * M_PI * 60.0 * Seconds + Phase) + Noise;
+}
+
+// ============================================================================
+unsigned short AnalogIn::read_u16() { return read() * 65535.0f; }
+
+// ============================================================================
+void Timer::start() {
+    if (!Running) {
+        Start = hostMicros();
+        Running = true;
+    }
+}
+
+// ============================================================================
+void Timer::stop() {
+    if (Running) {
+        Elapsed += hostMicros() - Start;
+        Running = false;
+    }
+}
+
+// ============================================================================
+void Timer::reset() {
+    Elapsed = 0;
+    Start = hostMicros();
+}
+
+// ============================================================================
+uint64_t Timer::read_high_resolution_us() {
+    return Elapsed + (Running ? hostMicros() - Start : 0);
+}
+
+// ============================================================================
+Timeout::Timeout() : Deadline(0), Stop(false) {
+    Worker = thread(&Timeout::run, this);
+}
+
+// ============================================================================
+Timeout::~Timeout() {
+    {
+        lock_guard<mutex> Guard(Lock);
+        Stop = true;
+    }
+    Changed.notify_all();
+    Worker.join();
+}
+
+// ============================================================================
+void Timeout::attach(Callback<void()> NewFunc, float Seconds) {
+    attach_us(NewFunc, Seconds * 1000000.0f);
+}
+
+// ============================================================================
+void Timeout::attach_us(Callback<void()> NewFunc, uint64_t Micros) {
+    {
+        lock_guard<mutex> Guard(Lock);
+        Func = NewFunc;
+        Deadline = hostMicros() + max<uint64_t>(Micros, 1);
+    }
+    Changed.notify_all();
+}
+
+// ============================================================================
+void Timeout::detach() {
+    {
+        lock_guard<mutex> Guard(Lock);
+        Deadline = 0;
+    }
+    Changed.notify_all();
+}
+
+// ============================================================================
+void Timeout::run() {
+    unique_lock<mutex> Guard(Lock);
+    while (!Stop) {
+        if (Deadline == 0) {
+            Changed.wait(Guard);
+            continue;
+        }
+        if (hostMicros() < Deadline) {
+            Changed.wait_until(Guard,
+                               programStart() + chrono::microseconds(Deadline));
+            continue;
+        }
+
+        // one shot, like an interrupt
+        Deadline = 0;
+        Callback<void()> Due = Func;
+        Guard.unlock();
+        Due();
+        Guard.lock();
+    }
+}
+
+// ============================================================================
+void wait_us(int Micros) { this_thread::sleep_for(chrono::microseconds(Micros)); }
+
+// ============================================================================
+void wait_ms(int Millis) { this_thread::sleep_for(chrono::milliseconds(Millis)); }
+
+// ============================================================================
+void NVIC_SystemReset() {
+    fprintf(stderr, "\nThe board reset itself (watchdog)\n");
+    fflush(stdout);
+    _exit(3);
+}
+
+uint32_t SystemCoreClock = 120000000;
+HostDWT HostDWTRegs;
+HostCoreDebug HostCoreDebugRegs;
+
+/// \returns cycles of the core clock since the program started
+static uint64_t hostCycles() {
+    return hostMicros() * (SystemCoreClock / 1000000);
+}
+
+// ============================================================================
+HostCycleCounter::operator uint32_t() const {
+    return (uint32_t)(hostCycles() - Zero);
+}
+
+// ============================================================================
+HostCycleCounter &HostCycleCounter::operator=(uint32_t Value) {
+    Zero = hostCycles() - Value;
+    return *this;
+}
+
+/// The host's stdin. Only what is already there is read, so the firmware
+/// never waits for it.
+class HostConsole : public FileHandle {
+  public:
+    ssize_t read(void *Buffer, size_t Size) override {
+        return readable() ? ::read(STDIN_FILENO, Buffer, Size) : 0;
+    }
+    ssize_t write(const void *Buffer, size_t Size) override { return -1; }
+    bool readable() const override {
+        pollfd Poll = {STDIN_FILENO, POLLIN, 0};
+        return poll(&Poll, 1, 0) == 1 && (Poll.revents & POLLIN);
+    }
+};
+
+// ============================================================================
+FileHandle *mbed_file_handle(int Fd) {
+    static HostConsole Console;
+    return Fd == STDIN_FILENO ? &Console : NULL;
+}
+
+// ============================================================================
+void error(const char *Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    vfprintf(stderr, Format, Args);
+    va_end(Args);
+    fflush(stdout);
+    _exit(1);
+}
+
+namespace rtos {
+
+// ============================================================================
+osStatus Thread::start(mbed::Callback<void()> Task) {
+    Worker = thread([Task]() { Task(); });
+    return osOK;
+}
+
+// ============================================================================
+osStatus Thread::join() {
+    if (Worker.joinable())
+        Worker.join();
+    return osOK;
+}
+
+// ============================================================================
+uint32_t EventFlags::set(uint32_t Set) {
+    uint32_t Now;
+    {
+        lock_guard<mutex> Guard(Lock);
+        Flags |= Set;
+        Now = Flags;
+    }
+    Changed.notify_all();
+    return Now;
+}
+
+// ============================================================================
+uint32_t EventFlags::clear(uint32_t Clear) {
+    lock_guard<mutex> Guard(Lock);
+    uint32_t Was = Flags;
+    Flags &= ~Clear;
+    return Was;
+}
+
+// ============================================================================
+uint32_t EventFlags::wait_any(uint32_t Wanted, uint32_t Timeout, bool Clear) {
+    unique_lock<mutex> Guard(Lock);
+    auto Ready = [&]() { return (Flags & Wanted) != 0; };
+    if (Timeout == osWaitForever) {
+        Changed.wait(Guard, Ready);
+    } else if (!Changed.wait_for(Guard, chrono::milliseconds(Timeout),
+                                 Ready)) {
+        return 0xFFFFFFFEU; // osFlagsErrorTimeout
+    }
+
+    uint32_t Got = Flags;
+    if (Clear)
+        Flags &= ~Wanted;
+    return Got;
+}
+
+// ============================================================================
+uint64_t Kernel::get_ms_count() { return hostMicros() / 1000; }
+
+// ============================================================================
+void ThisThread::sleep_for(uint32_t Millis) { wait_ms(Millis); }
+
+} // namespace rtos
+
+namespace events {
+
+// ============================================================================
+EventQueue::EventQueue(unsigned Size)
+    : Capacity(max(1U, Size / EVENTS_EVENT_SIZE)), NextID(1), Break(false) {}
+
+// ============================================================================
+int EventQueue::post(int Delay, int Period, function<void()> Func) {
+    int ID;
+    {
+        lock_guard<mutex> Guard(Lock);
+        if (Events.size() >= Capacity)
+            return 0;
+
+        Event New;
+        New.ID = ID = NextID++;
+        New.Due = hostMicros() + (uint64_t)max(Delay, 0) * 1000;
+        New.Period = Period;
+        New.Func = Func;
+
+        // keep the events in order of when they are due, first come first
+        // served for the same time
+        auto At = upper_bound(
+            Events.begin(), Events.end(), New,
+            [](const Event &A, const Event &B) { return A.Due < B.Due; });
+        Events.insert(At, New);
+    }
+    Changed.notify_all();
+    return ID;
+}
+
+// ============================================================================
+void EventQueue::cancel(int ID) {
+    lock_guard<mutex> Guard(Lock);
+    for (auto It = Events.begin(); It != Events.end(); ++It) {
+        if (It->ID == ID) {
+            Events.erase(It);
+            return;
+        }
+    }
+}
+
+// ============================================================================
+void EventQueue::dispatch(int Millis) {
+    uint64_t End = Millis < 0 ? UINT64_MAX : hostMicros() + Millis * 1000ULL;
+
+    unique_lock<mutex> Guard(Lock);
+    while (!Break && hostMicros() < End) {
+        uint64_t Wake = End;
+        if (!Events.empty())
+            Wake = min(Wake, Events.front().Due);
+
+        if (Events.empty() || Events.front().Due > hostMicros()) {
+            if (Wake == UINT64_MAX)
+                Changed.wait(Guard);
+            else
+                Changed.wait_until(Guard,
+                                   programStart() + chrono::microseconds(Wake));
+            continue;
+        }
+
+        Event Due = Events.front();
+        Events.pop_front();
+        Guard.unlock();
+        Due.Func();
+        Guard.lock();
+
+        if (Due.Period > 0) {
+            Due.Due += Due.Period * 1000ULL;
+            auto At = upper_bound(
+                Events.begin(), Events.end(), Due,
+                [](const Event &A, const Event &B) { return A.Due < B.Due; });
+            Events.insert(At, Due);
+        }
+    }
+    Break = false;
+}
+
+// ============================================================================
+void EventQueue::break_dispatch() {
+    {
+        lock_guard<mutex> Guard(Lock);
+        Break = true;
+    }
+    Changed.notify_all();
+}
+
+} // namespace events
+
+// ============================================================================
+EventQueue *mbed_event_queue() {
+    static EventQueue *Shared = NULL;
+    static once_flag Started;
+    call_once(Started, []() {
+        Shared = new EventQueue(32 * EVENTS_EVENT_SIZE);
+        thread([]() { Shared->dispatch_forever(); }).detach();
+    });
+    return Shared;
+}
@@ -0,0 +1,327 @@
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+/// \file
+/// \brief Stand-ins for the parts of mbed OS that the firmware uses, so that
+/// it can be built and run on a PC.
+///
+/// Threads, queues and timers are real and run at wall-clock speed. Thread
+/// priorities and stack sizes are ignored.
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <sys/types.h>
+#include <unistd.h>
+
+typedef int PinName;
+
+/// The pins that the firmware uses
+enum {
+    PTB2,
+    PTB3,
+    PTB10,
+    PTB11,
+    PTC11,
+    PTC10,
+    PTC2,
+    PTC0,
+    PTC9,
+    PTC8,
+    PTC16,
+    PTC17,
+    PTC18,
+    PTC19,
+    NC = -1
+};
+
+/// Lets the compiler check the arguments of a printf style function
+#define MBED_PRINTF(FormatIndex, FirstIndex)                                   \
+    __attribute__((format(printf, FormatIndex, FirstIndex)))
+
+/// The host's serial port can do flow control
+#define DEVICE_SERIAL_FC 1
+
+/// \returns microseconds since the program started
+uint64_t hostMicros();
+
+namespace mbed {
+
+/// The settings that mbed's serial classes share
+class SerialBase {
+  public:
+    enum Flow { Disabled, RTS, CTS, RTSCTS };
+};
+
+/// Something that can be read and written like a serial port
+class FileHandle {
+  public:
+    virtual ~FileHandle() {}
+    virtual ssize_t read(void *Buffer, size_t Size) = 0;
+    virtual ssize_t write(const void *Buffer, size_t Size) = 0;
+    virtual bool readable() const = 0;
+
+    /// Host only: waits up to Timeout ms for something to read.
+    /// \returns readable()
+    virtual bool wait_readable(int Timeout) { return readable(); }
+};
+
+template <typename F> class Callback;
+
+/// Callable that wraps a function, or an object and one of its methods
+template <typename R, typename... A> class Callback<R(A...)> {
+  public:
+    Callback() {}
+    Callback(R (*Func)(A...)) : Func(Func) {}
+    template <typename T>
+    Callback(T *Obj, R (T::*Method)(A...))
+        : Func([Obj, Method](A... Args) { return (Obj->*Method)(Args...); }) {
+    }
+    R operator()(A... Args) const { return Func(Args...); }
+    explicit operator bool() const { return (bool)Func; }
+
+  private:
+    std::function<R(A...)> Func;
+};
+
+template <typename T, typename R, typename... A>
+Callback<R(A...)> callback(T *Obj, R (T::*Method)(A...)) {
+    return Callback<R(A...)>(Obj, Method);
+}
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*Func)(A...)) {
+    return Callback<R(A...)>(Func);
+}
+
+/// Reads a made up signal. Each pin is a 60 Hz sine around mid-scale with a
+/// different phase and a little noise.
+class AnalogIn {
+  public:
+    AnalogIn(PinName Pin) : Pin(Pin) {}
+    float read();
+    unsigned short read_u16();
+
+  private:
+    PinName Pin;
+};
+
+class Timer {
+  public:
+    Timer() : Running(false), Start(0), Elapsed(0) {}
+    void start();
+    void stop();
+    void reset();
+    float read() { return read_high_resolution_us() / 1000000.0f; }
+    int read_ms() { return read_high_resolution_us() / 1000; }
+    int read_us() { return read_high_resolution_us(); }
+    uint64_t read_high_resolution_us();
+
+  private:
+    bool Running;
+    uint64_t Start;
+    uint64_t Elapsed;
+};
+
+/// Calls a function once after a delay, from its own thread
+class Timeout {
+  public:
+    Timeout();
+    ~Timeout();
+    void attach(Callback<void()> Func, float Seconds);
+    void attach_us(Callback<void()> Func, uint64_t Micros);
+    void detach();
+
+  private:
+    void run();
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    Callback<void()> Func;
+    uint64_t Deadline; ///< hostMicros() to call Func at, 0 if detached
+    bool Stop;
+    std::thread Worker;
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+void wait_us(int Micros);
+void wait_ms(int Millis);
+
+/// Ends the program, since there is no board to reset
+void NVIC_SystemReset();
+
+/// Speed of the K64F's core clock in Hz
+extern uint32_t SystemCoreClock;
+
+/// Stands in for the DWT's CYCCNT register. It counts at SystemCoreClock
+/// from the host's clock, and wraps like the register does.
+class HostCycleCounter {
+  public:
+    HostCycleCounter() : Zero(0) {}
+    operator uint32_t() const;
+    HostCycleCounter &operator=(uint32_t Value);
+
+  private:
+    uint64_t Zero; ///< host cycles when the counter was at 0
+};
+
+/// The DWT registers that the firmware uses
+struct HostDWT {
+    uint32_t CTRL;
+    HostCycleCounter CYCCNT;
+};
+
+/// The CoreDebug register that the firmware uses
+struct HostCoreDebug {
+    uint32_t DEMCR;
+};
+
+extern HostDWT HostDWTRegs;
+extern HostCoreDebug HostCoreDebugRegs;
+#define DWT (&HostDWTRegs)
+#define CoreDebug (&HostCoreDebugRegs)
+#define DWT_CTRL_CYCCNTENA_Msk (1UL)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+/// \returns the console: fd 0 is the host's stdin, which can't be written
+mbed::FileHandle *mbed_file_handle(int Fd);
+
+/// Prints the message and ends the program
+void error(const char *Format, ...);
+
+typedef enum {
+    osPriorityIdle,
+    osPriorityLow,
+    osPriorityBelowNormal,
+    osPriorityNormal,
+    osPriorityAboveNormal,
+    osPriorityHigh,
+    osPriorityRealtime
+} osPriority;
+
+typedef int osStatus;
+#define osOK (0)
+#define osWaitForever (0xFFFFFFFFU)
+
+namespace rtos {
+
+class Mutex {
+  public:
+    void lock() { Lock.lock(); }
+    bool trylock() { return Lock.try_lock(); }
+    void unlock() { Lock.unlock(); }
+
+  private:
+    std::recursive_mutex Lock;
+};
+
+class Thread {
+  public:
+    Thread(osPriority Priority = osPriorityNormal, uint32_t StackSize = 4096,
+           unsigned char *StackMem = NULL, const char *Name = NULL) {}
+    osStatus start(mbed::Callback<void()> Task);
+    osStatus join();
+
+  private:
+    std::thread Worker;
+};
+
+class EventFlags {
+  public:
+    EventFlags() : Flags(0) {}
+    uint32_t set(uint32_t Set);
+    uint32_t clear(uint32_t Clear = 0x7fffffff);
+    uint32_t get() const { return Flags; }
+    uint32_t wait_any(uint32_t Wanted, uint32_t Timeout = osWaitForever,
+                      bool Clear = true);
+
+  private:
+    std::mutex Lock;
+    std::condition_variable Changed;
+    uint32_t Flags;
+};
+
+namespace Kernel {
+uint64_t get_ms_count();
+}
+
+namespace ThisThread {
+void sleep_for(uint32_t Millis);
+}
+
+} // namespace rtos
+
+using namespace rtos;
+
+#define EVENTS_EVENT_SIZE (64)
+
+namespace events {
+
+/// Runs functions in order of when they are due on the thread that
+/// dispatches it
+class EventQueue {
+  public:
+    /// Holds about Size / EVENTS_EVENT_SIZE events, so that a queue that
+    /// would fill up on the board fills up here too
+    EventQueue(unsigned Size = 32 * EVENTS_EVENT_SIZE);
+
+    template <typename F, typename... A> int call(F Func, A... Args) {
+        return post(0, 0, [=]() { Func(Args...); });
+    }
+
+    template <typename F, typename... A>
+    int call_in(int Millis, F Func, A... Args) {
+        return post(Millis, 0, [=]() { Func(Args...); });
+    }
+
+    template <typename F, typename... A>
+    int call_every(int Millis, F Func, A... Args) {
+        return post(Millis, Millis, [=]() { Func(Args...); });
+    }
+
+    void cancel(int ID);
+
+    /// Runs events for Millis ms, or forever if it is negative
+    void dispatch(int Millis = -1);
+    void dispatch_forever() { dispatch(-1); }
+    void break_dispatch();
+
+  private:
+    struct Event {
+        int ID;
+        uint64_t Due; ///< hostMicros()
+        int Period;   ///< ms, 0 for one shot
+        std::function<void()> Func;
+    };
+
+    int post(int Delay, int Period, std::function<void()> Func);
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::deque<Event> Events;
+    size_t Capacity;
+    int NextID;
+    bool Break;
+};
+
+} // namespace events
+
+using namespace events;
+
+/// \returns the shared queue, which is dispatched by its own thread
+EventQueue *mbed_event_queue();
+
+#endif // HOST_MBED_H
@@ -1,9 +1,18 @@
 /// \file
 /// \brief Contains the logic and control flow for the entire program.
+///
+/// Ports are read by the main thread at fixed deadlines from its EventQueue,
+/// and the readings are passed through a SampleRing to a lower priority
+/// network thread that sends or backs them up. Both threads sleep while they
+/// have nothing to do, and a slow request on the network thread never moves
+/// the next reading.
 
 #include "BoardConfig.h"
+#include "ConsoleLog.h"
 #include "Networking.h"
 #include "OfflineLogging.h"
+#include "Profiling.h"
+#include "Sampling.h"
 #include "debugging.h"
 #include "mbed.h"
 #include <cmath>
@@ -24,9 +33,126 @@ using namespace std;
 /// The watchdog timer goes off after PollingInterval*WATCHDOGCOEFF seconds
 #define WATCHDOGCOEFF (5)
 
-/// the serial timeout for the ESP8266 in milliseconds
+/// Backed up data in RAM is saved after this fraction of the watchdog time
+#define WATCHDOGWARNCOEFF (0.8f)
+
+/// the serial timeout for the ESP8266 in milliseconds. Each AT command sets
+/// its own once it is sent, see commandTimeout().
 #define SERIALTIMEOUT (3000)
 
+/// ms that sending backed up data waits after the server fails it the first
+/// time, and the longest it waits, see backOffDrain()
+#define DRAINBACKOFFMIN (1000)
+#define DRAINBACKOFFMAX (300000)
+
+/// ms between checks for commands on the console, see checkConsole()
+#define CONSOLEPOLLMS (200)
+
+/// Most bytes of a config file that the server can send, see
+/// checkConfigVersion()
+#define CONFIGFETCHMAX (16384)
+
+/// ms before a new config that failed to come, or couldn't be used, is asked
+/// for again
+#define CONFIGRETRYMS (300000)
+
+/// stack size of the network thread in bytes
+#define NETWORKSTACKSIZE (6144)
+
+/// Set in NetworkFlags when there is a frame in Samples
+#define FRAMEREADY (0x01)
+
+/// name of the file where data is stored
+const char BackupFileName[] = "/sd/PortReadings.dat";
+
+/// name of the board's config file
+const char ConfigFileName[] = "/sd/IAC_Config_File.txt";
+
+/// data is gathered from these ports/sensor pins
+AnalogIn Port[] = {PTB2,  PTB3, PTB10, PTB11, PTC11,
+                   PTC10, PTC2, PTC0,  PTC9,  PTC8};
+
+/// number of pins in Port
+#define NUMPINS (sizeof(Port) / sizeof(Port[0]))
+
+/// interval for the sensor polling in seconds. The network thread changes it
+/// when the server sends a new one.
+volatile float PollingInterval = 5.0f;
+
+/// Board settings used by the network thread
+BoardSpecs Specs;
+
+/// Board settings used by the sampling thread. Only the port settings are
+/// read, and the readings in it are only used to back up data when the
+/// network thread has fallen behind.
+BoardSpecs SampleSpecs;
+
+/// A new config from the server that is being swapped in, see
+/// checkConfigVersion()
+BoardSpecs NewSpecs;
+
+/// true from when NewSpecs is ready until the network thread has swapped it
+/// in. Only the network thread uses it.
+bool ConfigPending = false;
+
+/// Kernel::get_ms_count() before which a new config isn't asked for again
+uint64_t ConfigRetryAt = 0;
+
+/// The text of a new config while it is fetched and parsed. Only the network
+/// thread uses it, and it is kept for good so fetching a config never has to
+/// find this much room on the heap.
+char ConfigText[CONFIGFETCHMAX + 1];
+
+ATCmdParser *_parser = NULL;
+
+bool OfflineMode = false; // indicates whether to actually send data or not
+
+/// how many times to try connecting to the wifi before giving up
+int wifi_tries = WIFITRIES;
+
+/// Runs the port reading deadlines. It is dispatched by the main thread.
+EventQueue SampleQueue(4 * EVENTS_EVENT_SIZE);
+
+/// Readings waiting for the network thread. Readings that don't fit are
+/// backed up by the sampling thread instead.
+SampleRing Samples;
+
+/// Wakes up the network thread
+EventFlags NetworkFlags;
+
+/// Highest SampleRing::highWater() that has been reported
+uint32_t ReportedHighWater = 0;
+
+/// Sends data, below the priority of the sampling thread
+Thread NetworkThread(osPriorityBelowNormal, NETWORKSTACKSIZE);
+
+/// Kernel::get_ms_count() of the next reading
+uint64_t NextSample = 0;
+
+/// Kernel::get_ms_count() when the network thread last finished a task
+volatile uint64_t NetworkBeat = 0;
+
+/// true while there is backed up data to send
+bool Draining = false;
+
+/// Kernel::get_ms_count() before which backed up data isn't sent, and how
+/// long the next wait is, see backOffDrain()
+uint64_t DrainAfter = 0;
+uint32_t DrainBackoff = DRAINBACKOFFMIN;
+
+Timeout watchdog;
+
+/// Goes off a little before the watchdog does
+Timeout watchdog_warning;
+
+/// Runs when the watchdog is about to reset the board. The SD card can't be
+/// written from an interrupt, so the backed up data that is still in RAM is
+/// saved from the shared event queue's thread, which still runs if main() is
+/// stuck.
+void onWatchdogWarning() {
+    mbed_event_queue()->call(&flushBackupFile, BackupFileName);
+}
+
 // for the watchdog timer, we will have a timeout that goes off
 // and resets the program. This function will be detached and reattached
 // throughout the life of the program to keep from resetting all the time
@@ -35,74 +161,407 @@ using namespace std;
 void resetWatchdog(Timeout &timeout, float new_delay) {
     timeout.detach();
     timeout.attach(&NVIC_SystemReset, new_delay);
+
+    watchdog_warning.detach();
+    watchdog_warning.attach(&onWatchdogWarning, new_delay * WATCHDOGWARNCOEFF);
 }
 
-int main() {
+/// Takes a new polling interval from the server if it sent a valid one
+void updatePollingInterval(float NewInterval) {
+    if (NewInterval != -1.0f && NewInterval > 0.0f) {
+        PollingInterval = NewInterval;
+        LOGINFO("Sample interval is now %f\r\n", NewInterval);
+    }
+}
+
+/// Tries to reconnect to the WiFi if the connection was lost, and enters
+/// offline mode after WIFITRIES failed attempts in a row.
+/// \returns true if the board is connected
+bool checkWiFi() {
+    if (wifiLinkUp(_parser))
+        return true;
+
+    LOGINFO("Trying to connect to %s \r\n", Specs.NetworkSSID.c_str());
+    int wifi_err = connectESPWiFi(_parser, Specs);
+
+    if (wifi_err != NETWORKSUCCESS) {
+        LOGWARN("Connection attempt failed error = %d\r\n", wifi_err);
+
+        wifi_tries -= 1;
+        if (wifi_tries <= 0) {
 
-    // interval for the sensor polling
-    float PollingInterval = 5.0f;
+            LOGERROR("Wifi connection failed %d times, activating "
+                     "offline mode\r\n",
+                     WIFITRIES);
+            OfflineMode = true;
+        }
+        return false;
+    }
+
+    // connectESPWiFi() already checked for an address
+    LOGINFO("Connected to %s \r\n", Specs.NetworkSSID.c_str());
+    wifi_tries = WIFITRIES;
+    return true;
+}
 
-    Timeout watchdog;
+/// Holds off on sending backed up data after Error. A server that had
+/// trouble (5xx) gets twice as long every time it fails again. One that
+/// refused the data (4xx) won't take it on the next try either, so it gets
+/// the longest wait right away. Other errors, like a dropped link, are
+/// retried after DRAINBACKOFFMIN.
+void backOffDrain(int Error) {
+    if (Error == ReqServerError) {
+        DrainAfter = Kernel::get_ms_count() + DrainBackoff;
+        LOGWARN("The server failed, sending backed up data again in %u ms\r\n",
+                (unsigned)DrainBackoff);
+        DrainBackoff = min(DrainBackoff * 2, (uint32_t)DRAINBACKOFFMAX);
+
+    } else if (requestRefused(Error)) {
+        DrainAfter = Kernel::get_ms_count() + DRAINBACKOFFMAX;
+        LOGERROR("The server refused the backed up data, check the ConnInfo "
+                 "line. Trying again in %d s\r\n",
+                 DRAINBACKOFFMAX / 1000);
+
+    } else {
+        DrainAfter = Kernel::get_ms_count() + DRAINBACKOFFMIN;
+    }
+}
 
-    // name of the file where data is stored
-    const char BackupFileName[] = "/sd/PortReadings.dat";
+/// Sends one request worth of backed up data, or one pipeline's worth if
+/// Specs.UploadLinks is over 1. Draining stays set until the backup file is
+/// empty, and a send that fails is tried again after DrainAfter.
+void drainBacklog() {
+    if (OfflineMode || !checkForBackupFile(BackupFileName)) {
+        Draining = false;
+        return;
+    }
+
+    if (!wifiLinkUp(_parser)) {
+        // try again once the link may be back
+        DrainAfter = Kernel::get_ms_count() + DRAINBACKOFFMIN;
+        return;
+    }
+
+    LOGDEBUG("\r\n Sending backed up data to the database. \r\n");
+    float tmp = -1.0f;
+    int wifi_err;
+    if (Specs.UploadLinks > 1) {
+        wifi_err =
+            sendBacklogPipelinedTCP(_parser, Specs, BackupFileName, tmp);
+    } else if (Specs.BatchBytes > 0) {
+        wifi_err = sendBackupBatchTCP(_parser, Specs, BackupFileName, tmp);
+    } else {
+        wifi_err = sendBackupDataTCP(_parser, Specs, BackupFileName, tmp);
+    }
+    updatePollingInterval(tmp);
+
+    if (wifi_err != NETWORKSUCCESS) {
+        LOGWARN("\r\n Failed to transmit backed up data to the "
+                "Database \r\n");
+        LOGWARN("Error code = %d\r\n", wifi_err);
+        backOffDrain(wifi_err);
+
+    } else {
+        DrainBackoff = DRAINBACKOFFMIN;
+
+        // batches and pipelines delete their own entries
+        if (Specs.BatchBytes == 0 && Specs.UploadLinks <= 1)
+            deleteDataEntry(Specs, BackupFileName);
+
+        Draining = checkForBackupFile(BackupFileName);
+    }
+}
+
+/// Swaps NewSpecs in for the sampling thread. Runs on the main thread's
+/// EventQueue, so it never lands in the middle of a reading, and every frame
+/// after it is read with the new ports and carries the new version.
+void swapSampleSpecs() {
+    SampleSpecs = NewSpecs;
+    LOGINFO("\r\nReading the ports of config %lu\r\n",
+            (unsigned long)SampleSpecs.ConfigVersion);
+}
+
+/// Swaps NewSpecs in for the network thread. Runs when the first frame that
+/// was read with it comes, so the frames before it still go out with the
+/// ports they were read with.
+void swapNetworkSpecs() {
+    // ports that are still there keep their deadbands going
+    for (auto &Port : NewSpecs.Ports) {
+        for (auto &Old : Specs.Ports) {
+            if (Old.Name == Port.Name) {
+                Port.LastValue = Old.LastValue;
+                Port.LastReport = Old.LastReport;
+                break;
+            }
+        }
+    }
+
+    // the UART stays at the rate that it was raised to when the board started
+    if (NewSpecs.UARTBaud != Specs.UARTBaud ||
+        NewSpecs.FlowControl != Specs.FlowControl) {
+        LOGINFO("The new UART settings are used after the next reset\r\n");
+    }
+    NewSpecs.UARTBaud = Specs.UARTBaud;
+    NewSpecs.FlowControl = Specs.FlowControl;
+
+    bool NewNetwork = NewSpecs.NetworkSSID != Specs.NetworkSSID ||
+                      NewSpecs.NetworkPassword != Specs.NetworkPassword;
+
+    Specs = move(NewSpecs);
+    ConfigPending = false;
+    LOGINFO("\r\nSending with config %lu\r\n",
+            (unsigned long)Specs.ConfigVersion);
+
+    // the server may have changed too
+    closeLinks(_parser);
+    if (NewNetwork && !OfflineMode) {
+        LOGINFO("Trying to connect to %s \r\n", Specs.NetworkSSID.c_str());
+        wifi_tries = WIFITRIES;
+        connectESPWiFi(_parser, Specs);
+    }
+}
+
+/// Fetches the config that the server has if it is a new one, and gets it
+/// ready to be swapped in. The server says which version it has in its
+/// responses. The new config is parsed off to the side in NewSpecs, and
+/// saved as the config file, while the threads keep using the old one. Then
+/// the sampling thread swaps it in between two readings, and the network
+/// thread once the first frame that was read with it comes. Runs on the
+/// network thread.
+void checkConfigVersion() {
+    uint32_t Version = getServerConfigVersion();
+    if (ConfigPending || OfflineMode || Version == 0 ||
+        Version == Specs.ConfigVersion ||
+        Kernel::get_ms_count() < ConfigRetryAt)
+        return;
+
+    LOGINFO("\r\nThe server has config %lu, fetching it\r\n",
+            (unsigned long)Version);
+    size_t Length = 0;
+    int err = fetchConfigTCP(_parser, Specs, Version, ConfigText,
+                             CONFIGFETCHMAX, Length);
+
+    bool Installed = err == NETWORKSUCCESS &&
+                     installConfigText(ConfigFileName, ConfigText, Length,
+                                       Version, NewSpecs);
+    if (!Installed) {
+        LOGWARN("Could not use config %lu, error = %d. Trying again in %d "
+                "s\r\n",
+                (unsigned long)Version, err, CONFIGRETRYMS / 1000);
+        ConfigRetryAt = Kernel::get_ms_count() + CONFIGRETRYMS;
+        return;
+    }
+
+    ConfigPending = SampleQueue.call(&swapSampleSpecs) != 0;
+    if (!ConfigPending)
+        ConfigRetryAt = Kernel::get_ms_count() + CONFIGRETRYMS;
+}
+
+/// Sends a set of port readings, or backs it up if it can't be sent. Runs on
+/// the network thread.
+void uploadFrame(const SampleFrame &Frame) {
+    applyFrame(Frame, Specs);
+
+    if (!markChanges(Specs)) {
+        // every port is inside its deadband, so the server already has it
+        LOGDEBUG("\r\nNo port changed, nothing to send\r\n");
+
+    } else if (OfflineMode) { // in offline mode, just dump data to file
+        LOGDEBUG("\r\nIn offline mode. Dumping data to file.\r\n");
+        dumpSensorDataToFile(Specs, BackupFileName);
+
+    } else if (!checkWiFi()) { // back up data if you are not connected
+        dumpSensorDataToFile(Specs, BackupFileName);
+        LOGDEBUG("\r\n Backed up Active Port data\r\n");
+        Draining = true;
+
+    } else if (checkForBackupFile(BackupFileName)) {
+        // keep the readings in order by sending the old ones first
+        dumpSensorDataToFile(Specs, BackupFileName);
+        Draining = true;
+
+    } else {
+        LOGDEBUG("\r\n Sending the last port reading to the database "
+                 "\r\n");
+        float tmp = -1.0f;
+        int wifi_err = sendBulkDataTCP(_parser, Specs, tmp);
+        updatePollingInterval(tmp);
+
+        if (wifi_err != NETWORKSUCCESS) {
+            LOGWARN("Could not send data to database, error = %d\r\n",
+                    wifi_err);
+
+            dumpSensorDataToFile(Specs, BackupFileName);
+            backOffDrain(wifi_err);
+            Draining = true;
+        }
+    }
+
+    // save backed up data that has been in RAM for too long
+    pollBackupFile(BackupFileName);
+}
+
+/// Body of the network thread. Sends the readings in Samples in order, and
+/// sends backed up data whenever no readings are waiting.
+void networkThread() {
+    while (true) {
+        NetworkBeat = Kernel::get_ms_count();
+
+        SampleFrame Frame;
+        if (Samples.pop(Frame)) {
+            PerfTimer Time(PerfCycle);
+
+            // the first frame that was read with the new config brings it in
+            if (ConfigPending && Frame.Config == NewSpecs.ConfigVersion)
+                swapNetworkSpecs();
+
+            if (Samples.size() > Samples.capacity() / 2) {
+                // the network is too slow to keep up, so back the reading up
+                // instead of sending it and let the backlog catch up later
+                applyFrame(Frame, Specs);
+                if (markChanges(Specs)) {
+                    dumpSensorDataToFile(Specs, BackupFileName);
+                    Draining = !OfflineMode;
+                }
+            } else {
+                uploadFrame(Frame);
+            }
 
-    Timer PollingTimer; // Timer that controlls when polling happens
+        } else if (Draining && Kernel::get_ms_count() >= DrainAfter) {
+            PerfTimer Time(PerfCycle);
+            drainBacklog();
+
+        } else {
+            // sleep until the sampling thread pushes a frame, or until backed
+            // up data can be sent again
+            uint32_t Wait = osWaitForever;
+            uint64_t Now = Kernel::get_ms_count();
+            if (Draining && DrainAfter > Now)
+                Wait = DrainAfter - Now;
+            NetworkFlags.wait_any(FRAMEREADY, Wait);
+            continue;
+        }
+
+        checkConfigVersion();
+    }
+}
+
+/// Reads the ports, hands the readings to the network thread and schedules
+/// the next reading. Deadlines are a fixed PollingInterval apart, so the time
+/// this takes doesn't add up over many readings.
+void sampleEvent() {
+    SampleFrame Frame;
+    {
+        PerfTimer Time(PerfSample);
+        readPorts(Port, NUMPINS, SampleSpecs, Frame);
+    }
+
+    if (Samples.push(Frame)) {
+        NetworkFlags.set(FRAMEREADY);
+    } else {
+        // the network thread has fallen behind, so don't lose the reading
+        LOGWARN("\r\nSample ring is full, backing up the reading\r\n");
+        applyFrame(Frame, SampleSpecs);
+        dumpSensorDataToFile(SampleSpecs, BackupFileName);
+    }
+
+    if (Samples.highWater() > ReportedHighWater) {
+        ReportedHighWater = Samples.highWater();
+        LOGINFO("\r\nSample ring high-water mark: %u of %u frames\r\n",
+                (unsigned)ReportedHighWater, (unsigned)Samples.capacity());
+    }
+
+    uint64_t Now = Kernel::get_ms_count();
+    uint32_t Interval = (uint32_t)(PollingInterval * 1000.0f);
+    uint32_t WatchdogTime = Interval * WATCHDOGCOEFF;
+
+    // only keep the board alive while the network thread is still running
+    if (Now - NetworkBeat < WatchdogTime)
+        resetWatchdog(watchdog, PollingInterval * WATCHDOGCOEFF);
+
+    NextSample += Interval;
+    if (NextSample <= Now) {
+        // skip the deadlines that were missed instead of reading in a burst
+        uint64_t Missed = (Now - NextSample) / Interval + 1;
+        LOGWARN("\r\nMissed %u sample deadlines\r\n", (unsigned)Missed);
+        NextSample += Missed * Interval;
+    }
+
+    SampleQueue.call_in(NextSample - Now, &sampleEvent);
+}
+
+/// Reads commands that were typed on the console: `p` prints the
+/// performance counters and `r` resets them. Runs on the main thread's
+/// EventQueue, and only reads what has already come so it never waits.
+void checkConsole() {
+    FileHandle *Console = mbed_file_handle(STDIN_FILENO);
+    char Command;
+    while (Console != NULL && Console->readable() &&
+           Console->read(&Command, 1) == 1) {
+        if (Command == 'p') {
+            printPerfCounters();
+        } else if (Command == 'r') {
+            resetPerfCounters();
+            LOGPRINT("\r\nPerformance counters reset\r\n");
+        }
+    }
+}
+
+int main() {
+    startPerfCounters();
 
     // Try to mount the filesystem
-    printf("Mounting the filesystem... ");
+    LOGINFO("Mounting the filesystem... ");
     fflush(stdout);
     int err = fs.mount(bd);
-    printf("%s\n", (err ? "Fail :(" : "OK"));
-    printf("\r\n");
+    LOGINFO("%s\n", (err ? "Fail :(" : "OK"));
+    LOGINFO("\r\n");
     if (err) {
         // Reformat if we can't mount the filesystem
         // this should only happen on the first boot
-        printf("No filesystem found, formatting... ");
+        LOGERROR("No filesystem found, formatting... ");
         fflush(stdout);
         err = fs.reformat(bd);
-        printf("%s\n", (err ? "Fail :(" : "OK"));
+        LOGERROR("%s\n", (err ? "Fail :(" : "OK"));
         if (err) {
             error("error: %s (%d)\n", strerror(-err), err);
         }
-        printf(
+        LOGERROR(
             "There is not config file since the drive was just formatted\r\n");
-        printf("Exiting\r\n");
+        LOGERROR("Exiting\r\n");
         return -1;
     }
 
-    // data is gathered from these ports/sensor pins
-    AnalogIn Port[] = {PTB2,  PTB3, PTB10, PTB11, PTC11,
-                       PTC10, PTC2, PTC0,  PTC9,  PTC8};
-    const char *config_file = "/sd/IAC_Config_File.txt";
+    UARTSerial *_serial = new UARTSerial(PTC17, PTC16, ESPBAUD);
+    _parser = new ATCmdParser(_serial);
 
-    bool OfflineMode = false; // indicates whether to actually send data or not
-
-    /// how many times to try connecting to the wifi before giving up
-    int wifi_tries = WIFITRIES;
-
-    UARTSerial *_serial = new UARTSerial(PTC17, PTC16, 115200);
-    ATCmdParser *_parser = new ATCmdParser(_serial);
-
-    _parser->debug_on(1);
+    _parser->debug_on(ATDEBUG);
     _parser->set_delimiter("\r\n");
     _parser->set_timeout(SERIALTIMEOUT);
 
-    printf("\r\nReading board settings from %s\r\n", config_file);
-    BoardSpecs Specs = readSDCard("/sd/IAC_Config_File.txt");
+    LOGINFO("\r\nReading board settings from %s\r\n", ConfigFileName);
+    Specs = readSDCard(ConfigFileName);
     // wait_us() is not deprecated, but wait() is
     wait_us(1000000);
 
+    // ports computed from power pairs don't need a pin
+    if (Specs.Ports.size() - Specs.Powers.size() * POWERQUANTITIES > NUMPINS) {
+        LOGWARN("\r\nThe board only has %u ports, the rest are ignored\r\n",
+                (unsigned)NUMPINS);
+    }
+
     // if (!checkESPWiFiConnection(_parser))
-    if (startESP(_parser) != NETWORKSUCCESS) {
+    if (setESPBaud(_parser, _serial, Specs) != NETWORKSUCCESS ||
+        startESP(_parser) != NETWORKSUCCESS) {
 
-        printf("\r\n ESP Chip was not initialized, entering offline mode\r\n");
+        LOGERROR(
+            "\r\n ESP Chip was not initialized, entering offline mode\r\n");
         OfflineMode = true;
     }
 
     // if there is no database tableName, or it is all spaces, then exit
     if (Specs.DatabaseTableName == "" || Specs.DatabaseTableName == " ") {
-        printf(
+        LOGERROR(
             "\r\n No Database Table Name Specified, Entering offline mode\r\n");
         OfflineMode = true;
     }
@@ -111,187 +570,67 @@ int main() {
     if (Specs.RemoteDir == " " || Specs.RemoteDir == "") {
         OfflineMode = true;
 
-        printf("\r\n No Remote directory specified, Entering offline mode\r\n");
+        LOGERROR(
+            "\r\n No Remote directory specified, Entering offline mode\r\n");
     }
 
     if (Specs.RemoteIP == " " || Specs.RemoteIP == "") {
         OfflineMode = true;
 
-        printf(
+        LOGERROR(
             "\r\n No Remote IP address specified, Entering offline mode\r\n");
     }
 
     if (Specs.RemotePort == 0) {
         OfflineMode = true;
 
-        printf("\r\n No Remote port specified, Entering offline mode\r\n");
+        LOGERROR("\r\n No Remote port specified, Entering offline mode\r\n");
     }
 
     if (Specs.HostName == "" || Specs.HostName == " ") {
         OfflineMode = true;
 
-        printf("\r\n No Remote Hostname found, Entering offline mode\r\n");
+        LOGERROR("\r\n No Remote Hostname found, Entering offline mode\r\n");
     }
 
-    resetWatchdog(watchdog, PollingInterval*WATCHDOGCOEFF);
+    resetWatchdog(watchdog, PollingInterval * WATCHDOGCOEFF);
 
     int wifi_err = NETWORKSUCCESS;
     if (!OfflineMode) {
-        if (!checkESPWiFiConnection(_parser)) {
-            printf("trying to connect to %s\r\n", Specs.NetworkSSID.c_str());
+        if (!wifiLinkUp(_parser)) {
+            LOGINFO("trying to connect to %s\r\n", Specs.NetworkSSID.c_str());
             wifi_err = connectESPWiFi(_parser, Specs);
         }
 
         if (wifi_err != NETWORKSUCCESS) {
-            printf("\r\n failed to connect to %s. Error code = %d \r\n",
-                   Specs.NetworkSSID.c_str(), wifi_err);
+            LOGWARN("\r\n failed to connect to %s. Error code = %d \r\n",
+                    Specs.NetworkSSID.c_str(), wifi_err);
             wifi_tries -= 1;
         } else {
-            printf(" connected to %s\r\n", Specs.NetworkSSID.c_str());
+            LOGINFO(" connected to %s\r\n", Specs.NetworkSSID.c_str());
         }
     }
 
-    // get the number of ports for the loop
-    const size_t NumPorts = Specs.Ports.size();
-
-    while (true) {
-
-        // Read all of the ports
-        for (size_t i = 0; i < NumPorts; ++i) {
-
-            // only reads the port if a port is connected
-            if (Specs.Ports[i].Multiplier != 0.0f) {
-
-                // read the port
-                Specs.Ports[i].Value =
-                    Port[i].read() * Specs.Ports[i].Multiplier;
-
-                // set error indicator if the sample is out of range
-                if (Specs.Ports[i].Value > Specs.Ports[i].RangeCeiling) {
-                    Specs.Ports[i].Value = HUGE_VAL;
-                    printf("\r\nPort value exceeded valid sample value range, "
-                           "assigning "
-                           "error value\r\n");
-                } else if (Specs.Ports[i].Value < Specs.Ports[i].RangeFloor) {
-                    Specs.Ports[i].Value = -HUGE_VAL;
-                    printf("\r\nPort value is under the valid sample range, "
-                           "assigning "
-                           "error value\r\n");
-                }
-                // print data
-                printf("\r\n%s's value = %f\r\n", Specs.Ports[i].Name.c_str(),
-                       Specs.Ports[i].Value);
-
-                resetWatchdog(watchdog, PollingInterval * WATCHDOGCOEFF);
-            }
-        }
-
-        // data will be transmitted while this timer is below the
-        // PollingInterval
-        PollingTimer.start();
-
-        // only try to send data if the wifi chip is working
-        if (!OfflineMode) {
-
-            // try to connect to wifi again if you are not connected now
-            if (!checkESPWiFiConnection(_parser)) {
-
-                printf("Trying to connect to %s \r\n",
-                       Specs.NetworkSSID.c_str());
-                wifi_err = connectESPWiFi(_parser, Specs);
-
-                if (wifi_err != NETWORKSUCCESS) {
-                    printf("Connection attempt failed error = %d\r\n",
-                           wifi_err);
-
-                    wifi_tries -= 1;
-                    if (wifi_tries <= 0) {
-
-                        printf("Wifi connection failed %d times, activating "
-                               "offline mode\r\n",
-                               WIFITRIES);
-                        OfflineMode = true;
-                    }
-
-                } else {
-                    printf("Connected to %s \r\n", Specs.NetworkSSID.c_str());
-                    wifi_tries = WIFITRIES;
-                }
-            }
-
-            // if the board is connected to the network, send data to the
-            // database
-            if (checkESPWiFiConnection(_parser)) {
-
-                // send backed up data while waiting for the polling rate to
-                // expire
-                while ((PollingTimer.read() <= PollingInterval) &&
-                       checkForBackupFile(BackupFileName)) {
-
-                    printf("\r\n Sending backed up data to the database. \r\n");
-                    float tmp = -1.0f;
-                    wifi_err =
-                        sendBackupDataTCP(_parser, Specs, BackupFileName, tmp);
-
-                    if (tmp != -1.0f && tmp > 0.0f) {
-                        PollingInterval = tmp;
-                        printf("Sample interval is now %f\r\n",
-                               PollingInterval);
-                    }
-
-                    if (wifi_err != NETWORKSUCCESS) {
-                        printf("\r\n Failed to transmit backed up data to the "
-                               "Database \r\n");
-                        printf("Error code = %d\r\n", wifi_err);
-                        break; // stop transmitting if data transmission failed.
-
-                    } else { // delete data entry if data was sent
-                        deleteDataEntry(Specs, BackupFileName);
-                    }
-                }
-
-                if (!checkForBackupFile(BackupFileName)) {
-                    printf("\r\n Sending the last port reading to the database "
-                           "\r\n");
-                    float tmp = -1;
-                    wifi_err = sendBulkDataTCP(_parser, Specs, tmp);
-
-                    if (tmp != -1.0f && tmp > 0.0f) {
-                        PollingInterval = tmp;
-                        printf("Sample interval is now %f\r\n",
-                               PollingInterval);
-                    }
-                    if (wifi_err != NETWORKSUCCESS) {
-
-                        printf(
-                            "Could not send data to database, error = %d\r\n",
-
-                            wifi_err);
-
-                        dumpSensorDataToFile(Specs, BackupFileName);
-                    }
-                } else {
-                    dumpSensorDataToFile(Specs, BackupFileName);
-                }
+    // the sampling thread gets its own copy so that the threads never share
+    // the readings
+    SampleSpecs = Specs;
 
-            } else { // back up data if you are not connected
-                dumpSensorDataToFile(Specs, BackupFileName);
-                printf("\r\n Backed up Active Port data\r\n");
-            }
+    // start sending data that was backed up before the last reset
+    Draining = !OfflineMode && checkForBackupFile(BackupFileName);
 
-        } else { // in offline mode, just dump data to file
-            printf("\r\nIn offline mode. Dumping data to file.\r\n");
-            dumpSensorDataToFile(Specs, BackupFileName);
-        }
+    // from here on, messages go through the log's ring so that the console
+    // never holds up the sampling or the network thread
+    startLogThread();
 
-        // wait until the Polling rate is up before reading again.
-        while (PollingTimer.read() <= PollingInterval) {
-        }
+    NetworkBeat = Kernel::get_ms_count();
+    NetworkThread.start(&networkThread);
 
-        // Reset Timer
-        PollingTimer.stop();
-        PollingTimer.reset();
-    }
+    // read the ports now, and then every PollingInterval seconds. The main
+    // thread sleeps in between.
+    NextSample = Kernel::get_ms_count();
+    SampleQueue.call(&sampleEvent);
+    SampleQueue.call_every(CONSOLEPOLLMS, &checkConsole);
+    SampleQueue.dispatch_forever();
 }
 /**
  * \mainpage IAC Energy Monitoring project
@@ -309,9 +648,21 @@ int main() {
  * - Networking.cpp / Networking.h -> functions related to networking
  * - BoardConfig.cpp / BoardConfig.h -> functions for getting, and holding the
  *   configuration for the board
+ * - ConfigCache.cpp / ConfigCache.h -> binary copy of the parsed configuration,
+ *   so it isn't parsed again after every reset
  * - Structs.h -> structs that contain configuration items
+ * - Sampling.cpp / Sampling.h -> functions that read the analog ports
  * - OfflineLogging.cpp / OfflineLogging.h -> functions that relate to logging
  *   and deleting data to and from a file
+ * - BacklogStore.cpp / BacklogStore.h -> the ring buffer on the SD card that
+ *   holds data that could not be sent yet
+ * - tools/decode_backlog.py -> prints the backlog file from an SD card on a PC
+ * - host/ -> builds the firmware for a PC against a simulated ESP8266, web
+ *   server and SD card
+ * - Profiling.cpp / Profiling.h -> counters that time the hot paths with the
+ *   DWT cycle counter
+ * - ConsoleLog.cpp / ConsoleLog.h -> leveled logging to the console through a
+ *   ring buffer, see \ref ConsoleLog.h
  * - debugging.h -> Macros that are meant to assist in debugging
  *
  * 
@@ -323,11 +674,27 @@ int main() {
  * - `Sensor`
  * - `Port`
  *
+ * These fields are optional:
+ * - `Upload`
+ * - `Logging`
+ * - `Power`
+ * - `UART`
+ * - `Version`
+ *
  * This is an example of filling out the `BoardInfo` field:
  * ```
  * BoardInfo:WiFi SSID,WiFi Password,Board Name
  * ```
  * To fill out a field, put the field name at the very beginning of the line, put a colon after it, and then put text after it, with subfields separated by commas.
+ * Spaces around the subfields are ignored, and lines that don't start with a letter are skipped, so `#` starts a comment and `*` turns a line off.
+ *
+ * The fields can come in any order, a `Port` line can come before the `Sensor` line that it refers to.
+ * The file is read in one pass, and a mistake is printed with its line and column, like `Config line 12, column 18: not a number: the multiplier`, and skipped.
+ * A `Sensor` line with a mistake still takes up its sensor ID, and its ports are skipped.
+ *
+ * Once the file has been read, the configuration is saved to `IAC_Config_File.txt.cache` next to it.
+ * When the board starts again, that is read instead of the text as long as the text has the same size and CRC32, so the mistakes are only printed the first time.
+ * The cache can be deleted at any time, it is made again on the next start.
  * 
  * This is an example of a board configuration:
  * ```
@@ -350,11 +717,53 @@ int main() {
  * ### ConnInfo
  * The board will try to connect to `192.168.0.3` at port `80`, with the hostname `test-server.com`, and try push a GET request to the file `sensor-readings.php` at the site root.
  *
+ * A fifth value picks how the readings are sent:
+ * ```
+ * ConnInfo:192.168.0.3,80,test-server.com,/sensor-readings.php,cbor
+ * ```
+ * `get`, or leaving it out, sends GET requests with the readings in the query string.
+ * `cbor` sends POST requests with a `application/cbor` body instead, which the server has to decode.
+ * The body is a map with these integer keys:
+ * - 0: the board's name
+ * - 1: the port table, the CRC32 (the same as zlib's `crc32()`) of the port names in order, each followed by a 0 byte
+ * - 2: an array of the port names. This is only sent until the server has answered with the port table, see below.
+ * - 3: the board's clock when the request was made, in seconds
+ * - 4: the base time, which the times of the sets are relative to
+ * - 5: an indefinite-length array of sets
+ *
+ * Each set is an array: its time minus the base time, a bit mask of the ports in the set (bit i is port i in the port table), and then one integer for each bit, lowest bit first.
+ * That integer is the difference between the bits of the port's reading, as a 32 bit float, and the bits of the port's previous reading in the same request, with 32 bit wrap-around.
+ * The first reading of each port is sent as a difference from 0.
+ *
+ * The server remembers the names it gets for each port table, and puts `porttable="xxxxxxxx"` (in hex) in its response, after `samplerate`, so the board stops sending the names.
+ * If the server gets a port table that it doesn't know without the names, it should answer `409 Conflict`, and the board sends them again.
+ * At most 64 ports can be sent this way; boards with more ports send GET requests.
+ * The host build's web server stand-in (`host/HttpStandIn.cpp`) decodes these requests.
+ *
  * ### Sensor
  * The first sensor has an id of 0, is measuring voltage, has volts as a unit, has a multiplier of 10, and has a valid range is from -20 to 20.
  *
  * The second sensor has an id of 1, is measuring voltage, has volts as a unit, has a multiplier of 1000, and has a valid range is from -50 to 50.
  *
+ * A sensor line can have two more values at the end, like this:
+ * ```
+ * Sensor:Pressure,PSIG,240,0,200,16,median
+ * ```
+ * Every reading of a port with this sensor is made from 16 ADC readings taken back to back, and the value that is reported is the middle one.
+ * The number of readings can be from 1 to 256, and the way they are combined can be `mean`, `median`, `min`, `max` or `rms`.
+ * If they are left out, one reading is taken, which is the same as `1,mean`. `median` is good for ignoring spikes.
+ * The readings of a burst are taken in well under a millisecond, so they only cover a small part of a mains cycle, and `rms` keeps the sensor's DC offset.
+ * That makes `rms` only useful for DC signals; AC current and voltage need a `Power` line, which takes its readings over whole cycles.
+ *
+ * Two more values can come after those, like this:
+ * ```
+ * Sensor:Temperature,Degree Celcius,50,0,50,16,mean,0.25,900
+ * ```
+ * A port with this sensor is only sent or logged when its value has moved more than 0.25 degrees since the last time it was sent, or when it has not been sent for 900 seconds.
+ * When none of the ports need to be sent, nothing is sent at all. 0 or leaving the values out sends every reading.
+ * The server can rebuild the full series by holding each port at the last value it received until the next one comes.
+ * A port that is missing for longer than its max silence means the board stopped sending, not that the value stayed flat.
+ *
  * The `Voltage` and `Volts` text in this case is not important. The sensor descriptions are based on that text, but no sensor readings are derived from those labels
  *
  * Sensor ID number are automatically assigned. The topmost sensor in the file has the id of 0, and the next one down has an ID of 1, and the next one has an ID of 2, and so on.
@@ -363,4 +772,77 @@ int main() {
  * The first port has the name `Voltage Port` and inherits the multipliers and valid range of its sensor id. Its sensor ID is 0 in this case.
  *
  * The second port has the name `Different Voltage Port` and inherits the multipliers and valid range of its sensor id. Its sensor ID is 1 in this case.
+ *
+ * ### Power
+ * ```
+ * Power:Main,0,1,10,60
+ * ```
+ * The port on the first `Port` line (0) measures current and the port on the second `Port` line (1) measures voltage on the same circuit.
+ * Every time the ports are read, both are sampled 32 times per cycle for 10 cycles of 60 Hz mains, and 5 more ports are reported:
+ * `Main Irms` (RMS current), `Main Vrms` (RMS voltage), `Main P` (real power), `Main S` (apparent power) and `Main PF` (power factor).
+ * Power is in the current port's unit times the voltage port's unit, so use multipliers that give amps and volts.
+ * The DC offset of both sensors is removed, so sensors that are biased to the middle of the ADC range work.
+ * The number of cycles (up to 60) and the frequency are optional and default to 10 and 60. The 2 ports are still reported on their own too.
+ * At most 20 ports are reported, computed ones included, so 2 `Power` lines fit alongside all 10 pins.
+ *
+ * ### Upload
+ * ```
+ * Upload:2048,keepalive,4
+ * ```
+ * The first value is the most bytes that the board puts in one request when it sends backed up data.
+ * The board packs as many backed up samples as fit into one request, with the time each one was taken, and only deletes them after the server responds.
+ * For GET requests, it is capped at 8000 bytes, since web servers commonly refuse longer request lines. Requests over 2048 bytes, the most the ESP8266 can send at once, are sent in several pieces, straight from the SD card.
+ * If this is 0 or the line is missing, backed up samples are sent one per request.
+ *
+ * If the second value is `keepalive`, the board sends HTTP/1.1 keep-alive requests and leaves the connection to the server open between them.
+ * If the server or the ESP8266 closes it, the board opens a new one the next time it sends something.
+ * Leaving it out opens and closes a connection for every request.
+ *
+ * The third value is how many requests with backed up data the board sends before the first one is answered, up to 4.
+ * Each one goes on its own connection, so the time the server takes to answer one overlaps with sending the others, which drains a backlog several times faster when the server is far away.
+ * The samples in a request are only deleted once it and every request before it have been answered. If one fails, the board stops sending, and the samples of that request and the ones after it are sent again later.
+ * If this is 1 or left out, requests are sent one at a time.
+ *
+ * The server's responses can use a Content-Length or chunked bodies. `samplerate="seconds"` anywhere in the body of a 2xx response sets the sample interval.
+ * When the server answers with a 5xx error, the board waits 1 second before sending backed up data again, and doubles the wait after every error in a row, up to 5 minutes.
+ * Any other 4xx error means the server refuses the requests, so the board only tries again every 5 minutes; check the ConnInfo line if this happens.
+ *
+ * ### Logging
+ * ```
+ * Logging:50,60
+ * ```
+ * Data that can not be sent is held in RAM and written to the SD card once 50 readings are waiting, or once the oldest one has waited 60 seconds, whichever comes first.
+ * It is also written out just before the watchdog resets the board. Anything still in RAM is lost if the board loses power, so smaller numbers are safer and larger numbers write to the card less often.
+ * If the line is missing, every sample is written to the card right away.
+ *
+ * ### UART
+ * ```
+ * UART:921600,rtscts
+ * ```
+ * The board talks to the ESP8266 at 115200 baud, which is about 11 KB/s and limits how fast backed up data can be sent.
+ * With this line, the board raises the rate to 921600 baud with `AT+UART_CUR` when it starts, and checks that the ESP8266 still answers.
+ * If it doesn't, the board tries half the rate, and so on down to 115200. The rate it ends up at is printed, and kept in the board's settings.
+ * If the second value is `rtscts`, the RTS (PTC18) and CTS (PTC19) lines are used for flow control above 115200, so they have to be wired to the ESP8266.
+ * The ESP8266 goes back to 115200 when it resets. If only the board resets, the board finds it at the rate it was left at.
+ *
+ * ### Version
+ * ```
+ * Version:7
+ * ```
+ * The version of this configuration, a number from 1 up. It is 0 if the line is left out.
+ * The server can hand the board a new configuration without a reset by putting `configversion="7"` in the body of its 2xx responses, after `samplerate`.
+ * When that isn't the version the board has, it sends `GET /sensor-readings.php?Board_ID=name&Config=7`, and the server answers with the whole file, at most 16 KB.
+ * The file should have the same `Version` line in it; if it doesn't, the board still takes it as version 7, and its cache keeps it as 7 across resets.
+ *
+ * The new file is saved next to the old one as `IAC_Config_File.txt.new`, read, and only put in place of the old one (along with its cache) if it has everything the board needs.
+ * Then the board switches to it between two readings: every reading is marked with the version it was read with, and the readings from before the switch are still sent or backed up with the old ports.
+ * Ports with the same name keep their deadbands going. A new WiFi network is joined right away, but a new `UART` line is only used after the next reset.
+ * If the file can't be fetched or used, the board keeps the configuration it has and asks again 5 minutes later.
+ *
+ * Performance Counters
+ * --------------------
+ * The board times reading the ports, adding readings to the backup file, reading and deleting backed up data, putting requests together, each kind of AT command, and the network thread's work for each reading.
+ * Type `p` on the console (the USB serial port) to print how many times each ran, the shortest, mean and longest time, and a histogram where bucket i counts times under 2^i microseconds. `r` sets them back to 0.
+ * Every 15 minutes, a live upload also carries them, so the server can see them from every board:
+ * GET requests get `&Perf=name:count,min,mean,max;...`, and CBOR requests get key 6, a map from each name to an array of the same 4 numbers. The times are in microseconds, and the counters keep counting from when the board started.
  */
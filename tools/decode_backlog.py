@@ -0,0 +1,131 @@
+"""
+Prints the readings in a backlog file (PortReadings.dat) from the SD card of a
+board as CSV, so cards pulled from the field can be inspected on a PC.
+
+usage: python decode_backlog.py PortReadings.dat [--all]
+
+Only the readings that have not been sent yet are printed, unless --all is
+given, in which case every slot that holds a valid record is printed.
+The layout has to match OfflineLogging/BacklogStore.h.
+"""
+
+import binascii
+import struct
+import sys
+import zlib
+
+MAGIC = 0x42434149
+VERSION = 3
+HEADER_SIZE = 512
+MAX_PORTS = 64
+
+HEADER = struct.Struct("<IHHIIIIIII")
+PORT = struct.Struct("<24s36sf")
+RECORD = struct.Struct("<I4sBBH")
+
+SET_START = 0x01
+ADC = 0x02
+
+TABLE_START = 2 * HEADER_SIZE
+DATA_START = TABLE_START + MAX_PORTS * PORT.size
+
+
+def crc32(data):
+    return zlib.crc32(data) & 0xFFFFFFFF
+
+
+def crc16(data):
+    # CRC-16/CCITT-FALSE, which is what MbedCRC<POLY_16BIT_CCITT, 16> computes
+    return binascii.crc_hqx(data, 0xFFFF)
+
+
+def read_header(data):
+    """returns the newest valid header copy as a dict, or None"""
+    best = None
+    for i in range(2):
+        raw = data[i * HEADER_SIZE:i * HEADER_SIZE + HEADER.size]
+        if len(raw) < HEADER.size:
+            continue
+        fields = HEADER.unpack(raw)
+        names = ("magic", "version", "record_size", "capacity", "head",
+                 "count", "port_count", "table_crc", "generation", "crc")
+        header = dict(zip(names, fields))
+        if (header["magic"] != MAGIC or header["version"] != VERSION or
+                header["record_size"] != RECORD.size or
+                header["crc"] != crc32(raw[:-4])):
+            continue
+        if best is None or ((header["generation"] - best["generation"]) &
+                            0xFFFFFFFF) < 0x80000000:
+            best = header
+    return best
+
+
+def read_ports(data, header):
+    size = header["port_count"] * PORT.size
+    raw = data[TABLE_START:TABLE_START + size]
+    if crc32(raw) != header["table_crc"]:
+        print("warning: port table CRC does not match", file=sys.stderr)
+    ports = []
+    for i in range(header["port_count"]):
+        name, desc, mult = PORT.unpack_from(raw, i * PORT.size)
+        ports.append((name.split(b"\0")[0].decode("ascii", "replace"),
+                      desc.split(b"\0")[0].decode("ascii", "replace"), mult))
+    return ports
+
+
+def decode_record(data, slot, ports):
+    """returns (time, port name, value, description, set start) or None"""
+    pos = DATA_START + slot * RECORD.size
+    raw = data[pos:pos + RECORD.size]
+    if len(raw) < RECORD.size:
+        return None
+    time, value, port, flags, crc = RECORD.unpack(raw)
+    if crc != crc16(raw[:-2]) or port >= len(ports):
+        return None
+    name, desc, mult = ports[port]
+    if flags & ADC:
+        value = struct.unpack("<I", value)[0] / 65535.0 * mult
+    else:
+        value = struct.unpack("<f", value)[0]
+    return time, name, value, desc, bool(flags & SET_START)
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(__doc__)
+        return 1
+
+    with open(argv[1], "rb") as f:
+        data = f.read()
+
+    header = read_header(data)
+    if header is None:
+        print("%s is not a backlog file" % argv[1], file=sys.stderr)
+        return 1
+
+    ports = read_ports(data, header)
+    print("# %d readings, head slot %d, %d ports" %
+          (header["count"], header["head"], len(ports)))
+    print("time,port,value,description")
+
+    if "--all" in argv:
+        slots = range(header["capacity"])
+    else:
+        slots = ((header["head"] + i) % header["capacity"]
+                 for i in range(header["count"]))
+
+    bad = 0
+    for slot in slots:
+        record = decode_record(data, slot, ports)
+        if record is None:
+            bad += 1
+            continue
+        print("%d,%s,%f,%s" % record[:4])
+
+    if bad and "--all" not in argv:
+        print("warning: %d records were unreadable" % bad, file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))